@@ -0,0 +1,172 @@
+#include "batch_validator.hpp"
+
+#include <string.h>
+
+/* clang-format off */
+#if defined( __x86_64__ ) || defined( __i386__ )
+#	include <immintrin.h>
+#	define HAS_X86_SIMD
+#endif
+/* clang-format on */
+
+
+// The type of an implementation of first_mismatch
+// The search starts at index start
+typedef size_t ( *mismatch_finder )( const uint64_t *const expected,
+                                     const uint64_t *const actual, const size_t start,
+                                     const size_t n, const uint64_t wildcard );
+
+
+/*********************************************************/
+/*                                                       */
+/*                    Implementations                    */
+/*                                                       */
+/*********************************************************/
+
+
+// The scalar implementation
+// The vector implementations use it to pinpoint a mismatch, and for their tails
+static size_t scalar_first_mismatch( const uint64_t *const expected,
+                                     const uint64_t *const actual, const size_t start,
+                                     const size_t n, const uint64_t wildcard ) {
+	for ( size_t i = start; i < n; ++i ) {
+		if ( ( expected[i] != actual[i] ) && ( expected[i] != wildcard ) ) {
+			return i;
+		}
+	}
+	return n;
+}
+
+#ifdef HAS_X86_SIMD
+
+// SSE2 has no 64 bit compare, so 64 bit lanes are equal if both of their halves are
+__attribute__( ( target( "sse2" ) ) ) static inline __m128i
+sse2_cmpeq_epi64( const __m128i x, const __m128i y ) {
+	const __m128i halves = _mm_cmpeq_epi32( x, y );
+	const __m128i swapped = _mm_shuffle_epi32( halves, _MM_SHUFFLE( 2, 3, 0, 1 ) );
+	return _mm_and_si128( halves, swapped );
+}
+
+// The SSE2 implementation, which checks 4 rets per iteration
+__attribute__( ( target( "sse2" ) ) ) static size_t
+sse2_first_mismatch( const uint64_t *const expected, const uint64_t *const actual,
+                     const size_t start, const size_t n, const uint64_t wildcard ) {
+	const __m128i wild = _mm_set1_epi64x( (long long) wildcard );
+	size_t i = start;
+	for ( ; i + 4 <= n; i += 4 ) {
+		const __m128i e0 = _mm_loadu_si128( (const __m128i *) &expected[i] );
+		const __m128i e1 = _mm_loadu_si128( (const __m128i *) &expected[i + 2] );
+		const __m128i a0 = _mm_loadu_si128( (const __m128i *) &actual[i] );
+		const __m128i a1 = _mm_loadu_si128( (const __m128i *) &actual[i + 2] );
+		const __m128i ok0 =
+		    _mm_or_si128( sse2_cmpeq_epi64( e0, a0 ), sse2_cmpeq_epi64( e0, wild ) );
+		const __m128i ok1 =
+		    _mm_or_si128( sse2_cmpeq_epi64( e1, a1 ), sse2_cmpeq_epi64( e1, wild ) );
+		if ( _mm_movemask_epi8( _mm_and_si128( ok0, ok1 ) ) != 0xffff ) {
+			return scalar_first_mismatch( expected, actual, i, n, wildcard );
+		}
+	}
+	return scalar_first_mismatch( expected, actual, i, n, wildcard );
+}
+
+// The AVX2 implementation, which checks 8 rets per iteration
+__attribute__( ( target( "avx2" ) ) ) static size_t
+avx2_first_mismatch( const uint64_t *const expected, const uint64_t *const actual,
+                     const size_t start, const size_t n, const uint64_t wildcard ) {
+	const __m256i wild = _mm256_set1_epi64x( (long long) wildcard );
+	size_t i = start;
+	for ( ; i + 8 <= n; i += 8 ) {
+		const __m256i e0 = _mm256_loadu_si256( (const __m256i *) &expected[i] );
+		const __m256i e1 = _mm256_loadu_si256( (const __m256i *) &expected[i + 4] );
+		const __m256i a0 = _mm256_loadu_si256( (const __m256i *) &actual[i] );
+		const __m256i a1 = _mm256_loadu_si256( (const __m256i *) &actual[i + 4] );
+		const __m256i ok0 = _mm256_or_si256( _mm256_cmpeq_epi64( e0, a0 ),
+		                                     _mm256_cmpeq_epi64( e0, wild ) );
+		const __m256i ok1 = _mm256_or_si256( _mm256_cmpeq_epi64( e1, a1 ),
+		                                     _mm256_cmpeq_epi64( e1, wild ) );
+		if ( _mm256_movemask_epi8( _mm256_and_si256( ok0, ok1 ) ) != -1 ) {
+			return scalar_first_mismatch( expected, actual, i, n, wildcard );
+		}
+	}
+	return sse2_first_mismatch( expected, actual, i, n, wildcard );
+}
+
+#endif
+
+
+/*********************************************************/
+/*                                                       */
+/*                        Dispatch                       */
+/*                                                       */
+/*********************************************************/
+
+
+// The names of the implementations, fastest first
+static const char *const finder_names[] = { "avx2", "sse2", "scalar" };
+
+// Returns the implementation called name, or nullptr if the cpu does not support it
+static mismatch_finder find_finder( const char *const name ) {
+#ifdef HAS_X86_SIMD
+	__builtin_cpu_init();
+	if ( ( strcmp( name, "avx2" ) == 0 ) && __builtin_cpu_supports( "avx2" ) ) {
+		return avx2_first_mismatch;
+	}
+	if ( ( strcmp( name, "sse2" ) == 0 ) && __builtin_cpu_supports( "sse2" ) ) {
+		return sse2_first_mismatch;
+	}
+#endif
+	if ( strcmp( name, "scalar" ) == 0 ) {
+		return scalar_first_mismatch;
+	}
+	return nullptr;
+}
+
+// The name of the implementation in use
+static const char *finder_name = "scalar";
+
+// Returns the fastest implementation the cpu supports, and notes its name
+static mismatch_finder pick_finder() {
+	for ( const char *const name : finder_names ) {
+		const mismatch_finder ret = find_finder( name );
+		if ( ret != nullptr ) {
+			finder_name = name;
+			return ret;
+		}
+	}
+	return scalar_first_mismatch;
+}
+
+// The implementation in use
+static mismatch_finder finder = pick_finder();
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Returns the index of the first ret that does not match its frame, or n if all do
+size_t BatchValidator::first_mismatch( const uint64_t *const expected,
+                                       const uint64_t *const actual, const size_t n,
+                                       const uint64_t wildcard ) {
+	return finder( expected, actual, 0, n, wildcard );
+}
+
+// Returns the name of the implementation first_mismatch uses
+const char *BatchValidator::implementation() { return finder_name; }
+
+// Make first_mismatch use the implementation called name
+// Returns false, changing nothing, if the cpu does not support it
+bool BatchValidator::use( const char *const name ) {
+	for ( const char *const known : finder_names ) {
+		const mismatch_finder found = find_finder( known );
+		if ( ( strcmp( name, known ) == 0 ) && ( found != nullptr ) ) {
+			finder = found;
+			finder_name = known;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,32 @@
+/** @file */
+#ifndef __BATCH_VALIDATOR_HPP__
+#define __BATCH_VALIDATOR_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Checks a batch of rets against the frames they return to, all at once
+ *  Only this comparison is vectorised, with AVX2 or SSE2, whichever the cpu supports,
+ *  and falls back to a scalar loop elsewhere. The choice is made once, at startup
+ *  Pairing each ret with its frame is left to the caller, and is not vectorised */
+namespace BatchValidator {
+
+	/** Returns the index of the first ret that does not match its frame, or n if all do
+	 *  The ith ret returns to actual[i], and its frame holds expected[i]
+	 *  A frame holding wildcard matches any address */
+	size_t first_mismatch( const uint64_t *const expected, const uint64_t *const actual,
+	                       const size_t n, const uint64_t wildcard );
+
+	/** Returns the name of the implementation first_mismatch uses
+	 *  One of "avx2", "sse2", or "scalar" */
+	const char *implementation();
+
+	/** Make first_mismatch use the implementation called name, as implementation()
+	 *  names it. Returns false, changing nothing, if the cpu does not support it
+	 *  Used by tests, to check every implementation the cpu supports */
+	bool use( const char *const name );
+}; // namespace BatchValidator
+
+
+#endif
@@ -7,7 +7,7 @@
 
 /*********************************************************/
 /*                                                       */
-/*                  Libraries for drrun                  */
+/*                   DynamoRIO injection                 */
 /*                                                       */
 /*********************************************************/
 
@@ -20,6 +20,12 @@
 #	define DYNAMORIO_CLIENT_SO "/path/to/.so/"
 #endif
 
+#ifndef DYNAMORIO_ROOT
+	/** The root directory of the DynamoRIO installation to inject
+	 *  This should be defined by the cmake on compilation */
+#	define DYNAMORIO_ROOT "/path/to/dynamorio/"
+#endif
+
 
 /*********************************************************/
 /*                                                       */
@@ -59,15 +65,76 @@
  *  during normal use, it is fine */
 #define WILDCARD ( -1 )
 
-/** The environment variable used to pass a string to the client
- *  The reason it is not an argument is because it is possible
- *  for a client's main function to run multiple times with the
- *  same arguments. We can change the environment between runs though! */
-#define DR_SS_ENV_SOCK "DR_SS_ENV_SOCK_VAR"
+/** The client option that is followed by the shadow stack mode */
+#define CLIENT_OPT_MODE "-mode"
+
+/** The client option that is followed by the JIT region policy */
+#define CLIENT_OPT_JIT "-jit"
+
+/** The client option that is followed by the path of the server's socket
+ *  It is omitted if the mode does not use a server */
+#define CLIENT_OPT_SOCK "-sock"
+
+/** The client option that is followed by the transport used to reach the server */
+#define CLIENT_OPT_TRANSPORT "-transport"
+
+/** The client option that is followed by the async window size
+ *  It is omitted if the mode does not use a server */
+#define CLIENT_OPT_WINDOW "-window"
+
+/** The client option that is followed by the number of frames hybrid mode keeps
+ *  in the client per thread. It is omitted unless the mode is hybrid */
+#define CLIENT_OPT_HYBRID "-hybrid"
+
+/** The client option that is followed by the longest a ret may wait for the server,
+ *  in microseconds, before its thread fails over. It is omitted if the mode does not
+ *  use a server */
+#define CLIENT_OPT_FAILOVER "-failover"
+
+/** The client option that is followed by the number of calls, rets, and signals
+ *  between digests. It is omitted if the mode does not use a server */
+#define CLIENT_OPT_DIGEST "-digest"
+
+/** The client option that is followed by the priority class of the target's threads
+ *  on the server. It is omitted if the mode does not use a server */
+#define CLIENT_OPT_QOS "-qos"
+
+/** The client option that is followed by the path statistics are written to
+ *  It is omitted unless the mode is internal and statistics were asked for */
+#define CLIENT_OPT_STATS "-stats"
+
+/** The default number of frames hybrid mode keeps in the client per thread */
+#define DEFAULT_HYBRID_WINDOW 64
+
+/** The client option that is followed by the path of the zygote's socket
+ *  It is omitted unless zygote mode is requested */
+#define CLIENT_OPT_ZYGOTE "-zygote"
 
 /** The environment variable used to store the file descriptor that
  *  links to the server. This is not closed on exec, but variables that
- *  say which fd to use are lost, so we store it in the environment */
+ *  say which fd to use are lost, so we store it in the environment.
+ *  The launcher also uses it to hand the target a channel connected before the fork;
+ *  the variables below are then empty, as nothing else about it is set up yet */
 #define DR_SS_ENV_FD "DR_SS_ENV_FD_VAR"
 
+/** The environment variable used to store the file descriptor of the shared
+ *  memory ring linking the client to the server, if the shm transport is used.
+ *  Like DR_SS_ENV_FD, this is how an exec'd image finds its channel */
+#define DR_SS_ENV_RING_FD "DR_SS_ENV_RING_FD_VAR"
+
+/** The environment variable used to store the protocol version agreed upon with
+ *  the server, if the socket transport is used. An exec'd image reuses the channel
+ *  without a new handshake, so it must learn the version from its environment */
+#define DR_SS_ENV_PROTOCOL "DR_SS_ENV_PROTOCOL_VAR"
+
+/** The environment variable used to pass the launch time to the client
+ *  It is only set when a startup profile was requested. The launch time
+ *  is a CLOCK_MONOTONIC timestamp, so it is comparable across processes */
+#define DR_SS_ENV_PROFILE "DR_SS_ENV_PROFILE_VAR"
+
+/** The environment variable used to store the file descriptor of the group's
+ *  statistics segment. The launcher sets it before anything else, and neither the
+ *  variable nor the file descriptor is lost on exec */
+#define DR_SS_ENV_STATS_FD "DR_SS_ENV_STATS_FD_VAR"
+
 #endif
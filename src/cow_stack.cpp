@@ -0,0 +1,99 @@
+#include "cow_stack.hpp"
+
+#include <string.h>
+#include <vector>
+#include <mutex>
+
+
+// The most free chunks the pool keeps
+#define CHUNK_POOL_SIZE 4096
+
+
+// The free chunks
+// Each stack keeps the last chunk it emptied, so it only takes or returns a chunk
+// when its depth moves by more than a chunk. A lock is fine
+// The pool is never freed, as stacks may release chunks while the process exits
+static std::vector<void *> &pool = *new std::vector<void *>();
+static std::mutex pool_lock;
+
+
+// Returns an unused chunk, taken from the pool if it has one
+std::shared_ptr<CowStack::Chunk> CowStack::new_chunk() {
+	Chunk *chunk = nullptr;
+	{
+		std::lock_guard<std::mutex> lock( pool_lock );
+		if ( !pool.empty() ) {
+			chunk = (Chunk *) pool.back();
+			pool.pop_back();
+		}
+	}
+	if ( chunk == nullptr ) {
+		chunk = new Chunk;
+	}
+	return std::shared_ptr<Chunk>( chunk, release );
+}
+
+// Return chunk, which no stack uses anymore, to the pool
+// If the pool is full, chunk is freed instead
+void CowStack::release( Chunk *const chunk ) {
+	chunk->below.reset();
+	{
+		std::lock_guard<std::mutex> lock( pool_lock );
+		if ( pool.size() < CHUNK_POOL_SIZE ) {
+			pool.push_back( chunk );
+			return;
+		}
+	}
+	delete chunk;
+}
+
+
+// Push value onto the stack
+void CowStack::push( const value_type value ) {
+
+	// If the top chunk is full, start a new one above it
+	if ( ( chunk == nullptr ) || ( used == chunk_size ) ) {
+		std::shared_ptr<Chunk> next =
+		    ( spare.use_count() == 1 ) ? std::move( spare ) : new_chunk();
+		spare.reset();
+		next->below = std::move( chunk );
+		chunk = std::move( next );
+		used = 0;
+	}
+
+	// If another stack shares the top chunk, copy it first
+	else if ( chunk.use_count() > 1 ) {
+		std::shared_ptr<Chunk> copy = new_chunk();
+		copy->below = chunk->below;
+		memcpy( copy->elements, chunk->elements, used * sizeof( value_type ) );
+		chunk = std::move( copy );
+	}
+
+	chunk->elements[used++] = value;
+	++total;
+}
+
+// Pop the top element
+// Popping only moves the top, so it never needs to copy a chunk
+// Chunks below the top are full, so popping an empty top chunk exposes a full one
+// The emptied chunk is kept as the spare if no other stack uses it
+void CowStack::pop() {
+	--total;
+	if ( ( --used == 0 ) && ( total > 0 ) ) {
+		std::shared_ptr<Chunk> emptied = std::move( chunk );
+		chunk = std::const_pointer_cast<Chunk>( emptied->below );
+		used = chunk_size;
+		if ( emptied.use_count() == 1 ) {
+			emptied->below.reset();
+			spare = std::move( emptied );
+		}
+	}
+}
+
+// Remove every element
+void CowStack::clear() {
+	chunk.reset();
+	spare.reset();
+	used = 0;
+	total = 0;
+}
@@ -0,0 +1,69 @@
+/** @file */
+#ifndef __COW_STACK_HPP__
+#define __COW_STACK_HPP__
+
+#include <stddef.h>
+#include <memory>
+
+
+/** A persistent stack of pointers, stored as a linked list of fixed size chunks
+ *  Copying a CowStack is O(1): the copy shares every chunk with the original.
+ *  Chunks below the top are full and never modified. A shared top chunk is
+ *  copied before it is written to, so a push after a copy costs at most one chunk.
+ *  Free chunks are pooled, so a long running server rarely allocates */
+class CowStack final {
+  public:
+	/** The type of an element */
+	typedef const char *value_type;
+
+	/** The number of elements per chunk */
+	static const constexpr size_t chunk_size = 256;
+
+	/** Returns true if the stack is empty */
+	bool empty() const { return total == 0; }
+
+	/** Returns the number of elements on the stack */
+	size_t size() const { return total; }
+
+	/** Returns the top element. The stack must not be empty */
+	value_type top() const { return chunk->elements[used - 1]; }
+
+	/** Push value onto the stack */
+	void push( const value_type value );
+
+	/** Pop the top element. The stack must not be empty */
+	void pop();
+
+	/** Remove every element */
+	void clear();
+
+  private:
+	/** A chunk of elements */
+	struct Chunk {
+		/** The chunk below this one, nullptr if this is the bottom chunk */
+		std::shared_ptr<const Chunk> below;
+		/** The elements */
+		value_type elements[chunk_size];
+	};
+
+	/** Returns an unused chunk, taken from the pool if it has one */
+	static std::shared_ptr<Chunk> new_chunk();
+
+	/** Return chunk, which no stack uses anymore, to the pool */
+	static void release( Chunk *const chunk );
+
+	/** The top chunk, nullptr if the stack has never been pushed to */
+	std::shared_ptr<Chunk> chunk;
+
+	/** An empty chunk kept for the next push that needs one, may be nullptr */
+	std::shared_ptr<Chunk> spare;
+
+	/** The number of elements of the top chunk in use */
+	size_t used = 0;
+
+	/** The number of elements on the stack */
+	size_t total = 0;
+};
+
+
+#endif
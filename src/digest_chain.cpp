@@ -0,0 +1,47 @@
+#include "digest_chain.hpp"
+#include "siphash.hpp"
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Returns the chain value of the frame addr above the chain value below
+uint64_t DigestChain::extend( const uint64_t key[2], const uint64_t below,
+                              const uint64_t addr ) {
+	return SipHash::hash( key, below, addr );
+}
+
+// Start a new epoch
+void DigestChain::start_epoch( const uint64_t new_key[2] ) {
+	key[0] = new_key[0];
+	key[1] = new_key[1];
+	frames.clear();
+}
+
+// Push the frame addr
+void DigestChain::push( const uint64_t addr ) {
+	frames.push_back( { addr, extend( key, digest(), addr ) } );
+}
+
+// Pop the top frame for a ret to target
+// The frame's chain value is recomputed from the one below, so a frame whose address was
+// overwritten is caught without waiting for the server
+DigestChain::Pop DigestChain::pop( const uint64_t target, const uint64_t wildcard ) {
+	if ( frames.empty() ) {
+		return EMPTY;
+	}
+	const Frame &top = frames.back();
+	const uint64_t below = ( frames.size() > 1 ) ? frames[frames.size() - 2].chain : 0;
+	if ( extend( key, below, top.addr ) != top.chain ) {
+		return TAMPERED;
+	}
+	if ( ( top.addr != target ) && ( top.addr != wildcard ) ) {
+		return MISMATCH;
+	}
+	frames.pop_back();
+	return POPPED;
+}
@@ -0,0 +1,71 @@
+/** @file */
+#ifndef __DIGEST_CHAIN_HPP__
+#define __DIGEST_CHAIN_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+/** The frames a digest mode thread pushed during the current epoch, chained by a keyed
+ *  hash. The chain value of a frame is the SipHash-2-4 under the epoch's key of the
+ *  chain value below it and the frame's address; the first frame of an epoch is chained
+ *  to 0. The server hands out a random key for each epoch, and chains the frames it is
+ *  sent at the end of the epoch the same way, to check them against the digest: the
+ *  chain value of the top frame */
+class DigestChain final {
+  public:
+	/** What popping a frame found */
+	enum Pop {
+		/** The frame matched, and was popped */
+		POPPED,
+		/** There was no frame to pop */
+		EMPTY,
+		/** The frame's address is neither the ret's target nor the wildcard */
+		MISMATCH,
+		/** The frame no longer matches its chain value */
+		TAMPERED
+	};
+
+	/** Returns the chain value of the frame addr, pushed above the chain value below,
+	 *  under key */
+	static uint64_t extend( const uint64_t key[2], const uint64_t below,
+	                        const uint64_t addr );
+
+	/** Start a new epoch under key, with no frames */
+	void start_epoch( const uint64_t new_key[2] );
+
+	/** Push the frame addr */
+	void push( const uint64_t addr );
+
+	/** Pop the top frame for a ret to target. A frame holding wildcard matches any target
+	 *  The frame is left in place unless this returns POPPED */
+	Pop pop( const uint64_t target, const uint64_t wildcard );
+
+	/** Returns the number of frames pushed this epoch and not popped */
+	size_t size() const { return frames.size(); }
+
+	/** Returns the address of the ith frame, bottom first */
+	const uint64_t &address( const size_t i ) const { return frames[i].addr; }
+
+	/** Returns the digest: the chain value of the top frame, 0 if there is none */
+	uint64_t digest() const { return frames.empty() ? 0 : frames.back().chain; }
+
+  private:
+	/** A frame and its chain value */
+	struct Frame {
+		/** The address the frame returns to */
+		uint64_t addr;
+		/** The chain value of the frame */
+		uint64_t chain;
+	};
+
+	/** The frames, top last */
+	std::vector<Frame> frames;
+
+	/** The key of the current epoch */
+	uint64_t key[2] = { 0, 0 };
+};
+
+
+#endif
@@ -1,17 +1,416 @@
 #include "dr_shadow_stack_client.hpp"
 #include "dr_external_ss_events.hpp"
+#include "dr_print_sym.hpp"
 #include "quick_socket.hpp"
+#include "dr_tls.hpp"
+#include "digest_chain.hpp"
 #include "utilities.hpp"
 #include "constants.hpp"
+#include "shm_ring.hpp"
+#include "qos_class.hpp"
+#include "protocol.hpp"
 #include "message.hpp"
+#include "group.hpp"
 
 #include "drmgr.h"
 
+#include <sys/random.h>
 #include <syscall.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 
-// The socket to be used by this client
-static int sock = -1;
+// Older C libraries do not name clone3, whose number is the same on every architecture
+#ifndef SYS_clone3
+#	define SYS_clone3 435
+#endif
+
+// The largest async window allowed with the socket transport
+// Every unreceived Continue is queued by the server; once too many are, the server
+// stops receiving, and the client blocks sending
+#define MAX_SOCKET_WINDOW 64
+
+// The number of bytes a thread's batch holds
+#define BATCH_SIZE 1024
+
+// Enough room for one message of any protocol version
+// A batch is flushed once it has less room than this left
+#define MAX_BATCHED_SIZE ( MESSAGE_SIZE + MAX_FRAME_SIZE )
+
+// The number of rets a failed over thread verifies between probes of the server
+#define FAILOVER_PROBE_INTERVAL 4096
+
+
+// The path of the server's socket
+static std::string server_path;
+
+// True if messages are sent over a shared memory ring instead of a socket
+static bool use_ring = false;
+
+// True if the server is reached over TCP, in which case server_path is its address
+static bool use_tcp = false;
+
+// The number of rets the server may still be verifying while the client runs on
+// If 0, every ret waits for the server
+static unsigned int window = 0;
+
+// The number of frames at the top of each thread's shadow stack the client keeps
+// The rest are spilled to the server. If 0, every frame is kept by the server
+// With failover, this is the number of frames a failed over thread keeps
+static unsigned int hybrid_window = 0;
+
+// The longest a ret may wait for the server, in microseconds, 0 unless failover is on
+// A thread whose ret waits longer verifies its rets itself until the server catches up
+static unsigned long failover_slo = 0;
+
+// The number of calls, rets, and signals between digests, 0 unless this is digest mode
+// A digest mode thread keeps the frames it pushes during an epoch itself, and verifies
+// the rets into them; the rets past them are sent to the server, which never answers
+// them. At the end of each epoch, and before any sensitive syscall, the frames left are
+// sent along with their digest, which the server checks and answers with the next key
+static unsigned int digest_interval = 0;
+
+// The number of the priority class each thread asks the server for
+// Unless it is the default class, which the server assumes, it is sent when a thread
+// connects
+static unsigned int qos_level = 0;
+static bool send_qos = false;
+
+// True until a thread has taken the channel the image inherited, if any
+static std::atomic<bool> inherited_channel( false );
+
+// Messages the server does not reply to, waiting to be sent over a socket
+// They are sent in the same write as the next ret, or once the batch is full
+struct Batch {
+	/** The number of bytes in the batch */
+	size_t length = 0;
+	/** The last address encoded, v2 addresses are encoded relative to it */
+	uint64_t prev = 0;
+	/** The encoded messages */
+	char buffer[BATCH_SIZE];
+};
+
+// Entries of an environment that were replaced, each with its value before
+typedef std::vector<std::pair<const char **, const char *>> ReplacedEnv;
+
+// A thread's channel to the server
+// Each thread has its own, so the server keeps a shadow stack per thread
+struct Channel {
+	/** The channel's socket */
+	int sock = -1;
+	/** The protocol version spoken over sock */
+	uintptr_t protocol = PROTOCOL_V1;
+	/** The shared memory ring, nullptr unless use_ring is true */
+	ShmRing *ring = nullptr;
+	/** The ring's file descriptor */
+	int ring_fd = -1;
+	/** The number of rets pushed onto the ring so far */
+	uint32_t rets_pushed = 0;
+	/** The number of rets sent over sock whose Continue has not yet been received */
+	unsigned int unacked = 0;
+	/** Messages waiting to be sent over sock */
+	Batch batch;
+	/** The token of the fork in progress, 0 if there is none */
+	uintptr_t fork_token = 0;
+	/** The environment entries the execve in progress replaced, and their values
+	 *  before. They are given back if the execve fails */
+	ReplacedEnv exec_env;
+	/** Hybrid mode only: the top frames of the thread's shadow stack, top last */
+	std::vector<app_pc> hot;
+	/** Hybrid mode only: true while the frames of a fill are owed by the server */
+	bool fill_owed = false;
+	/** Hybrid mode only: the most frames the fill owed may hold */
+	uintptr_t fill_wanted = 0;
+	/** Failover only: true while the thread verifies its rets itself, using hot */
+	bool local = false;
+	/** Failover only: the number of rets verified since the server was last probed */
+	unsigned int local_rets = 0;
+	/** Failover only: the number of times the thread failed over, and recovered */
+	unsigned long failovers = 0;
+	unsigned long recoveries = 0;
+	/** Digest mode only: the frames pushed this epoch, chained under its key */
+	DigestChain chain;
+	/** Digest mode only: the number of calls, rets, and signals this epoch */
+	unsigned int events = 0;
+};
+
+// Each thread's channel
+static TLS<Channel> *channels = nullptr;
+
+
+/*********************************************************/
+/*                                                       */
+/*                        Channel                        */
+/*                                                       */
+/*********************************************************/
+
+
+// Writes the channel's batch in a single syscall
+static void flush_batch( Channel &ch ) {
+	if ( ch.batch.length > 0 ) {
+		const ssize_t bytes_sent = write( ch.sock, ch.batch.buffer, ch.batch.length );
+		Utilities::assert( bytes_sent == (ssize_t) ch.batch.length, "write() failed!" );
+		ch.batch.length = 0;
+	}
+}
+
+// Appends the message Msg with body bdy to the channel's batch
+// The message is encoded in the channel's protocol
+template <typename Msg>
+static inline void add_to_batch( Channel &ch, const char *const bdy ) {
+	char *const dst = &ch.batch.buffer[ch.batch.length];
+	if ( ch.protocol == PROTOCOL_V1 ) {
+		memcpy( dst, Msg( bdy ).message, MESSAGE_SIZE );
+		ch.batch.length += MESSAGE_SIZE;
+	}
+	else {
+		uintptr_t body;
+		memcpy( &body, bdy, POINTER_SIZE );
+		const Protocol::Opcode op = Protocol::opcode_of<Msg>();
+		uint64_t base = 0;
+		uint64_t &prev = Protocol::has_address( op ) ? ch.batch.prev : base;
+		ch.batch.length += Protocol::encode( dst, op, body, prev );
+	}
+}
+
+// Appends the header only message Msg to the channel's batch
+// The message is encoded in the channel's protocol
+template <typename Msg> static inline void add_to_batch( Channel &ch ) {
+	char *const dst = &ch.batch.buffer[ch.batch.length];
+	if ( ch.protocol == PROTOCOL_V1 ) {
+		memcpy( dst, Msg::message, MESSAGE_SIZE );
+		ch.batch.length += MESSAGE_SIZE;
+	}
+	else {
+		ch.batch.length += Protocol::encode( dst, Protocol::opcode_of<Msg>() );
+	}
+}
+
+// Flushes the channel's batch if another message may not fit in it
+static inline void flush_if_full( Channel &ch ) {
+	if ( ch.batch.length > BATCH_SIZE - MAX_BATCHED_SIZE ) {
+		flush_batch( ch );
+	}
+}
+
+// Pushes the message msg onto the channel's ring
+// If the server parked the ring, its doorbell is rung so it pops msg; should that fail,
+// the server finds the channel closed, and handles what was pushed before it exits
+static inline void push_to_ring( Channel &ch, const char *const msg ) {
+	if ( ch.ring->push( msg ) ) {
+		const char bell = 0;
+		(void) send( ch.sock, &bell, sizeof( bell ), MSG_DONTWAIT | MSG_NOSIGNAL );
+	}
+}
+
+// Sends the message Msg with body bdy to the server
+// Over a socket, the message is batched until the next ret
+template <typename Msg>
+static inline void send_to_server( Channel &ch, const char *const bdy ) {
+	if ( ch.ring != nullptr ) {
+		push_to_ring( ch, Msg( bdy ).message );
+	}
+	else {
+		add_to_batch<Msg>( ch, bdy );
+		flush_if_full( ch );
+	}
+}
+
+// Sends the header only message Msg to the server
+// Over a socket, the message is batched until the next ret
+template <typename Msg> static inline void send_to_server( Channel &ch ) {
+	if ( ch.ring != nullptr ) {
+		push_to_ring( ch, Msg::message );
+	}
+	else {
+		add_to_batch<Msg>( ch );
+		flush_if_full( ch );
+	}
+}
+
+// Sends the ret message with body bdy to the server, along with the current batch
+static inline void send_ret_to_server( Channel &ch, const char *const bdy ) {
+	if ( ch.ring != nullptr ) {
+		push_to_ring( ch, Message::Ret( bdy ).message );
+	}
+	else {
+		add_to_batch<Message::Ret>( ch, bdy );
+		flush_batch( ch );
+	}
+}
+
+// Sends the channel's batch to the server
+static inline void flush_to_server( Channel &ch ) {
+	if ( ch.ring == nullptr ) {
+		flush_batch( ch );
+	}
+}
+
+// Waits until at most allowed rets sent are unacknowledged by the server
+static inline void wait_for_acks( Channel &ch, const unsigned int allowed ) {
+	if ( ch.ring != nullptr ) {
+		if ( ch.rets_pushed - ch.ring->acked() > allowed ) {
+			ch.ring->wait_for_acks( ch.rets_pushed - allowed );
+		}
+	}
+	else if ( ch.protocol == PROTOCOL_V1 ) {
+		for ( ; ch.unacked > allowed; --ch.unacked ) {
+			recv_msg<Message::Continue>( ch.sock );
+		}
+	}
+
+	// v2 Continue frames are single bytes, so receive them all at once
+	else if ( ch.unacked > allowed ) {
+		char conts[MAX_SOCKET_WINDOW + 1];
+		const int n = (int) ( ch.unacked - allowed );
+		Utilities::assert( recv( ch.sock, conts, n, MSG_WAITALL ) == n,
+		                   "Did not get all Continue messages!" );
+		for ( int i = 0; i < n; ++i ) {
+			Utilities::assert( conts[i] == (char) Protocol::CONTINUE,
+			                   "Received incorrect message!" );
+		}
+		ch.unacked = allowed;
+	}
+}
+
+// Notes that a ret was sent, then waits until the window allows the client to proceed
+static inline void wait_for_continue( Channel &ch ) {
+	if ( ch.ring != nullptr ) {
+		++ch.rets_pushed;
+	}
+	else {
+		++ch.unacked;
+	}
+	wait_for_acks( ch, window );
+}
+
+// Reads the number stored in the environment variable name
+static unsigned long get_env_num( const char *const name ) {
+	const char *const str = getenv( name );
+	Utilities::assert( str != nullptr, "getenv() failed." );
+	return std::stoul( std::string( str ) );
+}
+
+// Agree on a protocol version with the server
+static void say_hello( Channel &ch ) {
+	const uintptr_t latest = PROTOCOL_LATEST;
+	send_msg<Message::Hello>( ch.sock, (const char *) &latest );
+	char reply[Message::Hello::size];
+	recv_msg_and_body<Message::Hello>( ch.sock, reply );
+	ch.protocol = Message::body_of( reply );
+	Utilities::assert( ( ch.protocol == PROTOCOL_V1 ) || ( ch.protocol == PROTOCOL_V2 ),
+	                   "Server chose an unknown protocol version" );
+	Utilities::log( "Speaking protocol version ", ch.protocol, " with the server" );
+}
+
+// Maps the ring stored in fd and starts sending messages over it
+// Every ret sent so far was acknowledged, so continue counting from there
+static void attach_ring( Channel &ch, const int fd ) {
+	ch.ring_fd = fd;
+	ch.ring = new ShmRing( ch.ring_fd );
+	ch.rets_pushed = ch.ring->acked();
+	Utilities::log( "Sending messages over the shared memory ring on fd ", ch.ring_fd );
+}
+
+// Tell the server which thread the channel belongs to, and its priority class
+// The server puts channels in the default class unless told otherwise
+static void send_thread_id( Channel &ch ) {
+	const uintptr_t tid = (uintptr_t) Utilities::get_tid();
+	send_to_server<Message::Thread>( ch, (const char *) &tid );
+	if ( send_qos ) {
+		const uintptr_t level = qos_level;
+		send_to_server<Message::Priority>( ch, (const char *) &level );
+	}
+}
+
+// Set up the channel, whose socket was just connected to the server
+// If the shm transport is used, the server sends the ring right after connecting
+// Otherwise, the protocol version is agreed upon first
+static void open_channel( Channel &ch ) {
+	ch.unacked = 0;
+	ch.batch.length = 0;
+	ch.batch.prev = 0;
+	if ( use_ring ) {
+		attach_ring( ch, QS::recv_fd( ch.sock ) );
+	}
+	else {
+		say_hello( ch );
+	}
+	send_thread_id( ch );
+}
+
+// Connect a new channel to the server
+static void connect_channel( Channel &ch ) {
+	Utilities::log( "Client connecting to ", server_path );
+	ch.sock = use_tcp ? QS::create_tcp_client( server_path.c_str() )
+	                  : QS::create_client( server_path.c_str() );
+	open_channel( ch );
+}
+
+// Returns true if the environment variable name is set to the empty string
+static bool is_env_empty( const char *const name ) {
+	const char *const str = getenv( name );
+	Utilities::assert( str != nullptr, "getenv() failed." );
+	return str[0] == (char) 0;
+}
+
+// Take over the channel the image inherited
+// The launcher connects the first image's initial thread before starting it, but sets
+// nothing else up; an exec'd image inherits a channel that was fully set up
+static void inherit_channel( Channel &ch ) {
+	ch.sock = (int) get_env_num( DR_SS_ENV_FD );
+	Utilities::log( "Existing socket connected detected: ", server_path,
+	                "\n\t- Using file descriptor ", ch.sock,
+	                " as socket fd, as it is already connected..." );
+	fcntl( ch.sock, F_SETFD, FD_CLOEXEC );
+	if ( is_env_empty( use_ring ? DR_SS_ENV_RING_FD : DR_SS_ENV_PROTOCOL ) ) {
+		open_channel( ch );
+		return;
+	}
+
+	// The ring or the protocol version is inherited as well
+	if ( use_ring ) {
+		attach_ring( ch, (int) get_env_num( DR_SS_ENV_RING_FD ) );
+	}
+	else {
+		ch.protocol = get_env_num( DR_SS_ENV_PROTOCOL );
+	}
+
+	// Inherited descriptors are not passed on again unless this image execs
+	if ( use_ring ) {
+		fcntl( ch.ring_fd, F_SETFD, FD_CLOEXEC );
+	}
+
+	// The image that exec'd this one left its stack on the server in case the execve
+	// failed. Execve is sensitive, so that image was owed nothing when it exec'd
+	// The server encodes addresses from scratch after Execve, as does this image
+	send_to_server<Message::Execve>( ch );
+}
+
+// Close the channel
+static void close_channel( Channel &ch ) {
+	if ( ch.ring != nullptr ) {
+		delete ch.ring;
+		ch.ring = nullptr;
+		close( ch.ring_fd );
+	}
+	close( ch.sock );
+	ch.sock = -1;
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                        Handlers                       */
+/*                                                       */
+/*********************************************************/
 
 
 // The call handler.
@@ -19,7 +418,7 @@ static int sock = -1;
 // to execute. This function is static for optimization reasons */
 static void on_call( const app_pc ret_to_addr ) {
 	Utilities::verbose_log( "(client) Call @ ", (void *) ret_to_addr, " - 0x5" );
-	send_msg<Message::Call>( sock, (char *) &ret_to_addr );
+	send_to_server<Message::Call>( channels->get(), (char *) &ret_to_addr );
 }
 
 // The ret handler.
@@ -27,14 +426,337 @@ static void on_call( const app_pc ret_to_addr ) {
 // to execute. This function is static for optimization reasons */
 static void on_ret( const app_pc, const app_pc target_addr ) {
 	Utilities::verbose_log( "(client) Ret to ", (void *) target_addr );
-	send_msg<Message::Ret>( sock, (char *) &target_addr );
-	(void) recv_msg<Message::Continue>( sock );
+	Channel &ch = channels->get();
+	send_ret_to_server( ch, (char *) &target_addr );
+	wait_for_continue( ch );
 }
 
 // Called whenever a signal is called. Adds a wildcard to the shadow stack
 // Note: the reason we use this instead of the signal event is this ignores ignored
 // signals
-static void on_signal() { send_msg<Message::NewSignal>( sock ); }
+static void on_signal() { send_to_server<Message::NewSignal>( channels->get() ); }
+
+
+/*********************************************************/
+/*                                                       */
+/*                      Hybrid mode                      */
+/*                                                       */
+/*********************************************************/
+
+
+// Called when a ret does not match the top of the shadow stack, or the stack is empty
+// top is nullptr if the stack is empty
+[[noreturn]] static void hybrid_mismatch( const app_pc top, const app_pc target_addr ) {
+	TerminateOnDestruction tod;
+	if ( top == nullptr ) {
+		Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
+		                      "Attempting to return to ",
+		                      (void *) target_addr, "\n\tShadow stack is empty!\n" );
+	}
+	else {
+		Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
+		                      "Attempting to return to ",
+		                      (void *) target_addr, "\n\tTop of shadow stack is ",
+		                      (void *) top, '\n' );
+		Sym::print( "top of shadow stack", top );
+	}
+	Sym::print( "return address", target_addr );
+	Group::terminate( nullptr );
+}
+
+// Returns true if sock has something to receive within timeout microseconds
+static bool readable_within( const int sock, const unsigned long timeout ) {
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	const struct timespec ts = { (time_t)( timeout / 1000000 ),
+		                         (long) ( timeout % 1000000 ) * 1000 };
+	int ret;
+	do {
+		ret = ppoll( &pfd, 1, &ts, nullptr );
+	} while ( ( ret == -1 ) && ( errno == EINTR ) );
+	Utilities::assert( ret != -1, "ppoll() failed." );
+	return ret > 0;
+}
+
+// Ask the server for up to wanted of the frames spilled to it
+// The server only answers once every Continue it owes was received, so they are
+// received first. The frames are received by receive_fill
+static void request_fill( Channel &ch, const uintptr_t wanted ) {
+	wait_for_acks( ch, 0 );
+	send_to_server<Message::Fill>( ch, (const char *) &wanted );
+	flush_to_server( ch );
+	ch.fill_wanted = wanted;
+	ch.fill_owed = true;
+}
+
+// Receive the frames of the fill owed, and put them below the frames the client keeps
+// Unless wait is true, gives up if the server has not started answering within timeout
+// microseconds. Returns false if the fill is still owed
+static bool receive_fill( Channel &ch, const bool wait,
+                          const unsigned long timeout = 0 ) {
+	if ( !wait && !readable_within( ch.sock, timeout ) ) {
+		return false;
+	}
+	uintptr_t n;
+	Utilities::assert( recv( ch.sock, &n, sizeof( n ), MSG_WAITALL ) == sizeof( n ),
+	                   "Did not get the number of frames!" );
+	n = Message::wire_order( n );
+	Utilities::assert( n <= ch.fill_wanted, "Server sent more frames than asked for" );
+	ch.hot.insert( ch.hot.begin(), n, nullptr );
+	const ssize_t bytes = (ssize_t)( n * sizeof( app_pc ) );
+	Utilities::assert( recv( ch.sock, ch.hot.data(), bytes, MSG_WAITALL ) == bytes,
+	                   "Did not get every frame!" );
+	for ( uintptr_t i = 0; i < n; ++i ) {
+		ch.hot[i] = (app_pc) Message::wire_order( (uintptr_t) ch.hot[i] );
+	}
+	std::reverse( ch.hot.begin(), ch.hot.begin() + n );
+	ch.fill_owed = false;
+	Utilities::verbose_log( "(client) Filled ", n, " frames" );
+	return true;
+}
+
+// Spill the bottom frames the client keeps to the server, keeping half a window
+// They are batched like any call, so spilling costs no round trip
+// The frames of a fill owed go below the client's, so they are received first
+static void spill( Channel &ch ) {
+	if ( ch.fill_owed ) {
+		receive_fill( ch, true );
+	}
+	const size_t n = ch.hot.size() - ( hybrid_window - hybrid_window / 2 );
+	Utilities::verbose_log( "(client) Spilling ", n, " frames" );
+	for ( size_t i = 0; i < n; ++i ) {
+		send_to_server<Message::Call>( ch, (char *) &ch.hot[i] );
+	}
+	ch.hot.erase( ch.hot.begin(), ch.hot.begin() + n );
+}
+
+// Fetch back up to half a window of the frames spilled to the server, unless a fill
+// is already owed, then wait for them
+// Fetches nothing if no frame was spilled
+static void fill( Channel &ch ) {
+	if ( !ch.fill_owed ) {
+		request_fill( ch, hybrid_window / 2 );
+	}
+	receive_fill( ch, true );
+}
+
+// The hybrid mode call handler
+// The frame is kept by the client; if the client's frames are full, half are spilled
+static void hybrid_on_call( const app_pc ret_to_addr ) {
+	Utilities::verbose_log( "(client) Call @ ", (void *) ret_to_addr );
+	Channel &ch = channels->get();
+	if ( ch.hot.size() >= hybrid_window ) {
+		spill( ch );
+	}
+	ch.hot.push_back( ret_to_addr );
+}
+
+// The hybrid mode ret handler
+// Most rets match a frame the client keeps, and are verified without the server
+// A ret past the frames the client keeps fetches spilled frames back first
+static void hybrid_on_ret( const app_pc, const app_pc target_addr ) {
+	Utilities::verbose_log( "(client) Ret to ", (void *) target_addr );
+	Channel &ch = channels->get();
+	if ( ch.hot.empty() ) {
+		fill( ch );
+		if ( ch.hot.empty() ) {
+			hybrid_mismatch( nullptr, target_addr );
+		}
+	}
+	const app_pc top = ch.hot.back();
+	if ( ( top != target_addr ) && ( top != (app_pc) WILDCARD ) ) {
+		hybrid_mismatch( top, target_addr );
+	}
+	ch.hot.pop_back();
+}
+
+// Called whenever a signal is called. Adds a wildcard to the shadow stack
+static void hybrid_on_signal() { hybrid_on_call( (app_pc) WILDCARD ); }
+
+
+/*********************************************************/
+/*                                                       */
+/*                        Failover                       */
+/*                                                       */
+/*********************************************************/
+
+
+// Returns the time in microseconds since an arbitrary point
+static inline unsigned long now_us() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long) ts.tv_sec * 1000000 + (unsigned long) ts.tv_nsec / 1000;
+}
+
+// Have the thread verify its rets itself, as hybrid mode does, after a ret waited
+// waited microseconds. The top of the server's stack seeds the client's frames; the
+// thread waits for it no longer than a ret may wait. If it comes later, it is received
+// once a ret, a spill, or a syscall needs it
+// Continues still owed, which only an async window leaves, must be received before a
+// fill is sent, so then the first ret past the client's frames fetches them instead
+static void fail_over( Channel &ch, const unsigned long waited ) {
+	ch.local = true;
+	ch.local_rets = 0;
+	++ch.failovers;
+	Utilities::log( "Thread ", Utilities::get_tid(), " waited ", waited,
+	                "us for a ret to be verified, verifying its rets locally" );
+	const bool acked = ( ch.ring != nullptr ) ? ( ch.ring->acked() == ch.rets_pushed )
+	                                          : ( ch.unacked == 0 );
+	if ( acked ) {
+		request_fill( ch, hybrid_window / 2 );
+		(void) receive_fill( ch, false, failover_slo );
+	}
+}
+
+// Hand the thread's rets back to the server, which answered a probe in rtt microseconds
+// The frames the client keeps are batched as calls, bottom first, so the server's stack
+// becomes the thread's whole stack again
+static void recover( Channel &ch, const unsigned long rtt ) {
+	for ( const app_pc frame : ch.hot ) {
+		send_to_server<Message::Call>( ch, (const char *) &frame );
+	}
+	ch.hot.clear();
+	ch.local = false;
+	++ch.recoveries;
+	Utilities::log( "Thread ", Utilities::get_tid(), " reached the server in ", rtt,
+	                "us, the server verifies its rets again" );
+}
+
+// Returns true if the server answered an empty fill within half the limit, and stores
+// how long it took, in microseconds, in rtt
+// The fill pops nothing, so it only measures the server's responsiveness. A fill still
+// owed means the server is slow; so does a late answer, which is then still owed
+static bool probe( Channel &ch, unsigned long &rtt ) {
+	if ( ch.fill_owed && !receive_fill( ch, false ) ) {
+		return false;
+	}
+	const unsigned long start = now_us();
+	request_fill( ch, 0 );
+	if ( !receive_fill( ch, false, failover_slo / 2 ) ) {
+		return false;
+	}
+	rtt = now_us() - start;
+	return true;
+}
+
+// The failover call handler
+static void failover_on_call( const app_pc ret_to_addr ) {
+	if ( channels->get().local ) {
+		hybrid_on_call( ret_to_addr );
+	}
+	else {
+		on_call( ret_to_addr );
+	}
+}
+
+// The failover ret handler
+// A ret the server takes too long to verify fails the thread over; a failed over thread
+// probes the server every so often, and recovers once the server answers well within
+// the limit, so a server that is only just fast enough is not switched back and forth
+static void failover_on_ret( const app_pc from, const app_pc target_addr ) {
+	Channel &ch = channels->get();
+	if ( ch.local ) {
+		hybrid_on_ret( from, target_addr );
+		if ( ++ch.local_rets == FAILOVER_PROBE_INTERVAL ) {
+			ch.local_rets = 0;
+			unsigned long rtt;
+			if ( probe( ch, rtt ) ) {
+				recover( ch, rtt );
+			}
+		}
+		return;
+	}
+	const unsigned long start = now_us();
+	on_ret( from, target_addr );
+	const unsigned long waited = now_us() - start;
+	if ( waited > failover_slo ) {
+		fail_over( ch, waited );
+	}
+}
+
+// Called whenever a signal is called. Adds a wildcard to the shadow stack
+static void failover_on_signal() {
+	if ( channels->get().local ) {
+		hybrid_on_signal();
+	}
+	else {
+		on_signal();
+	}
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                      Digest mode                      */
+/*                                                       */
+/*********************************************************/
+
+
+// End the channel's epoch: send the frames left, bottom first, then their digest, and
+// start the next epoch under the key the server answers with
+// The server only answers once it chained the frames to the same digest; otherwise it
+// kills the group. The frames are then the server's, as calls are in external mode
+static void send_digest( Channel &ch ) {
+	for ( size_t i = 0; i < ch.chain.size(); ++i ) {
+		const uintptr_t addr = (uintptr_t) ch.chain.address( i );
+		send_to_server<Message::Call>( ch, (const char *) &addr );
+	}
+	const uintptr_t digest = (uintptr_t) ch.chain.digest();
+	send_to_server<Message::Digest>( ch, (const char *) &digest );
+	flush_to_server( ch );
+	uint64_t key[2];
+	Utilities::assert( recv( ch.sock, key, sizeof( key ), MSG_WAITALL ) == sizeof( key ),
+	                   "Did not get the next epoch's key!" );
+	key[0] = le64toh( key[0] );
+	key[1] = le64toh( key[1] );
+	ch.chain.start_epoch( key );
+	ch.events = 0;
+}
+
+// Note an event of the channel's epoch, and end the epoch once it had enough
+static inline void count_event( Channel &ch ) {
+	if ( ++ch.events >= digest_interval ) {
+		send_digest( ch );
+	}
+}
+
+// The digest mode call handler
+// The frame is kept by the client until the end of the epoch
+static void digest_on_call( const app_pc ret_to_addr ) {
+	Utilities::verbose_log( "(client) Call @ ", (void *) ret_to_addr );
+	Channel &ch = channels->get();
+	ch.chain.push( (uint64_t) ret_to_addr );
+	count_event( ch );
+}
+
+// The digest mode ret handler
+// A ret into a frame of this epoch is verified by the client, which also checks the
+// frame against its chain value. A ret past them is batched for the server to verify;
+// it does not wait for the server, which kills the group if the ret is wrong
+static void digest_on_ret( const app_pc, const app_pc target_addr ) {
+	Utilities::verbose_log( "(client) Ret to ", (void *) target_addr );
+	Channel &ch = channels->get();
+	switch ( ch.chain.pop( (uint64_t) target_addr, (uint64_t) WILDCARD ) ) {
+		case DigestChain::EMPTY:
+			send_to_server<Message::Ret>( ch, (const char *) &target_addr );
+			break;
+		case DigestChain::MISMATCH:
+			hybrid_mismatch( (app_pc) ch.chain.address( ch.chain.size() - 1 ),
+			                 target_addr );
+		case DigestChain::TAMPERED:
+			Group::terminate( "*** Shadow stack tampering detected! ***\n"
+			                  "The top frame does not match its chain value" );
+		default:
+			break;
+	}
+	count_event( ch );
+}
+
+// Called whenever a signal is called. Adds a wildcard to the shadow stack
+static void digest_on_signal() {
+	Channel &ch = channels->get();
+	ch.chain.push( (uint64_t) WILDCARD );
+	count_event( ch );
+}
 
 
 /*********************************************************/
@@ -44,60 +766,247 @@ static void on_signal() { send_msg<Message::NewSignal>( sock ); }
 /*********************************************************/
 
 
-// This function dictates what syscall is interesting
-static bool syscall_filter( void *, int sysnum ) {
+// Returns true if sysnum has effects outside of the process which must not happen
+// until every ret before it has been verified. Only used with an async window or digests
+static bool is_sensitive_syscall( const int sysnum ) {
 	switch ( sysnum ) {
-		/* case SYS_fork: */
-		/* case SYS_vfork: */
-		/* case SYS_clone: */
 		case SYS_execve:
+		case SYS_execveat:
+		case SYS_exit_group:
+		case SYS_fork:
+		case SYS_vfork:
+		case SYS_clone:
+		case SYS_clone3:
+		case SYS_kill:
+		case SYS_tkill:
+		case SYS_tgkill:
+		case SYS_ptrace:
+		case SYS_mmap:
+		case SYS_mprotect:
+		case SYS_mremap:
+		case SYS_open:
+		case SYS_openat:
+		case SYS_creat:
+		case SYS_unlink:
+		case SYS_unlinkat:
+		case SYS_rename:
+		case SYS_renameat:
+		case SYS_chmod:
+		case SYS_fchmod:
+		case SYS_chown:
+		case SYS_fchown:
+		case SYS_setuid:
+		case SYS_setgid:
+		case SYS_write:
+		case SYS_writev:
+		case SYS_pwrite64:
+		case SYS_pwritev:
+		case SYS_sendto:
+		case SYS_sendmsg:
+		case SYS_sendmmsg:
+		case SYS_connect:
 			return true;
 		default:
 			return false;
 	};
 }
 
-// Called before execve is called
-static inline void on_execve( void *drcontext, bool ) {
-
-	// Send the execve message
-	send_msg<Message::Execve>( sock );
+// This function dictates what syscall is interesting
+static bool syscall_filter( void *, int sysnum ) {
+	switch ( sysnum ) {
+		case SYS_fork:
+		case SYS_clone:
+		case SYS_clone3:
+		case SYS_execve:
+		case SYS_execveat:
+			return true;
+		default:
+			return ( ( window > 0 ) || ( digest_interval > 0 ) ) &&
+			       is_sensitive_syscall( sysnum );
+	};
+}
 
-	// Get the enviornment
-	const char **const env = (const char **) dr_syscall_get_param( drcontext, 2 );
+// Replace the value of the variable name in the environment env with value
+// The entry replaced and its value before are added to replaced
+static void replace_env_var( const char **const env, const char *const name,
+                             const unsigned long value, ReplacedEnv &replaced ) {
 
-	// Locate the DR_SS_ENV_FD
+	// Locate the variable
 	const char **next;
-	const size_t len = strlen( DR_SS_ENV_FD );
-	for ( next = env; strncmp( *next, DR_SS_ENV_FD, len ) != 0; ++next ) {
+	const size_t len = strlen( name );
+	for ( next = env; ( *next != nullptr ) && ( strncmp( *next, name, len ) != 0 );
+	      ++next ) {
 	}
+	Utilities::assert( *next != nullptr, "Variable missing from execve environment" );
 
 	// Replace the variable's value with our desired value
-	const char *const fd_str = getenv( DR_SS_ENV_FD );
-	Utilities::assert( fd_str != nullptr, "DR_SS_ENV_FD not set on call to execve" );
 	std::stringstream s;
-	s << DR_SS_ENV_FD << "=" << fd_str;
+	s << name << "=" << value;
+	replaced.emplace_back( next, *next );
 	*next = strdup( s.str().c_str() );
+}
+
+// Called before execve or execveat is called, and after it if it failed
+// The new image tells the server to clear the thread's stack once it starts, so the
+// stack, and this image's frames, are left as they are if the execve fails. Only the
+// environment and descriptors changed to pass the channel on are then given back
+static inline void on_execve( void *drcontext, const int sysnum, const bool pre ) {
+	Channel &ch = channels->get( drcontext );
+	if ( !pre ) {
+		for ( const auto &replaced : ch.exec_env ) {
+			free( (void *) *replaced.first );
+			*replaced.first = replaced.second;
+		}
+		ch.exec_env.clear();
+		fcntl( ch.sock, F_SETFD, FD_CLOEXEC );
+		if ( use_ring ) {
+			fcntl( ch.ring_fd, F_SETFD, FD_CLOEXEC );
+		}
+		return;
+	}
+
+	// Pass this thread's channel on to the new image via its enviornment
+	// The channels of other threads are close on exec
+	// execveat takes the directory the path is relative to first
+	const int env_param = ( sysnum == SYS_execveat ) ? 3 : 2;
+	const char **const env =
+	    (const char **) dr_syscall_get_param( drcontext, env_param );
+	replace_env_var( env, DR_SS_ENV_FD, ch.sock, ch.exec_env );
+	fcntl( ch.sock, F_SETFD, 0 );
+	if ( use_ring ) {
+		replace_env_var( env, DR_SS_ENV_RING_FD, ch.ring_fd, ch.exec_env );
+		fcntl( ch.ring_fd, F_SETFD, 0 );
+	}
+	else {
+		replace_env_var( env, DR_SS_ENV_PROTOCOL, ch.protocol, ch.exec_env );
+	}
 
 	// Update the syscall's arguments
-	dr_syscall_set_param( drcontext, 2, (reg_t) env );
+	dr_syscall_set_param( drcontext, env_param, (reg_t) env );
+}
+
+// Returns true if the syscall sysnum about to be called creates a new process
+// A clone sharing its parent's memory creates a thread or a vfork child instead
+// clone3 takes its flags in the first field of the struct its first argument points to;
+// if that cannot be read, the syscall fails and creates nothing
+static bool is_fork( void *drcontext, const int sysnum ) {
+	if ( sysnum == SYS_clone ) {
+		return ( dr_syscall_get_param( drcontext, 0 ) & CLONE_VM ) == 0;
+	}
+	if ( sysnum == SYS_clone3 ) {
+		uint64_t flags;
+		size_t read = 0;
+		const void *const args = (const void *) dr_syscall_get_param( drcontext, 0 );
+		return dr_safe_read( args, sizeof( flags ), &flags, &read ) &&
+		       ( read == sizeof( flags ) ) && ( ( flags & CLONE_VM ) == 0 );
+	}
+	return sysnum == SYS_fork;
+}
+
+// Returns a new fork token, which is random and never 0
+// Processes of other users or groups cannot guess it; the server also checks that the
+// child is in the parent's group before it hands out the snapshot
+static uintptr_t new_fork_token() {
+	uintptr_t token = 0;
+	while ( token == 0 ) {
+		Utilities::assert( getrandom( &token, sizeof( token ), 0 ) == sizeof( token ),
+		                   "getrandom() failed." );
+	}
+	return token;
 }
 
+// Called before and after fork, clone, or clone3
+// Before a fork, the server snapshots this thread's stack under the fork's unique token
+// This waits for the server, so the snapshot exists before the child does
+// After, the child connects its own channel and claims the snapshot with the token
+// If the fork failed, the parent tells the server to drop the snapshot instead
+static inline void on_fork( void *drcontext, const int sysnum, const bool pre ) {
+	Channel &ch = channels->get( drcontext );
+	if ( pre ) {
+		if ( !is_fork( drcontext, sysnum ) ) {
+			return;
+		}
+		ch.fork_token = new_fork_token();
+		send_to_server<Message::Fork>( ch, (const char *) &ch.fork_token );
+		flush_to_server( ch );
+		if ( ch.ring != nullptr ) {
+			++ch.rets_pushed;
+		}
+		else {
+			++ch.unacked;
+		}
+		wait_for_acks( ch, 0 );
+		return;
+	}
+
+	// Only the child of a fork continues
+	const uintptr_t token = ch.fork_token;
+	ch.fork_token = 0;
+	if ( token == 0 ) {
+		return;
+	}
+	const intptr_t result = (intptr_t) dr_syscall_get_result( drcontext );
+	if ( result < 0 ) {
+		send_to_server<Message::ForkFailed>( ch, (const char *) &token );
+		flush_to_server( ch );
+	}
+	if ( result != 0 ) {
+		return;
+	}
+
+	// The child's copy of the parent's channel is closed; the parent keeps using it
+	close_channel( ch );
+	connect_channel( ch );
+	send_to_server<Message::Child>( ch, (const char *) &token );
+	flush_to_server( ch );
+	Utilities::log( "Forked child connected to the server on fd ", ch.sock );
+
+	// The parent's epoch ended before it forked; the child's first digest starts its own
+	if ( digest_interval > 0 ) {
+		send_digest( ch );
+	}
+}
 
 // Called whenever an interesting syscall is found
 // This just delegates to the syscall specific function
+// Before a sensitive syscall, wait until every ret sent has been verified
+// In digest mode, the epoch is ended instead, unless nothing happened since it started
 static inline void syscall_event( void *drcontext, const int sysnum, const bool pre ) {
+	Channel &ch = channels->get( drcontext );
+	if ( pre && ( digest_interval > 0 ) && ( ch.events > 0 ) &&
+	     is_sensitive_syscall( sysnum ) ) {
+		send_digest( ch );
+	}
+	else if ( pre && ( window > 0 ) && is_sensitive_syscall( sysnum ) ) {
+		wait_for_acks( ch, 0 );
+	}
 	switch ( sysnum ) {
 		case SYS_execve:
-			on_execve( drcontext, pre );
+		case SYS_execveat:
+			on_execve( drcontext, sysnum, pre );
+			break;
+		case SYS_fork:
+		case SYS_clone:
+		case SYS_clone3:
+			on_fork( drcontext, sysnum, pre );
+			break;
 		default:
 		    /* Need a ; as this is the last statement */;
 	};
 }
 
 // Called before every interesting syscall
+// Batched messages are sent before anything else, so a child of fork or clone never
+// inherits messages its parent batched, and none are lost on execve. Messages the
+// syscall's handler batches are sent after it
 static bool pre_syscall_event( void *drcontext, const int sysnum ) {
+	Channel &ch = channels->get( drcontext );
+	if ( ch.fill_owed ) {
+		receive_fill( ch, true );
+	}
+	flush_to_server( ch );
 	syscall_event( drcontext, sysnum, true );
+	flush_to_server( ch );
 	return true;
 }
 
@@ -106,6 +1015,36 @@ static void post_syscall_event( void *drcontext, const int sysnum ) {
 	syscall_event( drcontext, sysnum, false );
 }
 
+// Called when a thread starts, including the initial thread
+// Every thread gets its own channel; the first may inherit one from before an exec
+static void thread_init_event( void *drcontext ) {
+	Channel &ch = channels->get( drcontext );
+	ch.hot.reserve( hybrid_window );
+	if ( inherited_channel.exchange( false ) ) {
+		inherit_channel( ch );
+	}
+	else {
+		connect_channel( ch );
+	}
+
+	// In digest mode, the first digest fetches the key of the channel's first epoch
+	if ( digest_interval > 0 ) {
+		send_digest( ch );
+	}
+}
+
+// Called when a thread exits, including when the process does
+// The server frees the thread's shadow stack once its channel is closed
+static void thread_exit_event( void *drcontext ) {
+	Channel &ch = channels->get( drcontext );
+	if ( ch.failovers > 0 ) {
+		Utilities::log( "Thread ", Utilities::get_tid(), " failed over ", ch.failovers,
+		                " times and recovered ", ch.recoveries, " times" );
+	}
+	flush_to_server( ch );
+	close_channel( ch );
+}
+
 /*********************************************************/
 /*                                                       */
 /*                       From Header                     */
@@ -114,30 +1053,60 @@ static void post_syscall_event( void *drcontext, const int sysnum ) {
 
 
 // Setup the external stack server for the DynamoRIO client
-void ExternalSS::setup( SSHandlers **const handlers, const char *const socket_path ) {
-	*handlers = new SSHandlers( on_call, on_ret, on_signal );
-
-	// Setup the socket
-	const char *const fd_str = getenv( DR_SS_ENV_FD );
-	Utilities::assert( fd_str != nullptr, "getenv() failed." );
-	if ( fd_str[0] != (char) 0 ) {
-		Utilities::log( "Existing socket connected detected: ", socket_path );
-		sock = stoi( std::string( fd_str ) );
-		Utilities::log( "\t- Using file descriptor ", sock,
-		                " as socket fd, as it is already connected..." );
+void ExternalSS::setup( SSHandlers **const handlers, const char *const socket_path,
+                        const Transport &transport, const unsigned int async_window,
+                        const unsigned int hybrid, const unsigned long failover,
+                        const unsigned int digest, const unsigned int qos ) {
+	if ( hybrid > 0 ) {
+		*handlers = new SSHandlers( hybrid_on_call, hybrid_on_ret, hybrid_on_signal );
+		Utilities::log( "Hybrid mode keeps the top ", hybrid, " frames of each thread" );
+	}
+	else if ( digest > 0 ) {
+		*handlers = new SSHandlers( digest_on_call, digest_on_ret, digest_on_signal );
+		Utilities::log( "Threads end an epoch with a digest every ", digest, " events" );
+	}
+	else if ( failover > 0 ) {
+		*handlers =
+		    new SSHandlers( failover_on_call, failover_on_ret, failover_on_signal );
+		Utilities::log( "Threads whose rets wait over ", failover,
+		                "us for the server verify them locally" );
 	}
 	else {
-		Utilities::log( "Client connecting to ", socket_path );
-		sock = QS::create_client( socket_path );
-		const auto sock_str = std::to_string( sock );
-		Utilities::assert( setenv( DR_SS_ENV_FD, sock_str.c_str(), true ) == 0,
-		                   "setenv() failed." );
-		Utilities::log( "Set environment variable " DR_SS_ENV_FD " to ", sock_str );
+		*handlers = new SSHandlers( on_call, on_ret, on_signal );
+	}
+	digest_interval = ( hybrid > 0 ) ? 0 : digest;
+	failover_slo = ( ( hybrid > 0 ) || ( digest_interval > 0 ) ) ? 0 : failover;
+	hybrid_window = ( failover_slo > 0 ) ? DEFAULT_HYBRID_WINDOW : hybrid;
+	server_path = socket_path;
+	qos_level = qos;
+	send_qos = ( qos != QoSClass( DEFAULT_QOS_CLASS ).level );
+	use_ring = transport.is_shm;
+	use_tcp = transport.is_tcp;
+	window = async_window;
+	if ( !use_ring && ( window > MAX_SOCKET_WINDOW ) ) {
+		Utilities::log_error( "Async window of ", window, " is too large for the ",
+		                      SOCKET_TRANSPORT_FLAG, " transport, using ",
+		                      MAX_SOCKET_WINDOW, " instead" );
+		window = MAX_SOCKET_WINDOW;
+	}
+	if ( window > 0 ) {
+		Utilities::log( "Rets are verified asynchronously with a window of ", window );
 	}
 
+	// If this image was exec'd by a protected image or started by a launcher with a
+	// server of its own, its initial thread inherits a channel
+	const char *const fd_str = getenv( DR_SS_ENV_FD );
+	Utilities::assert( fd_str != nullptr, "getenv() failed." );
+	inherited_channel.store( fd_str[0] != (char) 0 );
+
 	// Hook syscalls
 	Utilities::log( "Hooking syscalls..." );
 	dr_register_filter_syscall_event( syscall_filter );
 	drmgr_register_pre_syscall_event( pre_syscall_event );
 	drmgr_register_post_syscall_event( post_syscall_event );
+
+	// Each thread connects when it starts, and closes its channel when it exits
+	channels = new TLS<Channel>();
+	drmgr_register_thread_init_event( thread_init_event );
+	drmgr_register_thread_exit_event( thread_exit_event );
 }
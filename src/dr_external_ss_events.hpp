@@ -3,13 +3,30 @@
 #define __DR_EXTERNAL_SS_EVENTS_HPP__
 
 #include "dr_shadow_stack_client.hpp"
+#include "transport.hpp"
 
 
 /** Make a distinction between the internal and external SS functions */
 namespace ExternalSS {
 
-	/** Setup the external stack server for the DynamoRIO client */
-	void setup( SSHandlers **const handlers, const char *const );
+	/** Setup the external stack server for the DynamoRIO client
+	 *  Messages are sent to the server at socket_path via transport
+	 *  Up to async_window rets may be unverified while the target runs on;
+	 *  all of them are verified before any sensitive syscall. 0 disables this
+	 *  If hybrid_window is not 0, this is hybrid mode: each thread keeps the top
+	 *  hybrid_window frames of its shadow stack itself, and only the rest are sent
+	 *  Otherwise, if failover_slo is not 0, a thread whose ret waits for the server for
+	 *  more than failover_slo microseconds verifies its rets itself, as hybrid mode does,
+	 *  until the server catches up
+	 *  Otherwise, if digest_interval is not 0, this is digest mode: each thread keeps the
+	 *  frames it pushes itself, and every digest_interval calls, rets, and signals sends
+	 *  those left to the server along with a keyed hash chain digest of them
+	 *  Each thread asks the server to serve it in the priority class numbered
+	 *  qos_level */
+	void setup( SSHandlers **const handlers, const char *const socket_path,
+	            const Transport &transport, const unsigned int async_window,
+	            const unsigned int hybrid_window, const unsigned long failover_slo,
+	            const unsigned int digest_interval, const unsigned int qos_level );
 }; // namespace ExternalSS
 
 
@@ -1,5 +1,7 @@
 #include "dr_internal_ss_events.hpp"
 #include "dr_print_sym.hpp"
+#include "dr_tls.hpp"
+#include "group_stats.hpp"
 #include "constants.hpp"
 #include "utilities.hpp"
 #include "group.hpp"
@@ -11,49 +13,26 @@
 #include <map>
 
 
+// A thread's shadow stack and the counters of its events
+struct ShadowStack {
+	/** The return addresses of the thread */
+	std::stack<app_pc> frames;
+	/** The counters of the thread's events */
+	ThreadStats stats;
+};
+
 // A thread local shadow stack.
 // The shadow stack that holds the return addresses of the current thread
 // Everytime a signal handler is called, a shadow stack is pushed with a wildcard
 // Everytime we return from a signal handler, the stack pops a wildcard
-template <typename T> class TLS;
-TLS<std::stack<app_pc>> *shadow_stack;
-
-
-/*********************************************************/
-/*                                                       */
-/*                         TLS                           */
-/*                                                       */
-/*********************************************************/
-
+TLS<ShadowStack> *shadow_stack;
 
-// A class used to wrap DynamoRIO's thread local storage
-// Stores assumes the object stored is a T. This is safe
-// for any T that has a default constructor
-template <typename T> class TLS {
-  public:
-	/** The constructor */
-	TLS() : tls_index( drmgr_register_tls_field() ) {
-		Utilities::assert( tls_index != -1, "drmgr_register_tls_field() failed." );
-	}
+// The path statistics are written to when the process exits, empty if they are not
+static std::string stats_file;
 
-	/** Get a reference to the stored T
-	 *  If no drcontext is provided, this all will fetch it */
-	T &get( void *drcontext = nullptr ) const {
-		drcontext = ( drcontext == nullptr ) ? dr_get_current_drcontext() : drcontext;
-		T *const ptr = (T *) drmgr_get_tls_field( drcontext, tls_index );
-		if ( ptr != nullptr ) {
-			return *ptr;
-		}
-		T *const new_ptr = new T();
-		Utilities::assert( drmgr_set_tls_field( drcontext, tls_index, (void *) new_ptr ),
-		                   "drmgr_set_tls_field() failed." );
-		return *new_ptr;
-	}
-
-  private:
-	/** The index of tls used for DynamoRIO's TLS API */
-	const int tls_index;
-};
+// The counters of each thread that has exited, and the lock protecting them
+static Stats::ThreadList *exited_threads = nullptr;
+static void *exited_threads_lock = nullptr;
 
 
 /*********************************************************/
@@ -68,7 +47,10 @@ template <typename T> class TLS {
 // to execute. This function is static for optimization reasons */
 void on_call( const app_pc ret_to_addr ) {
 	Utilities::verbose_log( "Call @ ", (void *) ret_to_addr );
-	shadow_stack->get().push( ret_to_addr );
+	ShadowStack &ss = shadow_stack->get();
+	ss.frames.push( ret_to_addr );
+	++ss.stats.calls;
+	ss.stats.note_depth( ss.frames.size() );
 }
 
 // The ret handler.
@@ -80,7 +62,8 @@ void on_ret( app_pc, const app_pc target_addr ) {
 	Utilities::verbose_log( "Ret to ", (void *) target_addr );
 
 	// If the shadow stack is empty, we cannot return
-	std::stack<app_pc> &ss = shadow_stack->get();
+	ShadowStack &thread = shadow_stack->get();
+	std::stack<app_pc> &ss = thread.frames;
 	if ( ss.empty() ) {
 		TerminateOnDestruction tod;
 		Sym::print( "return address", target_addr );
@@ -94,6 +77,7 @@ void on_ret( app_pc, const app_pc target_addr ) {
 	const app_pc top = ss.top();
 	if ( top == target_addr ) {
 		ss.pop();
+		++thread.stats.rets;
 		return;
 	}
 
@@ -101,6 +85,8 @@ void on_ret( app_pc, const app_pc target_addr ) {
 	else if ( top == (app_pc) WILDCARD ) {
 		Utilities::verbose_log( "Wildcard detected. Returning from signal handler." );
 		ss.pop();
+		++thread.stats.rets;
+		++thread.stats.wildcard_pops;
 		return;
 	}
 
@@ -125,7 +111,12 @@ void on_ret( app_pc, const app_pc target_addr ) {
 // Called whenever a signal is called. Adds a wildcard to the shadow stack
 // Note: the reason we use this instead of the signal event is this ignores ignored
 // signals
-void on_signal() { shadow_stack->get().push( (app_pc) WILDCARD ); }
+void on_signal() {
+	ShadowStack &ss = shadow_stack->get();
+	ss.frames.push( (app_pc) WILDCARD );
+	++ss.stats.wildcard_pushes;
+	ss.stats.note_depth( ss.frames.size() );
+}
 
 
 /*********************************************************/
@@ -142,19 +133,31 @@ static bool syscall_filter( void *, int sysnum ) {
 		/* case SYS_vfork: */
 		/* case SYS_clone: */
 		case SYS_execve:
+		case SYS_execveat:
 			return true;
 		default:
 			return false;
 	};
 }
 
-// Called before execve is called
-static inline void on_execve( void *, bool ) {
+// Called before execve or execveat is called, and after it if it failed
+// Only the call before is counted, so a failed execve is counted once
+// The image is lost if it succeeds, so the thread's counters are first added to the
+// group's statistics, which outlive it
+static inline void on_execve( void *, bool pre ) {
 	Utilities::verbose_log( "execve syscall detected, clearing shadow stack!" );
-	std::stack<app_pc> &ss = shadow_stack->get();
+	ShadowStack &thread = shadow_stack->get();
+	std::stack<app_pc> &ss = thread.frames;
 	while ( ss.size() ) {
 		ss.pop();
 	}
+	if ( pre ) {
+		++thread.stats.execve_clears;
+	}
+	if ( pre && !stats_file.empty() ) {
+		GroupStats::add( thread.stats );
+		thread.stats = ThreadStats();
+	}
 }
 
 
@@ -163,6 +166,7 @@ static inline void on_execve( void *, bool ) {
 static inline void syscall_event( void *drcontext, const int sysnum, const bool pre ) {
 	switch ( sysnum ) {
 		case SYS_execve:
+		case SYS_execveat:
 			on_execve( drcontext, pre );
 		default:
 		    /* Need a ; as this is the last statement */;
@@ -180,6 +184,16 @@ static void post_syscall_event( void *drcontext, const int sysnum ) {
 	syscall_event( drcontext, sysnum, false );
 }
 
+// Called when a thread exits, including when the process does
+// The thread's counters are kept until the process exits, and added to the group's
+static void thread_exit_event( void *drcontext ) {
+	const ThreadStats &stats = shadow_stack->get( drcontext ).stats;
+	GroupStats::add( stats );
+	dr_mutex_lock( exited_threads_lock );
+	exited_threads->emplace_back( Utilities::get_tid(), stats );
+	dr_mutex_unlock( exited_threads_lock );
+}
+
 
 /*********************************************************/
 /*                                                       */
@@ -189,14 +203,23 @@ static void post_syscall_event( void *drcontext, const int sysnum ) {
 
 
 // Setup the internal stack server for the DynamoRIO client
-void InternalSS::setup( SSHandlers **const handlers, const char *const ) {
+void InternalSS::setup( SSHandlers **const handlers, const char *const statistics_file ) {
 
 	// Setup handlers
 	*handlers = new SSHandlers( on_call, on_ret, on_signal );
-	Sym::init();
 
 	// Setup shadow stack
-	shadow_stack = new TLS<std::stack<app_pc>>();
+	shadow_stack = new TLS<ShadowStack>();
+
+	// Setup statistics
+	stats_file = statistics_file;
+	if ( !stats_file.empty() ) {
+		exited_threads = new Stats::ThreadList();
+		exited_threads_lock = dr_mutex_create();
+		Utilities::assert( exited_threads_lock != nullptr, "dr_mutex_create() failed." );
+		drmgr_register_thread_exit_event( thread_exit_event );
+		Utilities::log( "Statistics will be written to ", stats_file );
+	}
 
 	// Hook syscalls
 	Utilities::log( "Hooking syscalls..." );
@@ -204,3 +227,13 @@ void InternalSS::setup( SSHandlers **const handlers, const char *const ) {
 	drmgr_register_pre_syscall_event( pre_syscall_event );
 	drmgr_register_post_syscall_event( post_syscall_event );
 }
+
+// Writes the counters of every thread to the statistics file, if there is one
+void InternalSS::finish() {
+	if ( stats_file.empty() ) {
+		return;
+	}
+	dr_mutex_lock( exited_threads_lock );
+	Stats::append_json( stats_file, "client", *exited_threads );
+	dr_mutex_unlock( exited_threads_lock );
+}
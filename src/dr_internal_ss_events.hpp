@@ -8,8 +8,14 @@
 /** Make a distinction between the internal and external SS functions */
 namespace InternalSS {
 
-	/** Setup the internal stack server for the DynamoRIO client */
-	void setup( SSHandlers **const handlers, const char *const );
+	/** Setup the internal stack server for the DynamoRIO client
+	 *  If stats_file is not empty, the counters of each thread are written to it
+	 *  as JSON when the process exits */
+	void setup( SSHandlers **const handlers, const char *const stats_file );
+
+	/** Writes the counters of each thread to the statistics file, if there is one
+	 *  Called when the client exits, after every thread has exited */
+	void finish();
 }; // namespace InternalSS
 
 
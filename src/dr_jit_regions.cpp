@@ -0,0 +1,307 @@
+#include "dr_jit_regions.hpp"
+#include "dr_print_sym.hpp"
+#include "utilities.hpp"
+#include "group.hpp"
+
+#include "drmgr.h"
+
+#include <syscall.h>
+#include <atomic>
+#include <vector>
+#include <iterator>
+#include <map>
+#include <set>
+
+
+/*********************************************************/
+/*                                                       */
+/*                        Regions                        */
+/*                                                       */
+/*********************************************************/
+
+
+// A writable-executable region of memory
+// The bitmap is protected by regions_lock, the block counters by blocks_lock, and rets
+// is atomic. A retired region frees its bitmap and seen, and only keeps its counters
+struct JIT::Region final {
+
+	/** Constructor. If use_bitmap, allocate one bit per byte of the region */
+	Region( const app_pc s, const app_pc e, const bool use_bitmap )
+	    : start( s ), end( e ), bitmap( use_bitmap ? ( ( e - s ) + 7 ) / 8 : 0, 0 ),
+	      blocks( 0 ), reinstrumented( 0 ), rets( 0 ) {}
+
+	/** Returns true if pc lies within this region */
+	bool contains( const app_pc pc ) const { return ( pc >= start ) && ( pc < end ); }
+
+	/** The first address of the region */
+	const app_pc start;
+
+	/** One past the last address of the region */
+	const app_pc end;
+
+	/** One bit per byte of the region, set if the byte is a known return site */
+	std::vector<unsigned char> bitmap;
+
+	/** Every basic block tag instrumented in this region */
+	std::set<void *> seen;
+
+	/** The number of basic blocks instrumented in this region */
+	unsigned long blocks;
+
+	/** The number of times an already seen block was instrumented again */
+	unsigned long reinstrumented;
+
+	/** The number of returns into this region */
+	std::atomic<unsigned long> rets;
+};
+
+
+// The JIT policy in use
+static bool enabled = false;
+static bool use_bitmap = false;
+
+// The mode specific handlers returns outside of JIT regions are passed on to
+static const SSHandlers *mode_handlers = nullptr;
+
+// The JIT regions mapped, keyed by their first address, and the lock protecting them
+// Regions never overlap, so the only one that may contain an address is the last to
+// start at or before it
+static std::map<app_pc, JIT::Region *> *regions = nullptr;
+static void *regions_lock = nullptr;
+
+// The number of regions in regions
+// While it is 0, a ret skips the lock and the lookup
+static std::atomic<unsigned long> num_regions( 0 );
+
+// Regions that were unmapped, or replaced by a region overlapping them
+// They are kept until exit, since a block being instrumented may still refer to one,
+// and so that their counters are logged. Protected by regions_lock
+static std::vector<JIT::Region *> *retired = nullptr;
+
+// The lock protecting the block counters of the regions mapped
+// It is only taken while holding regions_lock, so blocks of the same region can be
+// counted while holding regions_lock for reading only
+static void *blocks_lock = nullptr;
+
+
+// Returns the region containing pc, or nullptr if none does
+// The caller must hold regions_lock
+static JIT::Region *find_region( const app_pc pc ) {
+	auto next = regions->upper_bound( pc );
+	if ( next == regions->begin() ) {
+		return nullptr;
+	}
+	JIT::Region *const r = ( --next )->second;
+	return r->contains( pc ) ? r : nullptr;
+}
+
+// Retire every region overlapping [start, end)
+// The caller must hold regions_lock for writing
+static void retire( const app_pc start, const app_pc end ) {
+	auto i = regions->upper_bound( start );
+	if ( ( i != regions->begin() ) && std::prev( i )->second->contains( start ) ) {
+		--i;
+	}
+	while ( ( i != regions->end() ) && ( i->second->start < end ) ) {
+		JIT::Region *const r = i->second;
+		Utilities::log( "JIT region retired: [", (void *) r->start, ", ", (void *) r->end,
+		                ")" );
+		std::vector<unsigned char>().swap( r->bitmap );
+		std::set<void *>().swap( r->seen );
+		retired->push_back( r );
+		i = regions->erase( i );
+	}
+	num_regions.store( regions->size(), std::memory_order_release );
+}
+
+// If pc lies in writable-executable memory, record a new region for it, unless another
+// thread did first. Returns the region containing pc or nullptr
+// The memory is queried before regions_lock is taken for writing, which only happens
+// for writable-executable memory
+static JIT::Region *new_region( const app_pc pc ) {
+	byte *base;
+	size_t size;
+	uint prot;
+	if ( !dr_query_memory( pc, &base, &size, &prot ) ) {
+		return nullptr;
+	}
+	const uint wx = DR_MEMPROT_WRITE | DR_MEMPROT_EXEC;
+	if ( ( prot & wx ) != wx ) {
+		return nullptr;
+	}
+	dr_rwlock_write_lock( regions_lock );
+	JIT::Region *const found = find_region( pc );
+	if ( found != nullptr ) {
+		dr_rwlock_write_unlock( regions_lock );
+		return found;
+	}
+	retire( base, base + size );
+	JIT::Region *const r = new JIT::Region( base, base + size, use_bitmap );
+	( *regions )[r->start] = r;
+	num_regions.store( regions->size(), std::memory_order_release );
+	dr_rwlock_write_unlock( regions_lock );
+	Utilities::log( "JIT region detected: [", (void *) r->start, ", ", (void *) r->end,
+	                ")" );
+	return r;
+}
+
+// Only munmap is intercepted
+static bool syscall_filter( void *, int sysnum ) { return sysnum == SYS_munmap; }
+
+// Retire the regions a munmap is about to unmap
+// If the munmap then fails, a region still in use is detected again by its next block
+static bool pre_syscall_event( void *drcontext, int sysnum ) {
+	if ( sysnum == SYS_munmap ) {
+		const app_pc start = (app_pc) dr_syscall_get_param( drcontext, 0 );
+		const size_t len = (size_t) dr_syscall_get_param( drcontext, 1 );
+		if ( num_regions.load( std::memory_order_acquire ) != 0 ) {
+			dr_rwlock_write_lock( regions_lock );
+			retire( start, start + len );
+			dr_rwlock_write_unlock( regions_lock );
+		}
+	}
+	return true;
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From Header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Setup JIT handling with the given policy
+void JIT::setup( const JITPolicy &policy, const SSHandlers *const handlers ) {
+	Utilities::assert( policy.is_valid_policy, "Invalid JIT policy given to the client" );
+	enabled = !policy.is_full;
+	use_bitmap = policy.is_bitmap;
+	mode_handlers = handlers;
+	if ( enabled ) {
+		regions = new std::map<app_pc, Region *>();
+		retired = new std::vector<Region *>();
+		regions_lock = dr_rwlock_create();
+		Utilities::assert( regions_lock != nullptr, "dr_rwlock_create() failed." );
+		blocks_lock = dr_mutex_create();
+		Utilities::assert( blocks_lock != nullptr, "dr_mutex_create() failed." );
+		dr_register_filter_syscall_event( syscall_filter );
+		drmgr_register_pre_syscall_event( pre_syscall_event );
+		Utilities::log( "JIT region policy: ", policy.str );
+	}
+}
+
+// Returns true if JIT regions are handled differently from other code
+bool JIT::is_enabled() { return enabled; }
+
+// Called once per basic block before it is instrumented
+// Returns the JIT region containing the block, or nullptr if there is none
+// Regions are looked up holding regions_lock for reading, so returns are not held up;
+// it is only taken for writing to record a new region
+JIT::Region *JIT::analyze_block( void *const tag, const bool for_trace,
+                                 const bool translating ) {
+	if ( !enabled ) {
+		return nullptr;
+	}
+	const app_pc pc = dr_fragment_app_pc( tag );
+	dr_rwlock_read_lock( regions_lock );
+	Region *r = find_region( pc );
+	while ( r == nullptr ) {
+		dr_rwlock_read_unlock( regions_lock );
+		if ( new_region( pc ) == nullptr ) {
+			return nullptr;
+		}
+
+		// The region may be retired again before the read lock is taken
+		dr_rwlock_read_lock( regions_lock );
+		r = find_region( pc );
+	}
+
+	// Traces and translations rebuild existing blocks; they are not code churn
+	if ( !for_trace && !translating ) {
+		dr_mutex_lock( blocks_lock );
+		++r->blocks;
+		if ( !r->seen.insert( tag ).second ) {
+			++r->reinstrumented;
+		}
+		dr_mutex_unlock( blocks_lock );
+	}
+	dr_rwlock_read_unlock( regions_lock );
+	return r;
+}
+
+// Called when a call inside of the JIT region r is instrumented
+// The return site is recorded at instrumentation time so no clean call is needed
+bool JIT::note_call( Region *const r, const app_pc ret_to_addr ) {
+	if ( !r->contains( ret_to_addr ) ) {
+		return false;
+	}
+	if ( use_bitmap ) {
+		const size_t off = ret_to_addr - r->start;
+		dr_rwlock_write_lock( regions_lock );
+
+		// r may have been retired since its block was analyzed, freeing its bitmap
+		if ( !r->bitmap.empty() ) {
+			r->bitmap[off / 8] |= (unsigned char) ( 1 << ( off % 8 ) );
+		}
+		dr_rwlock_write_unlock( regions_lock );
+	}
+	return true;
+}
+
+// The 'on ret' handler used while JIT handling is enabled
+void JIT::on_ret( const app_pc instr_addr, const app_pc target_addr ) {
+
+	// Returns outside of JIT regions use the normal shadow stack
+	if ( num_regions.load( std::memory_order_acquire ) == 0 ) {
+		mode_handlers->on_ret( instr_addr, target_addr );
+		return;
+	}
+	dr_rwlock_read_lock( regions_lock );
+	Region *const r = find_region( target_addr );
+	if ( r == nullptr ) {
+		dr_rwlock_read_unlock( regions_lock );
+		mode_handlers->on_ret( instr_addr, target_addr );
+		return;
+	}
+
+	// Count the return then check the bitmap if requested
+	r->rets.fetch_add( 1, std::memory_order_relaxed );
+	const size_t off = target_addr - r->start;
+	const bool ok = !use_bitmap || ( r->bitmap[off / 8] & ( 1 << ( off % 8 ) ) );
+	dr_rwlock_read_unlock( regions_lock );
+	if ( !ok ) {
+		TerminateOnDestruction tod;
+		Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
+		                      "Attempting to return to ",
+		                      (void *) target_addr,
+		                      "\n\tAddress is not a known return site of its "
+		                      "JIT region\n" );
+		Sym::print( "return address", target_addr );
+		Group::terminate( nullptr );
+	}
+}
+
+// Logs the counters of one region
+static void log_region( const JIT::Region *const r, const char *const state ) {
+	Utilities::log( "JIT region [", (void *) r->start, ", ", (void *) r->end, ") ", state,
+	                ": ", r->blocks, " blocks instrumented, ", r->reinstrumented,
+	                " re-instrumentations, ", r->rets.load( std::memory_order_relaxed ),
+	                " returns" );
+}
+
+// Logs the per-region counters
+void JIT::finish() {
+	if ( !enabled ) {
+		return;
+	}
+	dr_rwlock_read_lock( regions_lock );
+	dr_mutex_lock( blocks_lock );
+	for ( const auto &i : *regions ) {
+		log_region( i.second, "mapped" );
+	}
+	for ( const auto r : *retired ) {
+		log_region( r, "retired" );
+	}
+	dr_mutex_unlock( blocks_lock );
+	dr_rwlock_read_unlock( regions_lock );
+}
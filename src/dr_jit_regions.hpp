@@ -0,0 +1,50 @@
+/** @file */
+#ifndef __DR_JIT_REGIONS_HPP__
+#define __DR_JIT_REGIONS_HPP__
+
+#include "dr_shadow_stack_client.hpp"
+#include "jit_policy.hpp"
+
+
+/** Handling of writable-executable (JIT) code regions
+ *  A JIT region is detected the first time a basic block inside
+ *  writable-executable memory is instrumented. While the policy is
+ *  not full, calls whose return address lies in a JIT region are not
+ *  pushed onto the shadow stack, and returns to a JIT region do not
+ *  pop it. This keeps the shadow stack balanced across JIT <-> native
+ *  transitions while keeping code churn out of the normal handlers
+ *  A region is forgotten once it is unmapped */
+namespace JIT {
+
+	/** A JIT region. Defined in dr_jit_regions.cpp */
+	struct Region;
+
+	/** Setup JIT handling with the given policy
+	 *  handlers must already be setup */
+	void setup( const JITPolicy &policy, const SSHandlers *const handlers );
+
+	/** Returns true if JIT regions are handled differently from other code */
+	bool is_enabled();
+
+	/** Called once per basic block before it is instrumented
+	 *  Returns the JIT region containing the block, or nullptr if there is none
+	 *  Also counts how many times each block of a region has been re-instrumented */
+	Region *analyze_block( void *const tag, const bool for_trace,
+	                       const bool translating );
+
+	/** Called when a call with return address ret_to_addr inside
+	 *  of the JIT region r is instrumented. Returns true if the call
+	 *  is handled by the JIT policy, false if on_call must still be inserted */
+	bool note_call( Region *const r, const app_pc ret_to_addr );
+
+	/** The 'on ret' handler used while JIT handling is enabled
+	 *  Returns into JIT regions are handled per the policy, all
+	 *  other returns are passed on to the mode's on_ret handler */
+	void on_ret( const app_pc instr_addr, const app_pc target_addr );
+
+	/** Logs the per-region counters. Called when the client exits */
+	void finish();
+}; // namespace JIT
+
+
+#endif
@@ -1,17 +1,29 @@
 #include "dr_shadow_stack_client.hpp"
 #include "dr_internal_ss_events.hpp"
 #include "dr_external_ss_events.hpp"
+#include "dr_jit_regions.hpp"
+#include "dr_zygote.hpp"
+#include "dr_print_sym.hpp"
+#include "startup_profile.hpp"
+#include "group_stats.hpp"
 #include "constants.hpp"
 #include "utilities.hpp"
+#include "qos_class.hpp"
 #include "ss_mode.hpp"
 #include "group.hpp"
 
 #include "drmgr.h"
 
+#include <atomic>
+
 
 // The mode specific shadow stack events to be used.
 SSHandlers *handlers = nullptr;
 
+// The address of the target's main function
+// Only found if startup profiling or zygote mode need it
+static app_pc main_entry = nullptr;
+
 
 /*********************************************************/
 /*                                                       */
@@ -38,6 +50,82 @@ bool SSHandlers::is_valid() const {
 /*********************************************************/
 
 
+// The options the launcher passed to the client
+struct ClientOptions {
+	/** The shadow stack mode */
+	const char *mode = nullptr;
+	/** The JIT region policy */
+	const char *jit = DEFAULT_JIT_POLICY;
+	/** The path of the server's socket, empty if no server is used */
+	const char *sock = "";
+	/** The path of the zygote's socket, empty if zygote mode is off */
+	const char *zygote = "";
+	/** The transport used to reach the server */
+	const char *transport = DEFAULT_TRANSPORT;
+	/** The number of rets the server may verify asynchronously */
+	unsigned int window = 0;
+	/** The number of frames per thread hybrid mode keeps in the client */
+	unsigned int hybrid = DEFAULT_HYBRID_WINDOW;
+	/** The longest a ret may wait for the server in microseconds, 0 if threads never
+	 *  fail over */
+	unsigned long failover = 0;
+	/** The number of calls, rets, and signals between digests, 0 unless this is digest
+	 *  mode */
+	unsigned int digest = 0;
+	/** The priority class of the target's threads on the server */
+	const char *qos = DEFAULT_QOS_CLASS;
+	/** The path statistics are written to, empty if they are not */
+	const char *stats = "";
+};
+
+// Parses the client options
+// Options come in pairs of the form: <option> <value>
+static ClientOptions parse_client_options( const int argc, const char *argv[] ) {
+	ClientOptions ret;
+	for ( int i = 1; i < argc; i += 2 ) {
+		Utilities::assert( i + 1 < argc, "Client option given without a value" );
+		if ( strcmp( argv[i], CLIENT_OPT_MODE ) == 0 ) {
+			ret.mode = argv[i + 1];
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_JIT ) == 0 ) {
+			ret.jit = argv[i + 1];
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_SOCK ) == 0 ) {
+			ret.sock = argv[i + 1];
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_ZYGOTE ) == 0 ) {
+			ret.zygote = argv[i + 1];
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_TRANSPORT ) == 0 ) {
+			ret.transport = argv[i + 1];
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_WINDOW ) == 0 ) {
+			ret.window = (unsigned int) std::stoul( argv[i + 1] );
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_HYBRID ) == 0 ) {
+			ret.hybrid = (unsigned int) std::stoul( argv[i + 1] );
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_FAILOVER ) == 0 ) {
+			ret.failover = std::stoul( argv[i + 1] );
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_DIGEST ) == 0 ) {
+			ret.digest = (unsigned int) std::stoul( argv[i + 1] );
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_QOS ) == 0 ) {
+			ret.qos = argv[i + 1];
+		}
+		else if ( strcmp( argv[i], CLIENT_OPT_STATS ) == 0 ) {
+			ret.stats = argv[i + 1];
+		}
+		else {
+			Utilities::log_error( "Unknown client option: ", argv[i] );
+			Group::terminate( "Incorrect usage of dr_client_main" );
+		}
+	}
+	Utilities::assert( ret.mode != nullptr, "No mode passed to the client" );
+	return ret;
+}
+
 // Calls setup functions.
 // The order of these functions matters !
 static inline void run_before_everything() {
@@ -68,6 +156,51 @@ static void kernel_xfer_event_handler( void *, const dr_kernel_xfer_info_t *info
 	}
 }
 
+// Called in a child after a fork
+static void fork_init_event( void * ) { GroupStats::on_fork(); }
+
+// Called when a thread starts, including the initial thread
+static void thread_init_event( void * ) { GroupStats::note_thread(); }
+
+// Locate the target's main function
+// If main is not exported, the entry point of the executable is used instead
+static void find_main_entry() {
+	module_data_t *const exe = dr_get_main_module();
+	Utilities::assert( exe != nullptr, "dr_get_main_module() failed." );
+	main_entry = (app_pc) dr_get_proc_address( exe->handle, "main" );
+	if ( main_entry == nullptr ) {
+		main_entry = exe->entry_point;
+		Utilities::log( "main is not exported, using the entry point instead" );
+	}
+	dr_free_module_data( exe );
+}
+
+// Called whenever the target's main function is entered
+// In zygote mode, this redirects the zygote to fork each worker, so the zygote
+// enters main again after every fork
+static void on_main_entry() {
+	static std::atomic<bool> entered( false );
+	if ( !entered.exchange( true ) ) {
+		StartupProfile::mark( "main entry" );
+	}
+	if ( Zygote::is_enabled() ) {
+		Zygote::serve( main_entry );
+	}
+}
+
+// Called once per basic block before event_app_instruction
+// Passes the JIT region the block lies in, if any, on to it via user_data
+static dr_emit_flags_t event_analyze_bb( void * /*drcontext*/, void *tag,
+                                         instrlist_t * /*bb*/, bool for_trace,
+                                         bool translating, void **user_data ) {
+	static std::atomic<bool> first_block_seen( false );
+	if ( StartupProfile::is_enabled() && !first_block_seen.exchange( true ) ) {
+		StartupProfile::mark( "first basic block" );
+	}
+	*user_data = (void *) JIT::analyze_block( tag, for_trace, translating );
+	return DR_EMIT_DEFAULT;
+}
+
 // The function that inserts the call and ret handlers
 // Whenever a new basic block is seen, this function will be
 // called once for each instruction in it. If either a call
@@ -76,28 +209,39 @@ static void kernel_xfer_event_handler( void *, const dr_kernel_xfer_info_t *info
 static dr_emit_flags_t event_app_instruction( void *drcontext, void * /*tag*/,
                                               instrlist_t *bb, instr_t *instr,
                                               bool /*for_trace*/, bool /*translating*/,
-                                              void * /*user_data*/ ) {
+                                              void *user_data ) {
 
 	// Concerning DynamoRIO's app_pc type. From their source:
 	//   include/dr_defines.h:typedef byte * app_pc;
 	//   tools/DRcontrol.c:typedef unsigned char byte;
 	// Thus app_pc is simply an unsigned char *
 
+	// If profiling startup, note when main is entered
+	if ( ( main_entry != nullptr ) && ( instr_get_app_pc( instr ) == main_entry ) ) {
+		dr_insert_clean_call( drcontext, bb, instr, (void *) on_main_entry, true, 0 );
+	}
+
 	// If the instruction is a call, get the address,
 	// add the size of the call instruction (to get the
 	// return address), then insert the on_call function
-	// with the return address as a parameter
+	// with the return address as a parameter. Calls
+	// inside of JIT regions are handled by the JIT policy
+	JIT::Region *const jit_region = (JIT::Region *) user_data;
 	if ( instr_is_call( instr ) ) {
 		const app_pc xip = instr_get_app_pc( instr ) + instr_length( drcontext, instr );
-		dr_insert_clean_call( drcontext, bb, instr, (void *) handlers->on_call, false, 1,
-		                      OPND_CREATE_INTPTR( xip ) );
+		if ( ( jit_region == nullptr ) || !JIT::note_call( jit_region, xip ) ) {
+			dr_insert_clean_call( drcontext, bb, instr, (void *) handlers->on_call, false,
+			                      1, OPND_CREATE_INTPTR( xip ) );
+		}
 	}
 
 	// If the instruction is a ret, insert the ret handler as an
 	// mbr_implementation so as to gain access to the info we need
+	// If JIT handling is enabled, its handler decides where the ret goes
 	if ( instr_is_return( instr ) ) {
-		dr_insert_mbr_instrumentation( drcontext, bb, instr, (void *) handlers->on_ret,
-		                               SPILL_SLOT_1 );
+		void *const on_ret =
+		    JIT::is_enabled() ? (void *) JIT::on_ret : (void *) handlers->on_ret;
+		dr_insert_mbr_instrumentation( drcontext, bb, instr, on_ret, SPILL_SLOT_1 );
 	}
 
 	// All went well
@@ -107,6 +251,10 @@ static dr_emit_flags_t event_app_instruction( void *drcontext, void * /*tag*/,
 // Called on exit of client program
 // Checks how the client returned then exits
 static void exit_event() {
+	JIT::finish();
+	InternalSS::finish();
+	Sym::finish();
+	GroupStats::on_exit();
 	Utilities::assert( drmgr_unregister_bb_insertion_event( event_app_instruction ),
 	                   "client process returned improperly." );
 	drmgr_exit();
@@ -118,27 +266,46 @@ static void exit_event() {
 DR_EXPORT void dr_client_main( client_id_t, int argc, const char *argv[] ) {
 
 	// Setup the client and drmgr
+	StartupProfile::attach();
+	StartupProfile::mark( "DynamoRIO init" );
 	run_before_everything();
 	TerminateOnDestruction tod;
 
-	// Error checking
-	Utilities::assert( argc == 2, "Incorrect usage of dr_client_main\n"
-	                              "Expected args: <Mode>" );
-	const char *const socket_path = getenv( DR_SS_ENV_SOCK );
-	Utilities::assert( socket_path != nullptr, "getenv() failed." );
-	Utilities::log( DR_SS_ENV_SOCK " environment variable has value: \"", socket_path,
-	                '"' );
+	// Join the group's statistics, if they are gathered
+	GroupStats::attach();
+
+	// Parse the client options
+	const ClientOptions ops = parse_client_options( argc, argv );
+	const char *const socket_path = ops.sock;
+	Utilities::log( "Client options parsed\n\t- Mode: ", ops.mode, "\n\t- JIT policy: ",
+	                ops.jit, "\n\t- Socket: \"", socket_path, "\"\n\t- Transport: ",
+	                ops.transport, "\n\t- Async window: ", ops.window,
+	                "\n\t- Hybrid window: ", ops.hybrid,
+	                "\n\t- Failover SLO: ", ops.failover,
+	                "us\n\t- Digest interval: ", ops.digest,
+	                "\n\t- Priority class: ", ops.qos, "\n\t- Zygote: \"", ops.zygote,
+	                "\"\n\t- Statistics file: \"", ops.stats, '"' );
 
 	// Extract the mode
-	const SSMode mode( argv[1] );
+	const SSMode mode( ops.mode );
 	Utilities::assert( mode.is_valid_mode, "Invalid mode given to the client" );
 
 	// Call the proper setup function
 	if ( mode.is_internal ) {
-		InternalSS::setup( &handlers, socket_path );
+		InternalSS::setup( &handlers, ops.stats );
 	}
-	else if ( mode.is_external ) {
-		ExternalSS::setup( &handlers, socket_path );
+	else if ( mode.uses_server ) {
+		const Transport transport( ops.transport );
+		Utilities::assert( transport.is_valid_transport,
+		                   "Invalid transport given to the client" );
+		Utilities::assert( !mode.is_hybrid || ( ops.hybrid >= 2 ),
+		                   "The hybrid window must hold at least 2 frames" );
+		const QoSClass qos( ops.qos );
+		Utilities::assert( qos.is_valid_class,
+		                   "Invalid priority class given to the client" );
+		ExternalSS::setup( &handlers, socket_path, transport, ops.window,
+		                   mode.is_hybrid ? ops.hybrid : 0, ops.failover, ops.digest,
+		                   qos.level );
 	}
 	else {
 		Group::terminate( "Unimplemented mode passed to the client" );
@@ -147,14 +314,32 @@ DR_EXPORT void dr_client_main( client_id_t, int argc, const char *argv[] ) {
 	// Error checking
 	Utilities::assert( handlers->is_valid(), "SSHandlers setup incomplete" );
 
+	// Setup symbol lookup for mismatch reports
+	Sym::init();
+
+	// Setup JIT region handling
+	JIT::setup( JITPolicy( ops.jit ), handlers );
+
+	// Setup zygote mode
+	Zygote::setup( ops.zygote );
+
+	// If profiling startup or in zygote mode, find main
+	if ( StartupProfile::is_enabled() || Zygote::is_enabled() ) {
+		find_main_entry();
+	}
+
 	// Register events
 	Utilities::log( "Registering events..." );
 	dr_register_exit_event( exit_event );
+	dr_register_fork_init_event( fork_init_event );
+	drmgr_register_thread_init_event( thread_init_event );
 	drmgr_register_kernel_xfer_event( kernel_xfer_event_handler );
 
 	// The event used to re-route call and ret's
-	drmgr_register_bb_instrumentation_event( NULL, event_app_instruction, NULL );
+	drmgr_register_bb_instrumentation_event( event_analyze_bb, event_app_instruction,
+	                                         NULL );
 
 	// Nothing went wrong, proceed
+	StartupProfile::mark( "client init" );
 	tod.disable();
 }
@@ -0,0 +1,40 @@
+/** @file */
+#ifndef __DR_TLS_HPP__
+#define __DR_TLS_HPP__
+
+#include "utilities.hpp"
+
+#include "drmgr.h"
+
+
+/** A class used to wrap DynamoRIO's thread local storage
+ *  Stores assumes the object stored is a T. This is safe
+ *  for any T that has a default constructor */
+template <typename T> class TLS {
+  public:
+	/** The constructor */
+	TLS() : tls_index( drmgr_register_tls_field() ) {
+		Utilities::assert( tls_index != -1, "drmgr_register_tls_field() failed." );
+	}
+
+	/** Get a reference to the stored T
+	 *  If no drcontext is provided, this all will fetch it */
+	T &get( void *drcontext = nullptr ) const {
+		drcontext = ( drcontext == nullptr ) ? dr_get_current_drcontext() : drcontext;
+		T *const ptr = (T *) drmgr_get_tls_field( drcontext, tls_index );
+		if ( ptr != nullptr ) {
+			return *ptr;
+		}
+		T *const new_ptr = new T();
+		Utilities::assert( drmgr_set_tls_field( drcontext, tls_index, (void *) new_ptr ),
+		                   "drmgr_set_tls_field() failed." );
+		return *new_ptr;
+	}
+
+  private:
+	/** The index of tls used for DynamoRIO's TLS API */
+	const int tls_index;
+};
+
+
+#endif
@@ -0,0 +1,147 @@
+#include "dr_zygote.hpp"
+#include "quick_socket.hpp"
+#include "utilities.hpp"
+
+#include <sys/socket.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+
+
+// The size of the fork stub
+#define STUB_SIZE 21
+
+
+// The path of the socket workers are requested from, empty if zygote mode is off
+static std::string zygote_path;
+
+// Where this process is in serving workers
+enum class State {
+	/** The entry function has not been reached */
+	Starting,
+
+	/** The zygote was redirected to fork for the connection conn */
+	Forking,
+
+	/** This process is a worker */
+	Worker
+};
+static State state = State::Starting;
+
+// The zygote's server socket, and the connection a worker is being forked for
+static int server = -1;
+static int conn = -1;
+
+// The app's machine context as the entry function was first entered
+// Each fork starts from it, and each worker returns to the app with it
+static dr_mcontext_t entry_mc;
+
+// App code that forks, then jumps to the entry function
+static byte *stub = nullptr;
+
+
+// Write the x86-64 fork stub into app memory
+// mov eax, SYS_fork; syscall; jmp [rip + 0]; <entry>
+// The stub only changes rax, rcx, and r11, which are restored in each worker
+static void make_stub( const app_pc entry ) {
+	stub = (byte *) dr_custom_alloc(
+	    nullptr, (dr_alloc_flags_t) ( DR_ALLOC_NON_HEAP | DR_ALLOC_NON_DR ), STUB_SIZE,
+	    DR_MEMPROT_READ | DR_MEMPROT_WRITE | DR_MEMPROT_EXEC, nullptr );
+	Utilities::assert( stub != nullptr, "dr_custom_alloc() failed." );
+	const uint32_t sysnum = SYS_fork;
+	const byte code[] = { 0xb8, 0, 0, 0, 0, 0x0f, 0x05, 0xff, 0x25, 0, 0, 0, 0 };
+	memcpy( stub, code, sizeof( code ) );
+	memcpy( &stub[1], &sysnum, sizeof( sysnum ) );
+	memcpy( &stub[sizeof( code )], &entry, sizeof( entry ) );
+	Utilities::assert(
+	    dr_memory_protect( stub, STUB_SIZE, DR_MEMPROT_READ | DR_MEMPROT_EXEC ),
+	    "dr_memory_protect() failed." );
+}
+
+// Wait for the next connection, then redirect the zygote to fork a worker for it
+[[noreturn]] static void fork_next_worker() {
+	conn = QS::accept_client( server );
+	state = State::Forking;
+	dr_mcontext_t mc = entry_mc;
+	mc.pc = stub;
+	dr_redirect_execution( &mc );
+	Utilities::err( "dr_redirect_execution() failed." );
+}
+
+// Called in a new worker, back at the entry function
+// The connection becomes the worker's stdin and stdout
+static void start_worker( void *const drcontext ) {
+	state = State::Worker;
+	close( server );
+	Utilities::assert( dup2( conn, STDIN_FILENO ) != -1, "dup2() failed." );
+	Utilities::assert( dup2( conn, STDOUT_FILENO ) != -1, "dup2() failed." );
+	close( conn );
+
+	// Undo the registers the stub changed
+	Utilities::assert( dr_set_mcontext( drcontext, &entry_mc ),
+	                   "dr_set_mcontext() failed." );
+	Utilities::log( "Zygote worker started" );
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From Header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Setup zygote mode
+void Zygote::setup( const char *const socket_path ) {
+	zygote_path = socket_path;
+#ifndef X86_64
+	Utilities::assert( !is_enabled(), "Zygote mode is only supported on x86-64" );
+#endif
+	if ( is_enabled() ) {
+		Utilities::log( "Zygote mode enabled. Socket: ", zygote_path );
+	}
+}
+
+// Returns true if zygote mode is enabled
+bool Zygote::is_enabled() { return !zygote_path.empty(); }
+
+// Serve launch requests
+void Zygote::serve( const app_pc entry ) {
+	void *const drcontext = dr_get_current_drcontext();
+	switch ( state ) {
+
+		// Start serving
+		case State::Starting:
+			entry_mc.size = sizeof( entry_mc );
+			entry_mc.flags = DR_MC_ALL;
+			Utilities::assert( dr_get_mcontext( drcontext, &entry_mc ),
+			                   "dr_get_mcontext() failed." );
+			make_stub( entry );
+			server = QS::create_server( zygote_path.c_str(), SOMAXCONN );
+			Utilities::log( "Zygote ready" );
+			fork_next_worker();
+
+		// The stub forked; its result tells the worker from the zygote
+		case State::Forking: {
+			dr_mcontext_t mc;
+			mc.size = sizeof( mc );
+			mc.flags = DR_MC_INTEGER;
+			Utilities::assert( dr_get_mcontext( drcontext, &mc ),
+			                   "dr_get_mcontext() failed." );
+			const long pid = (long) mc.xax;
+			Utilities::assert( pid >= 0, "fork() failed" );
+			if ( pid == 0 ) {
+				start_worker( drcontext );
+				return;
+			}
+			Utilities::log( "Zygote forked worker ", pid );
+			close( conn );
+			fork_next_worker();
+		}
+
+		// A worker entered the entry function again
+		case State::Worker:
+			return;
+	}
+}
@@ -0,0 +1,35 @@
+/** @file */
+#ifndef __DR_ZYGOTE_HPP__
+#define __DR_ZYGOTE_HPP__
+
+#include "dr_api.h"
+
+
+/** Zygote mode
+ *  In zygote mode the protected program stops once it reaches its entry function
+ *  and listens on a unix socket instead. Each connection to that socket forks a
+ *  worker, which inherits the zygote's warm code cache and its shadow stack as of
+ *  the entry function, then runs the program with the connection as stdin / stdout.
+ *  The fork is made by the program itself, from a stub the zygote is redirected to,
+ *  so DynamoRIO and the mode's fork handling see an ordinary fork
+ *  The target must be single threaded until its entry function is reached
+ *  Workers stay in the zygote's process group, so a mismatch in any worker
+ *  terminates the zygote and every other worker with it */
+namespace Zygote {
+
+	/** Setup zygote mode. Workers are requested by connecting to socket_path */
+	void setup( const char *const socket_path );
+
+	/** Returns true if zygote mode is enabled */
+	bool is_enabled();
+
+	/** Serve launch requests. Called from a clean call each time the entry function,
+	 *  whose first instruction is at entry, is entered. The zygote never returns:
+	 *  after accepting a connection it is redirected to fork, then enters the entry
+	 *  function again. This returns in each new worker, and whenever a worker enters
+	 *  the entry function again */
+	void serve( const app_pc entry );
+}; // namespace Zygote
+
+
+#endif
@@ -1,15 +1,39 @@
 #include "external_stack_server.hpp"
+#include "startup_profile.hpp"
+#include "batch_validator.hpp"
+#include "digest_chain.hpp"
+#include "server_metrics.hpp"
+#include "cow_stack.hpp"
+#include "qos_class.hpp"
+#include "group_stats.hpp"
+#include "quick_socket.hpp"
 #include "constants.hpp"
 #include "utilities.hpp"
+#include "shm_ring.hpp"
+#include "protocol.hpp"
+#include "uring.hpp"
 #include "message.hpp"
 #include "group.hpp"
 
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <algorithm>
+#include <errno.h>
 #include <stdio.h>
+#include <atomic>
+#include <memory>
 #include <string>
-#include <stack>
+#include <thread>
+#include <vector>
+#include <mutex>
 #include <map>
 
 // Remove assert macro
@@ -21,19 +45,222 @@ using NewSignal = Message::NewSignal;
 using Continue = Message::Continue;
 using Execve = Message::Execve;
 using Thread = Message::Thread;
+using Child = Message::Child;
+using Hello = Message::Hello;
 using Fork = Message::Fork;
+using Fill = Message::Fill;
 using Call = Message::Call;
 using Ret = Message::Ret;
+using Protocol::Opcode;
 
 
 // The type of a stack used to hold all the pointers
-typedef std::stack<const char *> pointer_stack;
+// Copying one is O(1), so a forked child can start from its parent's stack
+typedef CowStack pointer_stack;
+
+// The number of the default priority class
+static const unsigned int default_qos = QoSClass( DEFAULT_QOS_CLASS ).level;
+
+// A protected thread, as seen by the server
+// Each thread has its own channel, and so its own shadow stack
+struct Client {
+	/** The thread's shadow stack */
+	pointer_stack stk;
+	/** The thread's id, 0 until the client says */
+	pid_t tid = 0;
+	/** The thread's process group, only known to a daemon */
+	pid_t group = 0;
+	/** The user and process group of the thread's process, as of when it connected
+	 *  Unknown, and -1, for a TCP client */
+	uid_t uid = (uid_t) -1;
+	pid_t pgid = -1;
+	/** True once the thread was killed or is gone; its messages are then ignored */
+	bool killed = false;
+	/** The replies owed to the thread, such as Continue messages, not yet sent */
+	std::string out;
+	/** The number of the thread's priority class */
+	unsigned int qos = default_qos;
+	/** The number of the highest priority class the thread may be in */
+	unsigned int best_qos = 0;
+	/** The counters of the thread's events */
+	ThreadStats stats;
+	/** The live metrics of the thread, nullptr if they are not served */
+	ClientMetrics *metrics = nullptr;
+	/** True once the thread sent a Digest; its rets then get no Continue */
+	bool digest = false;
+	/** Digest mode only: the key of the thread's current epoch */
+	uint64_t key[2] = { 0, 0 };
+	/** Digest mode only: the chain value of the frames pushed this epoch */
+	uint64_t chain = 0;
+};
 
 // The type of a message handling function
-// It will take in the message send and the socket of the client
-// It will return a message to end the program with or nullptr if it should continue
-typedef void ( *message_handler )( pointer_stack &stk, const char *const buffer,
-                                   const int sock );
+// It will take in the client and the body of the message sent (or nullptr)
+// It will return true if the client is waiting for a Continue message
+typedef bool ( *message_handler )( Client &client, const char *const addr );
+
+// The most frames a Fill request may ask for
+#define MAX_FILL 1024
+
+// The most calls, rets, and signals validated together
+#define MAX_BATCH_EVENTS 512
+
+// The size of the buffer messages are received into
+#define RECV_BUFFER_SIZE ( 64 * 1024 )
+
+// The most Continue messages queued with one copy
+#define MAX_CONTINUES_PER_WRITE 256
+
+// The most bytes of replies an epoll shard holds for a connection
+// Until its client receives enough of them, nothing more is received from it
+#define MAX_UNSENT_SIZE ( 1024 * 1024 )
+
+// What a message parser returns for a message that cannot be parsed
+#define MALFORMED_MESSAGE ( (size_t) -1 )
+
+// How often a daemon logs the queueing delay of each priority class and writes the
+// statistics of the clients that disconnected since, in milliseconds
+#define REPORT_INTERVAL 10000
+
+// How long the snapshot of a fork waits for its child once the parent thread is gone,
+// in milliseconds. A child that has not connected by then never will
+#define FORK_CLAIM_TIMEOUT 10000
+
+// The type of a function that parses the message at the front of a buffer
+// It will take in the buffer, its length, and the previous address of the channel
+// It will store the opcode and address of the message in op and addr, and
+// return the size of the message, 0 if the buffer holds only part of it, or
+// MALFORMED_MESSAGE if the message cannot be parsed
+typedef size_t ( *message_parser )( const char *const src, const size_t len, Opcode &op,
+                                    uint64_t &addr, uint64_t &prev );
+
+// The most events handled per call to epoll_wait
+#define MAX_EVENTS 64
+
+// How long a worker keeps polling a ring it found empty before parking it, in ns
+// A client that pushes again within this long does not ring the doorbell
+#define RING_SPIN_NS 50000
+
+// How often the shards' loads are compared, in milliseconds
+#define REBALANCE_INTERVAL 100
+
+// A shard is overloaded if it handled this many times the messages of the idlest shard
+#define REBALANCE_RATIO 2
+
+// A shard that handled fewer messages than this in an interval is never overloaded
+#define REBALANCE_MIN_LOAD 4096
+
+// The most bytes of a partial message a connection can be left with
+#define MAX_PARTIAL_SIZE ( MESSAGE_SIZE > MAX_FRAME_SIZE ? MESSAGE_SIZE : MAX_FRAME_SIZE )
+
+// The number of requests each io_uring shard's ring holds
+#define URING_ENTRIES 256
+
+// The number of buffers each io_uring shard provides for receives, and their size
+// A buffer plus the partial message before it must fit in RECV_BUFFER_SIZE bytes
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE ( 16 * 1024 )
+
+// A client connected to the server over the socket or shm transport
+// Each connection has its own shadow stack
+struct Connection {
+
+	/** The constructor */
+	explicit Connection( const int s ) : sock( s ) {}
+
+	/** The connection's socket
+	 *  A ring client sends only the doorbell of its ring over it */
+	const int sock;
+
+	/** The ring the client pushes its messages onto, nullptr unless it uses shm */
+	std::unique_ptr<ShmRing> ring;
+
+	/** The protocol version spoken, 0 until the first message is received */
+	uintptr_t version = 0;
+
+	/** The parser for messages of version */
+	message_parser parse = nullptr;
+
+	/** The thread the connection belongs to */
+	Client client;
+
+	/** The last address received, v2 addresses are relative to it */
+	uint64_t prev = 0;
+
+	/** The start of a message whose end has not been received yet */
+	char partial[MAX_PARTIAL_SIZE];
+
+	/** The length of partial */
+	size_t partial_len = 0;
+
+	/** The number of messages handled recently, used to pick connections to move */
+	unsigned long recent = 0;
+
+	/** epoll only: the events the shard is watching sock for */
+	uint32_t events = 0;
+
+	/** io_uring only: true while a multishot receive is armed */
+	bool receiving = false;
+
+	/** io_uring only: the replies being sent. The client's replies queued since wait
+	 *  for this send to complete. A connection has one send in flight at most, and
+	 *  replies are sent in order, so a v1 message is never split */
+	std::string sending;
+
+	/** io_uring only: the bytes at the end of sending not yet sent, 0 if there is none */
+	size_t in_flight = 0;
+
+	/** io_uring only: true once the client disconnected or was killed */
+	bool gone = false;
+
+	/** io_uring only: the shard the connection is being moved to, or -1 */
+	int move_to = -1;
+};
+
+// A worker thread and the socket clients it serves
+// Only the worker touches its connections, so handling messages takes no locks
+// Other threads hand it connections through its inbox
+struct Shard {
+
+	/** The constructor
+	 *  finished is written to each time a client of this shard disconnects */
+	Shard( const int id_, const int finished_ );
+
+	/** The index of this shard */
+	const int id;
+
+	/** The epoll instance of the worker */
+	const int epfd;
+
+	/** Written to when the inbox is not empty */
+	const int wake;
+
+	/** Written to each time a client disconnects */
+	const int finished;
+
+	/** Connections given to this shard that the worker has not yet taken */
+	std::vector<std::unique_ptr<Connection>> inbox;
+
+	/** Protects inbox */
+	std::mutex inbox_lock;
+
+	/** The number of messages handled since the rebalancer last checked */
+	std::atomic<unsigned long> load;
+
+	/** The index of the shard to give a connection to, or -1 */
+	std::atomic<int> give_to;
+
+	/** The worker's connections by fd. Only the worker may touch this */
+	std::map<int, std::unique_ptr<Connection>> connections;
+
+	/** The worker's io_uring, nullptr if it uses epoll. Only the worker may touch this */
+	std::unique_ptr<Uring> uring;
+
+	/** epoll only: the fds of the ring connections whose ring was not parked last turn
+	 *  They are served again without waiting for their doorbell. Only the worker may
+	 *  touch this */
+	std::vector<int> unparked;
+};
 
 
 /*********************************************************/
@@ -43,41 +270,195 @@ typedef void ( *message_handler )( pointer_stack &stk, const char *const buffer,
 /*********************************************************/
 
 
+// True if the server is a daemon serving many process groups
+// A private server kills its own group when verification fails, or when a client breaks
+// the protocol or its channel fails
+// A daemon must outlive the groups it serves, so it kills only the offending group when
+// verification fails, and otherwise only drops the client's connection
+static bool daemon_mode = false;
+
+// A thread's stack, as of when the thread forked
+struct Snapshot {
+	/** The shadow stack */
+	pointer_stack stk;
+	/** The thread that forked, nullptr once it is gone */
+	const Client *parent = nullptr;
+	/** When the parent was found to be gone, in nanoseconds */
+	unsigned long orphaned_at = 0;
+	/** The user and process group of the parent's process, which the child shares */
+	uid_t uid = (uid_t) -1;
+	pid_t pgid = -1;
+};
+
+// The counters of each client that has disconnected since they were last written
+static Stats::ThreadList finished_stats;
+static std::mutex finished_stats_lock;
+
+// The stacks of forks whose child has not yet connected, by fork token
+// A parent's snapshot is stored before it forks, so it is here when the child connects
+// A parent may exit before its child connects, so a snapshot outlives its parent for
+// FORK_CLAIM_TIMEOUT before it is dropped
+static std::map<uintptr_t, Snapshot> pending_forks;
+static std::mutex pending_forks_lock;
+
+// Returns the time in nanoseconds since an arbitrary point
+static inline unsigned long now_ns() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long) ts.tv_sec * 1000000000 + (unsigned long) ts.tv_nsec;
+}
+
+// Note the user and process group of the client connected on the unix socket sock
+// A forked child must share them with its parent to claim the parent's stack
+// A daemon also kills the group if the client fails verification; if it cannot be
+// found, the client is only ever disconnected
+static void find_credentials( Client &client, const int sock ) {
+	struct ucred cred;
+	socklen_t len = sizeof( cred );
+	if ( getsockopt( sock, SOL_SOCKET, SO_PEERCRED, &cred, &len ) != 0 ) {
+		Utilities::log_error( "Could not find the process of the client on fd ", sock );
+		return;
+	}
+	client.uid = cred.uid;
+	client.pgid = getpgid( cred.pid );
+	if ( client.pgid == -1 ) {
+		Utilities::log( "Client on fd ", sock, " exited before its group was found" );
+	}
+	else if ( daemon_mode ) {
+		client.group = client.pgid;
+	}
+}
+
+// Returns true if the process connected on the unix socket sock runs as this user
+// Any local user can connect to an abstract socket, whose name is not guarded by file
+// permissions, so a private server only serves its own user's processes
+static bool is_same_user( const int sock ) {
+	struct ucred cred;
+	socklen_t len = sizeof( cred );
+	if ( getsockopt( sock, SOL_SOCKET, SO_PEERCRED, &cred, &len ) != 0 ) {
+		Utilities::log_error( "Could not find the user of the client on fd ", sock );
+		return false;
+	}
+	return cred.uid == geteuid();
+}
+
+// Forget the thread of client, whose channel has been closed
+// The thread's counters are kept until they are written, and added to the group's
+static void forget( Client &client ) {
+	GroupStats::add( client.stats );
+	ServerMetrics::disconnect( client.metrics );
+	client.metrics = nullptr;
+	{
+		std::lock_guard<std::mutex> lock( finished_stats_lock );
+		finished_stats.emplace_back( client.tid, client.stats );
+	}
+	std::lock_guard<std::mutex> lock( pending_forks_lock );
+	for ( auto &i : pending_forks ) {
+		if ( i.second.parent == &client ) {
+			i.second.parent = nullptr;
+			i.second.orphaned_at = now_ns();
+		}
+	}
+}
+
+// Drop the snapshots of forks whose parent is gone and whose child never connected
+static void sweep_forks() {
+	const unsigned long now = now_ns();
+	std::lock_guard<std::mutex> lock( pending_forks_lock );
+	for ( auto i = pending_forks.begin(); i != pending_forks.end(); ) {
+		if ( ( i->second.parent == nullptr ) &&
+		     ( now - i->second.orphaned_at >= FORK_CLAIM_TIMEOUT * 1000000ul ) ) {
+			Utilities::log( "Dropping the snapshot of fork ", (void *) i->first,
+			                ", its child never connected" );
+			i = pending_forks.erase( i );
+		}
+		else {
+			++i;
+		}
+	}
+}
+
+
+// Called when the thread of client failed verification
+// A private server terminates its own group, which the thread belongs to
+// A daemon kills the thread's group instead; the messages it sent after are ignored
+// A TCP client's group may be on another machine, so it is only disconnected; its
+// thread fails to receive its reply, which terminates its group
+static void violation( Client &client ) {
+	if ( !daemon_mode ) {
+		Group::terminate( nullptr );
+	}
+	if ( client.group == 0 ) {
+		Utilities::log_error( "Disconnecting thread ", client.tid );
+	}
+	else {
+		Utilities::log_error( "Killing process group ", client.group );
+	}
+	if ( ( client.group > 1 ) && ( client.group != getpgrp() ) ) {
+		killpg( client.group, SIGKILL );
+	}
+	client.killed = true;
+}
+
+// Called when the channel of client failed, or the client broke the protocol
+// why is logged. A private server terminates its own group, which the thread belongs to
+// A daemon only drops the connection; its messages are ignored from now on, and the
+// thread fails to receive its reply, which terminates its group
+template <typename... Args>
+static void client_failed( Client &client, Args &&... why ) {
+	Utilities::log_error( "Thread ", client.tid, " failed: ",
+	                      std::forward<Args>( why )... );
+	if ( !daemon_mode ) {
+		Group::terminate( nullptr );
+	}
+	Utilities::log_error( "Disconnecting thread ", client.tid );
+	client.killed = true;
+}
+
 // Called whenever a signal is sent to the client
 // Signal handlers have no 'call', so we add a wildcard
-void add_wildcard( pointer_stack &stk, const char *const, const int ) {
+bool add_wildcard( Client &client, const char *const ) {
 	Utilities::verbose_log( "(server) Signal detected, adding wildcard!" );
-	stk.push( (char *) WILDCARD );
+	client.stk.push( (char *) WILDCARD );
+	++client.stats.wildcard_pushes;
+	client.stats.note_depth( client.stk.size() );
+	return false;
 }
 
 // Clears the stack whenever execve is called
-void clear_stack( pointer_stack &stk, const char *const, const int ) {
+bool clear_stack( Client &client, const char *const ) {
 	Utilities::verbose_log( "(server) execve syscall detected, clearing shadow stack!" );
-	while ( stk.size() ) {
-		stk.pop();
-	}
+	client.stk.clear();
+	client.chain = 0;
+	++client.stats.execve_clears;
+	return false;
 }
 
 // Called when a 'call' was detected
-void call_handler( pointer_stack &stk, const char *const buffer, const int ) {
-	const char *const addr = *( (char **) buffer );
+bool call_handler( Client &client, const char *const addr ) {
 	Utilities::verbose_log( "(server) Push(", (void *) addr, ")" );
-	stk.push( addr );
+	client.stk.push( addr );
+	++client.stats.calls;
+	client.stats.note_depth( client.stk.size() );
+	return false;
 }
 
 // Called when a 'ret' was detected
-void ret_handler( pointer_stack &stk, const char *const buffer, const int sock ) {
+// The client waits for a Continue message, so return true
+bool ret_handler( Client &client, const char *const addr ) {
+	pointer_stack &stk = client.stk;
 
 	// Log the address
-	const char *const addr = *( (char **) buffer );
 	Utilities::verbose_log( "(server) Pop(", (void *) addr, ")\n" );
 
 	// If the stack is empty, error
 	if ( stk.empty() ) {
 		Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
-		                      "Attempting to return to ",
-		                      (void *) addr, "\n\tShadow Stack is empty.\n" );
-		Group::terminate( nullptr );
+		                      "Thread ",
+		                      client.tid, " attempting to return to ", (void *) addr,
+		                      "\n\tShadow Stack is empty.\n" );
+		violation( client );
+		return false;
 	}
 
 	// If the top of the stack is a wildcard,
@@ -86,99 +467,1289 @@ void ret_handler( pointer_stack &stk, const char *const buffer, const int sock )
 	if ( top == (char *) WILDCARD ) {
 		Utilities::verbose_log(
 		    "Wildcard detected, returning from signal handler allowed." );
+		++client.stats.wildcard_pops;
 	}
 
 	// If the return address is incorrect, error
 	else if ( addr != top ) {
 		Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
-		                      "Attempting to return to ",
-		                      (void *) addr, "\n\tTop of shadow stack is ", (void *) top,
-		                      "\n" );
-		Group::terminate( nullptr );
+		                      "Thread ",
+		                      client.tid, " attempting to return to ", (void *) addr,
+		                      "\n\tTop of shadow stack is ", (void *) top, "\n" );
+		violation( client );
+		return false;
 	}
 
 	// If everything is valid, pop the stack
 	stk.pop();
+	++client.stats.rets;
+	return true;
+}
+
+// Called when a thread is about to fork. The body of the message is the fork's token
+// The child's stack starts as a snapshot of the parent's, which shares its frames
+// The client waits for a Continue message, so the snapshot exists before the child does
+bool fork_handler( Client &client, const char *const token ) {
+	Utilities::log( "Thread ", client.tid, " is forking with token ", (void *) token );
+	std::lock_guard<std::mutex> lock( pending_forks_lock );
+	Snapshot &snapshot = pending_forks[(uintptr_t) token];
+	snapshot.stk = client.stk;
+	snapshot.parent = &client;
+	snapshot.orphaned_at = 0;
+	snapshot.uid = client.uid;
+	snapshot.pgid = client.pgid;
+	return true;
+}
+
+// Called when a thread's fork failed. The body of the message is the fork's token
+// No child will claim the fork's snapshot, so it is dropped
+bool fork_failed_handler( Client &client, const char *const token ) {
+	Utilities::log( "Thread ", client.tid, " failed to fork with token ",
+	                (void *) token );
+	std::lock_guard<std::mutex> lock( pending_forks_lock );
+	const auto snapshot = pending_forks.find( (uintptr_t) token );
+	if ( ( snapshot != pending_forks.end() ) && ( snapshot->second.parent == &client ) ) {
+		pending_forks.erase( snapshot );
+	}
+	return false;
+}
+
+// Called when a forked child connects. The body of the message is the fork's token
+// The child connects before it runs any code of its own, so it is still in its parent's
+// user and process group. A claimant that is not keeps the snapshot for the real child
+bool child_handler( Client &client, const char *const token ) {
+	std::lock_guard<std::mutex> lock( pending_forks_lock );
+	const auto snapshot = pending_forks.find( (uintptr_t) token );
+	if ( snapshot == pending_forks.end() ) {
+		Utilities::log_error( "Thread ", client.tid,
+		                      " claims to be the child of unknown fork ",
+		                      (void *) token );
+		violation( client );
+		return false;
+	}
+	if ( ( snapshot->second.uid != client.uid ) ||
+	     ( snapshot->second.pgid != client.pgid ) ) {
+		Utilities::log_error( "Thread ", client.tid, " claims to be the child of fork ",
+		                      (void *) token, " of another user or process group" );
+		violation( client );
+		return false;
+	}
+	client.stk = std::move( snapshot->second.stk );
+	pending_forks.erase( snapshot );
+	Utilities::log( "Thread ", client.tid, " forked with a stack of depth ",
+	                client.stk.size() );
+	return false;
+}
+
+// Called when a hybrid mode thread unwinds past the frames it keeps itself
+// The body of the message is the most frames to send back. They are popped, then
+// sent top first in wire order; the client owes no Continue, so they are queued at once
+// A thread that asks for more frames than the stack holds gets them all
+bool fill_handler( Client &client, const char *const count ) {
+	uintptr_t reply[1 + MAX_FILL];
+	const uintptr_t wanted = std::min( (uintptr_t) count, (uintptr_t) MAX_FILL );
+	uintptr_t &n = reply[0];
+	for ( n = 0; ( n < wanted ) && !client.stk.empty(); ++n ) {
+		reply[1 + n] = Message::wire_order( (uintptr_t) client.stk.top() );
+		client.stk.pop();
+	}
+	Utilities::verbose_log( "(server) Fill(", n, ")" );
+	const size_t size = ( 1 + n ) * sizeof( uintptr_t );
+	n = Message::wire_order( n );
+	client.out.append( (const char *) reply, size );
+	return false;
+}
+
+// Called when a channel says which priority class its thread is in
+// The body of the message is the number of the class
+// A class higher than the connection may use is lowered to the highest it may
+bool priority_handler( Client &client, const char *const level ) {
+	if ( (uintptr_t) level >= NUM_QOS_CLASSES ) {
+		Utilities::log_error( "Thread ", client.tid, " asked for unknown priority class ",
+		                      (uintptr_t) level );
+		return false;
+	}
+	if ( (uintptr_t) level < client.best_qos ) {
+		Utilities::log_error( "Thread ", client.tid, " asked for priority class ",
+		                      QoSClass::name( (unsigned int) (uintptr_t) level ),
+		                      ", which it may not use" );
+	}
+	client.qos = std::max( (unsigned int) (uintptr_t) level, client.best_qos );
+	Utilities::log( "Thread ", client.tid, " is in priority class ",
+	                QoSClass::name( client.qos ) );
+	return false;
+}
+
+// Called when a digest mode thread ends an epoch. The body of the message is its digest
+// The thread keeps the frames it pushes during an epoch itself, and checks the rets into
+// them; the rets past them were checked here as they arrived. The frames left are sent
+// just before the digest, so a digest that does not match their chain means the thread's
+// frames were tampered with. A match is answered with the next epoch's key
+// A thread's first digest starts its first epoch
+bool digest_handler( Client &client, const char *const digest ) {
+	if ( client.digest && ( (uintptr_t) digest != (uintptr_t) client.chain ) ) {
+		Utilities::log_error( "*** Shadow stack digest mismatch detected! ***\n"
+		                      "Thread ",
+		                      client.tid, " sent digest ", (void *) digest,
+		                      "\n\tDigest of the frames it sent is ",
+		                      (void *) client.chain, "\n" );
+		violation( client );
+		return false;
+	}
+	client.digest = true;
+	client.chain = 0;
+	Utilities::assert( getrandom( client.key, sizeof( client.key ), 0 ) ==
+	                       sizeof( client.key ),
+	                   "getrandom() failed." );
+	const uint64_t reply[2] = { htole64( client.key[0] ), htole64( client.key[1] ) };
+	client.out.append( (const char *) reply, sizeof( reply ) );
+	return false;
+}
+
+// Called when a channel says which thread it belongs to
+// The body of the message is the thread id
+bool thread_handler( Client &client, const char *const tid ) {
+	client.tid = (pid_t)(uintptr_t) tid;
+	Utilities::log( "Thread ", client.tid, " connected" );
+	if ( client.metrics != nullptr ) {
+		client.metrics->tid.store( client.tid, std::memory_order_relaxed );
+	}
+	return false;
+}
+
+
+// The handler of each opcode, indexed by opcode
+// Opcodes the client never sends have no handler
+static const message_handler handlers[Protocol::NUM_OPCODES] = {
+	call_handler,  // CALL
+	ret_handler,   // RET
+	add_wildcard,  // NEW_SIGNAL
+	clear_stack,   // EXECVE
+	fork_handler,  // FORK
+	thread_handler,  // THREAD
+	nullptr,       // CONTINUE
+	child_handler, // CHILD
+	fill_handler,  // FILL
+	priority_handler, // PRIORITY
+	fork_failed_handler, // FORK_FAILED
+	digest_handler // DIGEST
+};
+
+// Call the handler of op with the address addr
+// Returns true if the client is waiting for a Continue message
+static inline bool dispatch( Client &client, const Opcode op, const char *const addr ) {
+	if ( ( op >= Protocol::NUM_OPCODES ) || ( handlers[op] == nullptr ) ) {
+		client_failed( client, "sent a message of unknown opcode ", (int) op );
+		return false;
+	}
+	return handlers[op]( client, addr );
+}
+
+// A run of consecutive calls, rets, and signals from one client, validated together
+// A signal is a call to the wildcard
+struct EventRun {
+	/** The number of events in the run */
+	size_t length = 0;
+	/** True for each event that is a ret */
+	bool is_ret[MAX_BATCH_EVENTS];
+	/** The address of each event */
+	uint64_t addr[MAX_BATCH_EVENTS];
+};
+
+// Returns true if op is an event an EventRun holds
+static inline bool is_run_event( const Opcode op ) {
+	return ( op == Protocol::CALL ) || ( op == Protocol::RET ) ||
+	       ( op == Protocol::NEW_SIGNAL );
+}
+
+// Validate then empty run, the client's most recent events
+// Each ret is paired with the frame it returns to: the latest call of the run not yet
+// returned from, or else the top of the stack. Every pair is then compared at once, and
+// only the calls never returned from are pushed, so the rest never touch the stack
+// The pairing is a scalar pass over the run; only the compare is vectorised
+// Every event is still counted as if it had
+// Returns the number of rets the client is waiting for a Continue message for, which is
+// none once it sent a Digest
+static unsigned long validate_run( Client &client, EventRun &run ) {
+	if ( run.length == 0 ) {
+		return 0;
+	}
+	pointer_stack &stk = client.stk;
+	ThreadStats &stats = client.stats;
+	uint64_t open[MAX_BATCH_EVENTS];
+	uint64_t expected[MAX_BATCH_EVENTS];
+	uint64_t actual[MAX_BATCH_EVENTS];
+	size_t n_open = 0;
+	size_t n_rets = 0;
+	const size_t length = run.length;
+	run.length = 0;
+
+	// Pair each ret with its frame
+	for ( size_t i = 0; i < length; ++i ) {
+		if ( !run.is_ret[i] ) {
+			open[n_open++] = run.addr[i];
+			if ( run.addr[i] == (uint64_t) WILDCARD ) {
+				++stats.wildcard_pushes;
+			}
+			else {
+				++stats.calls;
+			}
+			stats.note_depth( stk.size() + n_open );
+			continue;
+		}
+		if ( n_open > 0 ) {
+			expected[n_rets] = open[--n_open];
+		}
+		else if ( !stk.empty() ) {
+			expected[n_rets] = (uint64_t) stk.top();
+			stk.pop();
+		}
+		else {
+			Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
+			                      "Thread ",
+			                      client.tid, " attempting to return to ",
+			                      (void *) run.addr[i], "\n\tShadow Stack is empty.\n" );
+			violation( client );
+			return 0;
+		}
+		stats.wildcard_pops += ( expected[n_rets] == (uint64_t) WILDCARD );
+		actual[n_rets++] = run.addr[i];
+	}
+	stats.rets += n_rets;
+
+	// Compare every pair
+	const size_t bad =
+	    BatchValidator::first_mismatch( expected, actual, n_rets, (uint64_t) WILDCARD );
+	if ( bad != n_rets ) {
+		Utilities::log_error( "*** Shadow stack mistmach detected! ***\n"
+		                      "Thread ",
+		                      client.tid, " attempting to return to ",
+		                      (void *) actual[bad], "\n\tTop of shadow stack is ",
+		                      (void *) expected[bad], "\n" );
+		violation( client );
+		return 0;
+	}
+
+	// Push what is left
+	for ( size_t i = 0; i < n_open; ++i ) {
+		stk.push( (const char *) open[i] );
+	}
+	Utilities::verbose_log( "(server) Validated ", length, " events, pushed ", n_open );
+	return client.digest ? 0 : n_rets;
+}
+
+// Publish the depth of the client's shadow stack to its metrics, if they are served
+static inline void publish_depth( Client &client ) {
+	if ( client.metrics != nullptr ) {
+		client.metrics->depth.store( client.stk.size(), std::memory_order_relaxed );
+	}
+}
+
+// Parses the v1 message at the front of the len bytes at src
+// Returns the size of the message, or 0 if src holds only part of it
+static size_t parse_v1( const char *const src, const size_t len, Opcode &op,
+                        uint64_t &addr, uint64_t & ) {
+	if ( len < MESSAGE_SIZE ) {
+		return 0;
+	}
+	op = Protocol::from_v1( src );
+	addr = Message::body_of( src );
+	return MESSAGE_SIZE;
+}
+
+// Parses the v2 frame at the front of the len bytes at src
+// Returns the size of the frame, 0 if src holds only part of it, or MALFORMED_MESSAGE
+static size_t parse_v2( const char *const src, const size_t len, Opcode &op,
+                        uint64_t &addr, uint64_t &prev ) {
+	op = (Opcode) src[0];
+	if ( !Protocol::has_body( op ) ) {
+		return 1;
+	}
+
+	// Only addresses are relative to the previous one
+	uint64_t base = 0;
+	uint64_t &from = Protocol::has_address( op ) ? prev : base;
+	const int n = Protocol::decode_address( &src[1], len - 1, addr, from );
+	if ( n < 0 ) {
+		return MALFORMED_MESSAGE;
+	}
+	return ( n == 0 ) ? 0 : 1 + (size_t) n;
+}
+
+// As many Continue messages as are queued with one copy, for each protocol version
+// Every Continue is the same, so any number of them can be copied from these
+static char v1_continues[MAX_CONTINUES_PER_WRITE * MESSAGE_SIZE];
+static char v2_continues[MAX_CONTINUES_PER_WRITE];
+
+// Fill v1_continues and v2_continues
+static void fill_continues() {
+	for ( unsigned long i = 0; i < MAX_CONTINUES_PER_WRITE; ++i ) {
+		memcpy( &v1_continues[i * Continue::size], Continue::message, Continue::size );
+		v2_continues[i] = (char) Protocol::CONTINUE;
+	}
+}
+
+// Returns the Continue messages of protocol version, and stores the size of one in size
+static inline const char *continues_of( const uintptr_t version, size_t &size ) {
+	size = ( version == PROTOCOL_V1 ) ? Continue::size : 1;
+	return ( version == PROTOCOL_V1 ) ? v1_continues : v2_continues;
+}
+
+// Queue n Continue messages of protocol version for the client
+static void queue_continues( Client &client, const uintptr_t version, unsigned long n ) {
+	size_t size;
+	const char *const replies = continues_of( version, size );
+	while ( n > 0 ) {
+		const unsigned long count =
+		    std::min( n, (unsigned long) MAX_CONTINUES_PER_WRITE );
+		client.out.append( replies, count * size );
+		n -= count;
+	}
+}
+
+// Determines the protocol version of conn from its first message, at the front of buffer
+// Returns the number of bytes of buffer consumed
+static size_t handshake( Connection &conn, const char *const buffer ) {
+	size_t consumed = 0;
+
+	// A client that does not say hello speaks v1
+	if ( !Message::is_a_valid<Hello>( buffer ) ) {
+		conn.version = PROTOCOL_V1;
+	}
+
+	// Otherwise, agree on a version
+	else {
+		conn.version = Message::body_of( buffer );
+		if ( conn.version < PROTOCOL_V1 ) {
+			client_failed( conn.client, "asked for invalid protocol version ",
+			               conn.version );
+			conn.version = PROTOCOL_V1;
+		}
+		conn.version = std::min( conn.version, (uintptr_t) PROTOCOL_LATEST );
+		conn.client.out.append( Hello( (char *) &conn.version ).message, Hello::size );
+		consumed = MESSAGE_SIZE;
+	}
+	conn.parse = ( conn.version == PROTOCOL_V1 ) ? parse_v1 : parse_v2;
+	Utilities::log( "Client on fd ", conn.sock, " speaks protocol version ",
+	                conn.version );
+	return consumed;
+}
+
+// Handle every complete message in the end bytes of buffer, which start with
+// the partial message conn was left with. The number of rets handled is added to
+// continues, and whatever follows the last complete message is kept for next time
+// Returns false if the client was killed
+static bool consume( Connection &conn, const char *const buffer, const size_t end,
+                     unsigned long &continues ) {
+	size_t start = 0;
+
+	// The first message decides the protocol version
+	if ( conn.version == 0 ) {
+		if ( end >= MESSAGE_SIZE ) {
+			start = handshake( conn, buffer );
+		}
+		else {
+			start = end;
+		}
+	}
+
+	// Handle every complete message received
+	// Calls, rets, and signals are validated in runs; any other message ends a run
+	// Once a client sent a Digest, the frames it pushes are chained as they arrive
+	ClientMetrics *const metrics = conn.client.metrics;
+	EventRun run;
+	while ( ( conn.version != 0 ) && ( start < end ) && !conn.client.killed ) {
+		Opcode op;
+		uint64_t addr = 0;
+		const size_t size =
+		    conn.parse( &buffer[start], end - start, op, addr, conn.prev );
+		if ( size == MALFORMED_MESSAGE ) {
+			client_failed( conn.client, "sent a malformed address" );
+			break;
+		}
+		if ( size == 0 ) {
+			break;
+		}
+		start += size;
+		++conn.recent;
+		if ( metrics != nullptr ) {
+			metrics->note_message( op );
+		}
+		if ( is_run_event( op ) ) {
+			run.is_ret[run.length] = ( op == Protocol::RET );
+			run.addr[run.length] =
+			    ( op == Protocol::NEW_SIGNAL ) ? (uint64_t) WILDCARD : addr;
+			if ( conn.client.digest && ( op != Protocol::RET ) ) {
+				conn.client.chain = DigestChain::extend(
+				    conn.client.key, conn.client.chain, run.addr[run.length] );
+			}
+			if ( ++run.length == MAX_BATCH_EVENTS ) {
+				continues += validate_run( conn.client, run );
+			}
+			continue;
+		}
+		continues += validate_run( conn.client, run );
+		if ( conn.client.killed ) {
+			break;
+		}
+		continues += dispatch( conn.client, op, (const char *) addr );
+		if ( op == Protocol::EXECVE ) {
+			conn.prev = 0;
+		}
+	}
+	if ( !conn.client.killed ) {
+		continues += validate_run( conn.client, run );
+	}
+	if ( conn.client.killed ) {
+		return false;
+	}
+	publish_depth( conn.client );
 
-	// Tell the client process it may continue
-	const int bytes_sent = write( sock, Continue::message, Continue::size );
-	Utilities::assert( bytes_sent == Continue::size, "write() failed." );
+	// Keep the partial message left for next time
+	if ( conn.version == 0 ) {
+		start = 0;
+	}
+	conn.partial_len = end - start;
+	memcpy( conn.partial, &buffer[start], conn.partial_len );
+	return true;
 }
 
-#if 0
-// Called when the process forks
-void fork_handler( pointer_stack &stk, const char *const buffer, const int ) {
-	// TODO
-	/* new_proc_handler(); */
-	Utilities::log_error( "FORK_HANDLER" );
+// The most bytes an epoll shard receives from a connection per turn, by priority class
+// What a connection sent beyond that is left in its socket until the next turn
+static const size_t qos_quantum[NUM_QOS_CLASSES] = {
+	RECV_BUFFER_SIZE, RECV_BUFFER_SIZE / 4, RECV_BUFFER_SIZE / 16
+};
+
+// How long the connections of a priority class waited to be served once ready
+struct QueueingDelay {
+	/** The number of times a connection of the class was served */
+	std::atomic<unsigned long> turns;
+	/** The total and the longest wait, in nanoseconds */
+	std::atomic<unsigned long> total;
+	std::atomic<unsigned long> longest;
+};
+
+// The queueing delay of each priority class since the last report
+static QueueingDelay queueing_delays[NUM_QOS_CLASSES];
+
+// Note that a connection of priority class qos was served after waiting delay nanoseconds
+static inline void note_delay( const unsigned int qos, const unsigned long delay ) {
+	QueueingDelay &d = queueing_delays[qos];
+	d.turns.fetch_add( 1, std::memory_order_relaxed );
+	d.total.fetch_add( delay, std::memory_order_relaxed );
+	unsigned long longest = d.longest.load( std::memory_order_relaxed );
+	while ( ( delay > longest ) &&
+	        !d.longest.compare_exchange_weak( longest, delay,
+	                                          std::memory_order_relaxed ) ) {
+	}
 }
 
-// Called when the process starts a new thread
-void thread_handler( pointer_stack &stk, const char *const buffer, const int ) {
-	// TODO
-	/* while ( ! stk.empty() ) { */
-	/* 	stk.pop(); */
-	/* } */
-	/* new_proc_handler(); */
-	Utilities::log_error( "THREAD_HANDLER" );
+// Note that bytes were received from the client, if its metrics are served
+static inline void note_received( Client &client, const size_t bytes ) {
+	if ( client.metrics != nullptr ) {
+		ClientMetrics::bump( client.metrics->bytes, bytes );
+	}
 }
-#endif
+
+// Note that n rets of the client received at received_at were just acknowledged,
+// if its metrics are served
+static inline void note_acknowledged( Client &client, const unsigned long n,
+                                      const unsigned long received_at ) {
+	if ( ( client.metrics != nullptr ) && ( n > 0 ) ) {
+		client.metrics->note_rets( n, now_ns() - received_at );
+	}
+}
+
+// Log the queueing delay of each priority class served since the last report
+static void report_queueing_delays() {
+	for ( unsigned int i = 0; i < NUM_QOS_CLASSES; ++i ) {
+		QueueingDelay &d = queueing_delays[i];
+		const unsigned long turns = d.turns.exchange( 0, std::memory_order_relaxed );
+		const unsigned long total = d.total.exchange( 0, std::memory_order_relaxed );
+		const unsigned long longest = d.longest.exchange( 0, std::memory_order_relaxed );
+		if ( turns > 0 ) {
+			Utilities::log( "Priority class ", QoSClass::name( i ), ": served ", turns,
+			                " times, queueing delay mean ", total / turns / 1000,
+			                "us, max ", longest / 1000, "us" );
+		}
+	}
+}
+
+// Append the counters of the clients that disconnected since the last call to stats_file
+// A daemon writes nothing if no client disconnected
+static void write_stats( const std::string &stats_file ) {
+	Stats::ThreadList done;
+	{
+		std::lock_guard<std::mutex> lock( finished_stats_lock );
+		done.swap( finished_stats );
+	}
+	if ( !daemon_mode || !done.empty() ) {
+		Stats::append_json( stats_file, "server", done );
+	}
+}
+
+// Receive whatever conn has sent into buffer, which must be RECV_BUFFER_SIZE bytes
+// At most the quantum of the connection's priority class is received
+// Every complete message received is handled, then their rets are acknowledged together
+// The acknowledgements and any other replies are queued, to be sent by the caller
+// ready_at is when conn was found to be readable
+// Returns false if the client disconnected or was killed
+static bool receive( Connection &conn, char *const buffer,
+                     const unsigned long ready_at ) {
+
+	// Receive after the partial message left from last time
+	// The socket is non-blocking, and may have been found readable spuriously
+	memcpy( buffer, conn.partial, conn.partial_len );
+	const size_t room =
+	    std::min( RECV_BUFFER_SIZE - conn.partial_len, qos_quantum[conn.client.qos] );
+	const ssize_t bytes_recv = recv( conn.sock, &buffer[conn.partial_len], room, 0 );
+	if ( ( bytes_recv == -1 ) && ( ( errno == EAGAIN ) || ( errno == EINTR ) ) ) {
+		return true;
+	}
+	if ( ( bytes_recv == -1 ) && ( errno != ECONNRESET ) ) {
+		client_failed( conn.client, "recv() failed: ", strerror( errno ) );
+		return false;
+	}
+	if ( bytes_recv <= 0 ) {
+		if ( conn.partial_len != 0 ) {
+			client_failed( conn.client, "disconnected mid message" );
+		}
+		return false;
+	}
+	note_received( conn.client, (size_t) bytes_recv );
+
+	// Handle them, then tell the client process every ret handled may continue
+	// A client that was killed is treated as disconnected
+	unsigned long continues = 0;
+	if ( !consume( conn, buffer, conn.partial_len + (size_t) bytes_recv, continues ) ) {
+		return false;
+	}
+	queue_continues( conn.client, conn.version, continues );
+	note_acknowledged( conn.client, continues, ready_at );
+	return true;
+}
+
+// Handle the messages the client of conn pushed onto its ring, in buffer, which must be
+// RECV_BUFFER_SIZE bytes. Ring slots always hold v1 messages
+// At most the quantum of the connection's priority class is handled. If rung, the
+// doorbell is drained first; once the client closed its socket, everything it pushed
+// before exiting is handled. Rets are acknowledged on the ring, other replies are queued
+// Returns false if the client disconnected or was killed
+static bool receive_ring( Connection &conn, char *const buffer, const bool rung,
+                          const unsigned long ready_at ) {
+	bool connected = true;
+	if ( rung ) {
+		char bells[64];
+		const ssize_t n = recv( conn.sock, bells, sizeof( bells ), MSG_DONTWAIT );
+		connected = ( n > 0 ) || ( ( n == -1 ) && ( errno == EAGAIN || errno == EINTR ) );
+	}
+	ShmRing &ring = *conn.ring;
+	const size_t most = connected ? qos_quantum[conn.client.qos] : RECV_BUFFER_SIZE;
+	do {
+		size_t end = 0;
+		while ( ( end + MESSAGE_SIZE <= most ) && ring.pop( &buffer[end] ) ) {
+			end += MESSAGE_SIZE;
+		}
+		if ( end == 0 ) {
+			break;
+		}
+		note_received( conn.client, end );
+		unsigned long continues = 0;
+		if ( !consume( conn, buffer, end, continues ) ) {
+			return false;
+		}
+		ring.ack( (uint32_t) continues );
+		note_acknowledged( conn.client, continues, ready_at );
+	} while ( !connected );
+	return connected;
+}
+
+
+// Adds fd to the epoll instance epfd, to be woken when fd is readable
+static void watch( const int epfd, const int fd ) {
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	Utilities::assert( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &event ) == 0,
+	                   "epoll_ctl() failed." );
+}
+
+// Watch the socket of conn, already added to epfd, for what the connection waits for
+// It is readable while its client has not too many replies queued, and
+// writable while any are
+static void rewatch( const int epfd, Connection &conn ) {
+	uint32_t events = 0;
+	if ( conn.client.out.size() < MAX_UNSENT_SIZE ) {
+		events |= EPOLLIN;
+	}
+	if ( !conn.client.out.empty() ) {
+		events |= EPOLLOUT;
+	}
+	if ( events == conn.events ) {
+		return;
+	}
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = events;
+	event.data.fd = conn.sock;
+	Utilities::assert( epoll_ctl( epfd, EPOLL_CTL_MOD, conn.sock, &event ) == 0,
+	                   "epoll_ctl() failed." );
+	conn.events = events;
+}
+
+// Send as much of the replies queued for the client of conn as its socket takes
+// The socket is non-blocking; the rest is sent once it is writable
+// Returns false if the client is gone
+static bool flush( const int epfd, Connection &conn ) {
+	std::string &out = conn.client.out;
+	size_t sent = 0;
+	while ( sent < out.size() ) {
+		const ssize_t n = send( conn.sock, &out[sent], out.size() - sent, MSG_NOSIGNAL );
+		if ( n >= 0 ) {
+			sent += (size_t) n;
+		}
+		else if ( errno == EAGAIN ) {
+			break;
+		}
+		else if ( errno != EINTR ) {
+			if ( ( errno != EPIPE ) && ( errno != ECONNRESET ) ) {
+				client_failed( conn.client, "send() failed: ", strerror( errno ) );
+			}
+			return false;
+		}
+	}
+	out.erase( 0, sent );
+	rewatch( epfd, conn );
+	return true;
+}
+
+// Writes 1 to the eventfd fd
+static void notify( const int fd ) {
+	const uint64_t one = 1;
+	Utilities::assert( write( fd, &one, sizeof( one ) ) == sizeof( one ),
+	                   "write() failed." );
+}
+
+// Reads the count of the eventfd fd
+static uint64_t drain( const int fd ) {
+	uint64_t count;
+	Utilities::assert( read( fd, &count, sizeof( count ) ) == sizeof( count ),
+	                   "read() failed." );
+	return count;
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                        io_uring                       */
+/*                                                       */
+/*********************************************************/
+
+
+// The kinds of request an io_uring shard makes
+// The kind is stored above the file descriptor of the request in its user data
+enum UringRequest : uint64_t { URING_RECV = 1, URING_SEND, URING_WAKE, URING_CANCEL };
+
+// Returns the user data of the request of kind on fd
+static inline uint64_t uring_data( const UringRequest kind, const int fd ) {
+	return ( (uint64_t) kind << 32 ) | (uint32_t) fd;
+}
+
+// Start receiving whatever conn sends, until it disconnects or the receive is cancelled
+static void arm_receive( Uring &uring, Connection &conn ) {
+	conn.receiving = true;
+	uring.recv_multishot( conn.sock, uring_data( URING_RECV, conn.sock ) );
+}
+
+// Queue a send of the rest of the replies being sent to conn
+static void send_rest( Uring &uring, Connection &conn ) {
+	const char *const rest = &conn.sending[conn.sending.size() - conn.in_flight];
+	uring.send( conn.sock, rest, conn.in_flight, uring_data( URING_SEND, conn.sock ) );
+}
+
+// Queue a send of every reply queued for the client of conn, unless one is in flight
+static void send_owed( Uring &uring, Connection &conn ) {
+	if ( ( conn.in_flight > 0 ) || conn.client.out.empty() || conn.gone ) {
+		return;
+	}
+	conn.sending.swap( conn.client.out );
+	conn.client.out.clear();
+	conn.in_flight = conn.sending.size();
+	send_rest( uring, conn );
+}
+
+// Stop serving conn, whose client is gone or was killed
+// Shutting the socket down ends its receive, after which the connection is closed
+static void drop( Connection &conn ) {
+	if ( !conn.gone ) {
+		conn.gone = true;
+		shutdown( conn.sock, SHUT_RDWR );
+	}
+}
+
+/*********************************************************/
+/*                                                       */
+/*                         Shards                        */
+/*                                                       */
+/*********************************************************/
+
+
+// The Shard constructor
+Shard::Shard( const int id_, const int finished_ )
+    : id( id_ ), epfd( epoll_create1( EPOLL_CLOEXEC ) ),
+      wake( eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK ) ), finished( finished_ ), load( 0 ),
+      give_to( -1 ) {
+	Utilities::assert( epfd != -1, "epoll_create1() failed." );
+	Utilities::assert( wake != -1, "eventfd() failed." );
+	watch( epfd, wake );
+}
+
+// Give the connection conn to shard
+static void give( Shard &shard, std::unique_ptr<Connection> conn ) {
+	{
+		std::lock_guard<std::mutex> lock( shard.inbox_lock );
+		shard.inbox.push_back( std::move( conn ) );
+	}
+	notify( shard.wake );
+}
+
+// Take every connection in the shard's inbox
+// An io_uring worker may be woken more than once for one write, so wake may
+// already be drained; it is non-blocking, and reading nothing is fine
+// An epoll worker makes each socket non-blocking, and serves each ring right away, as
+// it may hold messages pushed while the connection had no shard
+static void take_inbox( Shard &shard ) {
+	uint64_t count;
+	const ssize_t ignored = read( shard.wake, &count, sizeof( count ) );
+	(void) ignored;
+	std::vector<std::unique_ptr<Connection>> taken;
+	{
+		std::lock_guard<std::mutex> lock( shard.inbox_lock );
+		taken.swap( shard.inbox );
+	}
+	for ( auto &conn : taken ) {
+		const int fd = conn->sock;
+		if ( shard.uring != nullptr ) {
+			arm_receive( *shard.uring, *conn );
+		}
+		else {
+			const int flags = fcntl( fd, F_GETFL );
+			Utilities::assert( fcntl( fd, F_SETFL, flags | O_NONBLOCK ) == 0,
+			                   "fcntl() failed." );
+			watch( shard.epfd, fd );
+			conn->events = EPOLLIN;
+			rewatch( shard.epfd, *conn );
+			if ( conn->ring != nullptr ) {
+				shard.unparked.push_back( fd );
+			}
+		}
+		shard.connections[fd] = std::move( conn );
+	}
+}
+
+// If the rebalancer asked, give the shard's busiest connection to another shard
+// A shard with a single connection keeps it; moving it would not spread the load
+static void rebalance( Shard &shard, std::vector<std::unique_ptr<Shard>> &shards ) {
+	const int to = shard.give_to.exchange( -1 );
+	if ( ( to == -1 ) || ( shard.connections.size() < 2 ) ) {
+		return;
+	}
+
+	// Find the busiest connection, and forget old activity
+	auto busiest = shard.connections.begin();
+	for ( auto i = shard.connections.begin(); i != shard.connections.end(); ++i ) {
+		if ( i->second->recent > busiest->second->recent ) {
+			busiest = i;
+		}
+	}
+	for ( auto &i : shard.connections ) {
+		i.second->recent /= 2;
+	}
+
+	// Move it
+	// An io_uring connection moves once its receive is cancelled and its sends are done
+	const int fd = busiest->first;
+	if ( shard.uring != nullptr ) {
+		Connection &conn = *busiest->second;
+		if ( !conn.gone && ( conn.move_to == -1 ) ) {
+			conn.move_to = to;
+			shard.uring->cancel( uring_data( URING_RECV, fd ),
+			                     uring_data( URING_CANCEL, fd ) );
+		}
+		return;
+	}
+	Utilities::assert( epoll_ctl( shard.epfd, EPOLL_CTL_DEL, fd, nullptr ) == 0,
+	                   "epoll_ctl() failed." );
+	Utilities::log( "Moving client on fd ", fd, " from shard ", shard.id, " to ", to );
+	give( *shards[to], std::move( busiest->second ) );
+	shard.connections.erase( busiest );
+}
+
+// Pin the calling thread to cpu
+static void pin( const unsigned int cpu ) {
+	cpu_set_t set;
+	CPU_ZERO( &set );
+	CPU_SET( cpu, &set );
+	if ( pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) != 0 ) {
+		Utilities::log( "Could not pin shard worker to cpu ", cpu );
+	}
+}
+
+// Once the shard's io_uring has no request left on conn, close or move it as intended
+static void settle( Shard &shard, std::vector<std::unique_ptr<Shard>> &shards,
+                    Connection &conn ) {
+	if ( conn.receiving || ( conn.in_flight > 0 ) ) {
+		return;
+	}
+	const int fd = conn.sock;
+	if ( conn.gone ) {
+		Utilities::log( "Client on fd ", fd, " disconnected." );
+		forget( conn.client );
+		shard.connections.erase( fd );
+		close( fd );
+		notify( shard.finished );
+	}
+	else if ( !conn.client.out.empty() ) {
+		send_owed( *shard.uring, conn );
+	}
+	else if ( conn.move_to != -1 ) {
+		const int to = conn.move_to;
+		conn.move_to = -1;
+		Utilities::log( "Moving client on fd ", fd, " from shard ", shard.id, " to ",
+		                to );
+		give( *shards[to], std::move( shard.connections.at( fd ) ) );
+		shard.connections.erase( fd );
+	}
+}
+
+// Handle the receive of res bytes into the buffer flags names on conn
+// ready_at is when the receive's completion was reaped
+// Returns the number of messages handled
+static unsigned long on_received( Shard &shard, Connection &conn, char *const scratch,
+                                  const int res, const unsigned int flags,
+                                  const unsigned long ready_at ) {
+	Uring &uring = *shard.uring;
+	const unsigned long before = conn.recent;
+
+	// Data that arrived after the client was dropped is ignored
+	if ( res > 0 ) {
+		char *const data = uring.buffer( flags );
+		if ( !conn.gone ) {
+			note_received( conn.client, (size_t) res );
+
+			// The partial message left from last time goes in front of the data
+			const char *buffer = data;
+			if ( conn.partial_len > 0 ) {
+				memcpy( scratch, conn.partial, conn.partial_len );
+				memcpy( &scratch[conn.partial_len], data, (size_t) res );
+				buffer = scratch;
+			}
+			unsigned long continues = 0;
+			if ( consume( conn, buffer, conn.partial_len + (size_t) res, continues ) ) {
+				queue_continues( conn.client, conn.version, continues );
+				send_owed( uring, conn );
+				note_acknowledged( conn.client, continues, ready_at );
+			}
+			else {
+				drop( conn );
+			}
+		}
+		uring.recycle( flags );
+	}
+
+	// The client disconnected, or its socket failed
+	// Running out of buffers or being cancelled is not the client's doing
+	else if ( ( res != -ENOBUFS ) && ( res != -ECANCELED ) ) {
+		if ( ( res < 0 ) && ( res != -ECONNRESET ) ) {
+			client_failed( conn.client, "recv() failed: ", strerror( -res ) );
+		}
+		else if ( !conn.gone && ( conn.partial_len != 0 ) ) {
+			client_failed( conn.client, "disconnected mid message" );
+		}
+		conn.gone = true;
+	}
+
+	// The kernel ended the receive; start another unless the connection is leaving
+	if ( ( flags & IORING_CQE_F_MORE ) == 0 ) {
+		conn.receiving = false;
+		if ( !conn.gone && ( conn.move_to == -1 ) ) {
+			arm_receive( uring, conn );
+		}
+	}
+	return conn.recent - before;
+}
+
+// Handle the completion of the send on conn, which sent res bytes
+// A send is retried by the kernel until every byte is sent, so a short one is unexpected;
+// the rest is queued as another send, which must complete before any later send starts
+// Replies queued while the send was in flight are sent next, as the client may be
+// waiting for all of them before it sends anything more
+static void on_sent( Uring &uring, Connection &conn, const int res ) {
+	if ( res < 0 ) {
+		conn.in_flight = 0;
+		if ( ( res != -EPIPE ) && ( res != -ECONNRESET ) ) {
+			client_failed( conn.client, "send() failed: ", strerror( -res ) );
+		}
+		drop( conn );
+		return;
+	}
+	conn.in_flight -= std::min( conn.in_flight, (size_t) res );
+	if ( ( conn.in_flight > 0 ) && !conn.gone ) {
+		send_rest( uring, conn );
+		return;
+	}
+	conn.in_flight = 0;
+	send_owed( uring, conn );
+}
+
+// A completion an io_uring shard has yet to handle
+struct UringCompletion {
+	/** The completion's user data, result, and flags */
+	uint64_t data;
+	int res;
+	unsigned int flags;
+	/** The priority class of the connection it belongs to */
+	unsigned int qos;
+};
+
+// The worker of an io_uring shard
+// Each connection has a multishot receive armed into the shard's provided buffers,
+// and every reply is sent asynchronously. Every request queued while handling
+// completions is submitted by the same system call that waits for the next ones,
+// except that the replies to each priority class are submitted before the
+// completions of lower classes are handled
+[[noreturn]] static void
+run_uring_shard( Shard *const shard, std::vector<std::unique_ptr<Shard>> *const shards ) {
+	Uring &uring = *shard->uring;
+	std::vector<char> scratch( RECV_BUFFER_SIZE );
+	std::vector<UringCompletion> completions;
+	uring.poll_multishot( shard->wake, uring_data( URING_WAKE, shard->wake ) );
+	while ( true ) {
+		uring.submit_and_wait();
+		const unsigned long ready_at = now_ns();
+
+		// Take new connections, then order the other completions by priority class
+		// Completions of the same connection keep their order
+		completions.clear();
+		uring.for_each_completion( [&]( const uint64_t data, const int res,
+		                                const unsigned int flags ) {
+			const UringRequest kind = (UringRequest)( data >> 32 );
+			if ( kind == URING_WAKE ) {
+				take_inbox( *shard );
+				if ( ( flags & IORING_CQE_F_MORE ) == 0 ) {
+					uring.poll_multishot( shard->wake, data );
+				}
+				return;
+			}
+			const auto found = shard->connections.find( (int) (uint32_t) data );
+			const unsigned int qos =
+			    ( found == shard->connections.end() ) ? 0 : found->second->client.qos;
+			completions.push_back( { data, res, flags, qos } );
+		} );
+		std::stable_sort( completions.begin(), completions.end(),
+		                  []( const UringCompletion &a, const UringCompletion &b ) {
+			                  return a.qos < b.qos;
+		                  } );
+
+		// Handle each completion, highest class first
+		unsigned long handled = 0;
+		for ( size_t i = 0; i < completions.size(); ++i ) {
+			const UringCompletion &c = completions[i];
+			if ( ( i > 0 ) && ( c.qos != completions[i - 1].qos ) ) {
+				uring.submit();
+			}
+			const UringRequest kind = (UringRequest)( c.data >> 32 );
+			const int fd = (int) (uint32_t) c.data;
+			const auto found = shard->connections.find( fd );
+			if ( ( kind == URING_CANCEL ) || ( found == shard->connections.end() ) ) {
+				continue;
+			}
+			Connection &conn = *found->second;
+			if ( kind == URING_RECV ) {
+				note_delay( c.qos, now_ns() - ready_at );
+				handled += on_received( *shard, conn, scratch.data(), c.res, c.flags,
+				                        ready_at );
+			}
+			else {
+				on_sent( uring, conn, c.res );
+			}
+			settle( *shard, *shards, conn );
+		}
+
+		// Report the load, then move a connection if asked to
+		shard->load.fetch_add( handled, std::memory_order_relaxed );
+		rebalance( *shard, *shards );
+	}
+}
+
+// The worker of shard
+// Serves the shard's connections with io_uring if use_uring, otherwise with epoll
+// The ring is set up by the worker, the only thread that submits to it
+// Serves the shard's connections until the process exits
+[[noreturn]] static void run_shard( Shard *const shard,
+                                    std::vector<std::unique_ptr<Shard>> *const shards,
+                                    const bool use_uring ) {
+	pin( shard->id % std::max( 1u, std::thread::hardware_concurrency() ) );
+	if ( use_uring ) {
+		shard->uring.reset(
+		    new Uring( URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE ) );
+		Utilities::assert( shard->uring->is_valid(), "Could not set up io_uring" );
+		run_uring_shard( shard, shards );
+	}
+	std::vector<char> buffer( RECV_BUFFER_SIZE );
+	struct epoll_event events[MAX_EVENTS];
+	std::vector<std::pair<Connection *, uint32_t>> ready;
+	std::vector<int> unparked;
+	while ( true ) {
+		const int timeout = shard->unparked.empty() ? -1 : 0;
+		const int n = epoll_wait( shard->epfd, events, MAX_EVENTS, timeout );
+		if ( ( n == -1 ) && ( errno == EINTR ) ) {
+			continue;
+		}
+		Utilities::assert( n != -1, "epoll_wait() failed." );
+		const unsigned long ready_at = now_ns();
+
+		// Take new connections, then order the ready ones by priority class
+		// Rings not parked last turn are ready too, even if their doorbell was not rung
+		ready.clear();
+		unparked.swap( shard->unparked );
+		for ( int i = 0; i < n; ++i ) {
+			const int fd = events[i].data.fd;
+			if ( fd == shard->wake ) {
+				take_inbox( *shard );
+			}
+			else {
+				const uint32_t flags = events[i].events;
+				ready.emplace_back( shard->connections.at( fd ).get(), flags );
+			}
+		}
+		for ( const int fd : unparked ) {
+			const auto found = shard->connections.find( fd );
+			if ( ( found != shard->connections.end() ) &&
+			     std::none_of( ready.begin(), ready.end(),
+			                   [&]( const std::pair<Connection *, uint32_t> &r ) {
+				                   return r.first == found->second.get();
+			                   } ) ) {
+				ready.emplace_back( found->second.get(), 0 );
+			}
+		}
+		unparked.clear();
+		std::stable_sort( ready.begin(), ready.end(),
+		                  []( const std::pair<Connection *, uint32_t> &a,
+		                      const std::pair<Connection *, uint32_t> &b ) {
+			                  return a.first->client.qos < b.first->client.qos;
+		                  } );
+
+		// Serve each, highest class first
+		// A connection is read from when readable, or if it has a ring, then sent
+		// whatever it is owed
+		unsigned long handled = 0;
+		for ( const auto &r : ready ) {
+			Connection &conn = *r.first;
+			const int fd = conn.sock;
+			const bool readable = ( r.second & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) != 0;
+			note_delay( conn.client.qos, now_ns() - ready_at );
+
+			// A client sent messages, was sent replies, or disconnected
+			const unsigned long before = conn.recent;
+			bool served = true;
+			if ( conn.ring != nullptr ) {
+				served = receive_ring( conn, buffer.data(), readable, ready_at );
+			}
+			else if ( readable ) {
+				served = receive( conn, buffer.data(), ready_at );
+			}
+			if ( served && flush( shard->epfd, conn ) ) {
+				handled += conn.recent - before;
+				if ( ( conn.ring != nullptr ) &&
+				     !conn.ring->park( now_ns(), RING_SPIN_NS ) ) {
+					shard->unparked.push_back( fd );
+				}
+			}
+			else {
+				Utilities::log( "Client on fd ", fd, " disconnected." );
+				forget( conn.client );
+				shard->connections.erase( fd );
+				close( fd );
+				notify( shard->finished );
+			}
+		}
+
+		// Report the load, then move a connection if asked to
+		shard->load.fetch_add( handled, std::memory_order_relaxed );
+		rebalance( *shard, *shards );
+	}
+}
+
+// Compare the load each shard had since the last call
+// If the busiest shard is overloaded, ask it to give a connection to the idlest one
+static void check_balance( std::vector<std::unique_ptr<Shard>> &shards ) {
+	int busiest = 0;
+	int idlest = 0;
+	std::vector<unsigned long> loads( shards.size() );
+	for ( unsigned int i = 0; i < shards.size(); ++i ) {
+		loads[i] = shards[i]->load.exchange( 0, std::memory_order_relaxed );
+		busiest = ( loads[i] > loads[busiest] ) ? i : busiest;
+		idlest = ( loads[i] < loads[idlest] ) ? i : idlest;
+	}
+	if ( ( loads[busiest] >= REBALANCE_MIN_LOAD ) &&
+	     ( loads[busiest] > REBALANCE_RATIO * loads[idlest] ) ) {
+		shards[busiest]->give_to.store( idlest );
+	}
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
 
 
 // The external shadow stack function
-// Communicates with the unix socket server file descriptor sock
-void start_external_shadow_stack( const int sock ) {
+// Accepts clients from the unix socket or TCP server file descriptor server_sock
+// connected, unless it is -1, is served before any client is accepted
+// Clients are sharded across num_shards pinned worker threads by connection order, or
+// one per cpu if num_shards is 0
+// Shards use io_uring if io_uring is true and the kernel supports it, else epoll
+// Ring clients are always served with epoll, which waits for their doorbells
+// A daemon serves clients of any process group, and never returns
+// qos is the number of the highest priority class a client may be in. A daemon lets
+// unix socket clients of its own user be in any class
+// If stats_file is not empty, the counters of disconnected clients are appended to it
+// If metrics_socket is not empty, live metrics are served on it from the start
+void start_external_shadow_stack( const int server_sock, const Transport &transport,
+                                  unsigned int num_shards, bool io_uring,
+                                  const bool daemon, const unsigned int qos,
+                                  const int connected, const std::string &stats_file,
+                                  const std::string &metrics_socket ) {
 	TerminateOnDestruction tod;
+	daemon_mode = daemon;
+	fill_continues();
+	if ( !metrics_socket.empty() ) {
+		ServerMetrics::serve( metrics_socket );
+	}
 
-	// Create the message handling function map and populate it
-	std::map<std::string, message_handler> call_correct_function{
-		{ std::string( NewSignal::header ), add_wildcard },
-		/* { std::string( Thread::header ), thread_handler }, */
-		{ std::string( Execve::header ), clear_stack },
-		/* { std::string( Fork::header ), fork_handler }, */
-		{ std::string( Call::header ), call_handler },
-		{ std::string( Ret::header ), ret_handler }
-	};
+	// Watch the server socket, and an eventfd that counts clients finished
+	const int epfd = epoll_create1( EPOLL_CLOEXEC );
+	Utilities::assert( epfd != -1, "epoll_create1() failed." );
+	const int finished = eventfd( 0, EFD_CLOEXEC );
+	Utilities::assert( finished != -1, "eventfd() failed." );
+	watch( epfd, server_sock );
+	watch( epfd, finished );
 
-	// Create the shadow stack
-	pointer_stack stk;
+	// Start the shards, which serve unix socket, TCP, and ring clients
+	// They are never freed, their workers run until the process exits
+	auto &shards = *new std::vector<std::unique_ptr<Shard>>();
+	if ( num_shards == 0 ) {
+		num_shards = std::max( 1u, std::thread::hardware_concurrency() );
+	}
+	for ( unsigned int i = 0; i < num_shards; ++i ) {
+		shards.emplace_back( new Shard( (int) i, finished ) );
+	}
+	if ( io_uring && transport.is_shm ) {
+		Utilities::log( "Ring clients are served with epoll, not io_uring" );
+		io_uring = false;
+	}
+	if ( io_uring && !Uring::is_supported() ) {
+		Utilities::log_error( "io_uring is not supported here, using epoll instead" );
+		io_uring = false;
+	}
+	for ( auto &shard : shards ) {
+		std::thread( run_shard, shard.get(), &shards, io_uring ).detach();
+	}
+	Utilities::log( "Started ", num_shards, " server shards using ",
+	                io_uring ? "io_uring" : "epoll", ", comparing rets with ",
+	                BatchValidator::implementation() );
 
-	// The buffer used to receive messages
-	// The first few bytes will contain the type of message
-	// The last few bytes will contain the pointer itself (or 0)
-	const int num_bytes = MESSAGE_HEADER_LENGTH + POINTER_SIZE;
-	char buffer[num_bytes];
+	// Serve the client connected on fd client, dealing clients to the shards in turn
+	// A ring client is sent its ring first, whose slots always hold v1 messages
+	unsigned long next_id = 0;
+	unsigned long active = 0;
+	auto serve = [&]( const int client ) {
+		if ( next_id == 0 ) {
+			StartupProfile::mark( "server accept" );
+		}
+		++active;
+		std::unique_ptr<Connection> conn( new Connection( client ) );
+		if ( transport.is_shm ) {
+			const int ring_fd = ShmRing::create();
+			QS::send_fd( client, ring_fd );
+			conn->ring.reset( new ShmRing( ring_fd ) );
+			close( ring_fd );
+			conn->version = PROTOCOL_V1;
+			conn->parse = parse_v1;
+		}
+		conn->client.metrics = ServerMetrics::connect();
+		if ( !transport.is_tcp ) {
+			find_credentials( conn->client, client );
+		}
+		const bool trusted = daemon && !transport.is_tcp && is_same_user( client );
+		conn->client.best_qos = trusted ? 0 : qos;
+		conn->client.qos = std::max( default_qos, conn->client.best_qos );
+		give( *shards[next_id % shards.size()], std::move( conn ) );
+		++next_id;
+	};
+	if ( connected != -1 ) {
+		serve( connected );
+	}
 
-	// Loop until the child sends 0 bytes
-	const char *msg = nullptr;
-	while ( msg == nullptr ) {
+	// Loop until every client has disconnected
+	struct epoll_event events[MAX_EVENTS];
+	unsigned long last_report = now_ns();
+	while ( daemon || ( next_id == 0 ) || ( active > 0 ) ) {
+		const int n = epoll_wait( epfd, events, MAX_EVENTS, REBALANCE_INTERVAL );
+		if ( ( n == -1 ) && ( errno == EINTR ) ) {
+			continue;
+		}
+		Utilities::assert( n != -1, "epoll_wait() failed." );
+		for ( int i = 0; i < n; ++i ) {
+			const int fd = events[i].data.fd;
 
-		// Read num_bytes bytes, wait until all bytes have been read.
-		const int bytes_recv = recv( sock, buffer, num_bytes, MSG_WAITALL );
-		Utilities::assert( ( bytes_recv == num_bytes ) || ( bytes_recv == 0 ),
-		                   "recv() failed" );
+			// A new client
+			// A private server rejects unix socket clients of other users; its TCP
+			// server is on loopback, and TCP clients have no credentials to check
+			if ( fd == server_sock ) {
+				const int client = QS::accept_client( server_sock );
+				if ( daemon || transport.is_tcp || is_same_user( client ) ) {
+					serve( client );
+				}
+				else {
+					Utilities::log_error( "Rejected a client of another user on fd ",
+					                      client );
+					close( client );
+				}
+			}
 
-		// If the client disconnected, break
-		if ( bytes_recv == 0 ) {
-			Utilities::log( "Client Disconnected." );
-			break;
+			// Clients have finished
+			else {
+				active -= drain( finished );
+			}
 		}
 
-		// Verify the message is valid then call the appropriate function
-		const std::string message_type( buffer, MESSAGE_HEADER_LENGTH );
-		const auto function_ptr = call_correct_function[message_type];
-		Utilities::verbose_log( "Got message header: ",
-		                        std::string( buffer, MESSAGE_HEADER_LENGTH ) );
-		if ( function_ptr == nullptr ) {
-			Utilities::log_error( "Sever recieved wrong type of message.",
-			                      "\n\tMessage header was: ", message_type );
+		// Spread the load, and drop what forks left behind
+		if ( shards.size() > 1 ) {
+			check_balance( shards );
+		}
+		sweep_forks();
+
+		// A daemon reports periodically, as it never finishes
+		if ( daemon && ( now_ns() - last_report >= REPORT_INTERVAL * 1000000ul ) ) {
+			report_queueing_delays();
+			if ( !stats_file.empty() ) {
+				write_stats( stats_file );
+			}
+			last_report = now_ns();
 		}
-		Utilities::assert( function_ptr != nullptr,
-		                   "Sever recieved wrong type of message!" );
-		function_ptr( stk, &buffer[MESSAGE_HEADER_LENGTH], sock );
 	}
 
-	// If the program reached this point, another
-	// thread / process must be active, gracefully return
+	// Every client has disconnected, gracefully return
+	// The shards are left blocked; the process exits after this
+	report_queueing_delays();
+	if ( !stats_file.empty() ) {
+		write_stats( stats_file );
+	}
+	Utilities::log( "All clients disconnected." );
 	tod.disable();
 }
@@ -3,11 +3,35 @@
 #define __EXTERNAL_STACK_SERVER_HPP__
 
 
+#include "transport.hpp"
+
+#include <string>
+
+
 /** The function for running the external shadow stack sever
- *  Sock must be the file descriptor to the unix domain
- *  server that connects the shadow stack program to the
- *  dynamorio client managing the program to be run */
-void start_external_shadow_stack( const int sock );
+ *  server_sock must be the file descriptor of the listening unix
+ *  domain or TCP server that the dynamorio clients managing the program
+ *  to be run connect to. Every connection gets its own shadow stack.
+ *  Returns once a client has connected and every client has disconnected
+ *  transport must be the transport the clients were told to use
+ *  Clients are served by num_shards worker threads, one per cpu if 0
+ *  The workers use io_uring if io_uring is true and the kernel supports it, else epoll
+ *  Ring clients are always served with epoll
+ *  If daemon is true, clients may belong to any process group, and this never returns.
+ *  When a client fails verification, only its process group is killed. Otherwise, unix
+ *  socket clients of other users are rejected
+ *  qos is the number of the highest priority class a client may ask for. A daemon lets
+ *  unix socket clients of its own user ask for any class
+ *  If connected is not -1, it is a client already connected, served as if accepted
+ *  If stats_file is not empty, the counters of each client are appended to it as JSON
+ *  once every client has disconnected, or periodically by a daemon
+ *  If metrics_socket is not empty, live metrics are served in the Prometheus text format
+ *  on a unix socket at that path, see ServerMetrics */
+void start_external_shadow_stack( const int server_sock, const Transport &transport,
+                                  unsigned int num_shards, bool io_uring,
+                                  const bool daemon, const unsigned int qos,
+                                  const int connected, const std::string &stats_file,
+                                  const std::string &metrics_socket );
 
 
 #endif
@@ -1,4 +1,5 @@
 #include "group.hpp"
+#include "group_stats.hpp"
 #include "utilities.hpp"
 #include "constants.hpp"
 
@@ -144,7 +145,8 @@ void Group::setup() {
 	terminate_already_called = true;
 	TerminateOnDestruction tod;
 
-	// Print the message via the correct function then flush the buffers
+	// Print the message via the correct function, report the group's
+	// statistics if they are gathered, then flush the buffers
 	if ( msg != nullptr ) {
 		if ( is_error ) {
 			Utilities::log_error( msg );
@@ -153,6 +155,7 @@ void Group::setup() {
 			Utilities::message( msg );
 		}
 	}
+	GroupStats::report();
 	fflush( nullptr );
 
 	// Kill the process group
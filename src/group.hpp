@@ -61,6 +61,7 @@ struct Group {
 	 *  If is_error is set to true, msg is logged to the
 	 *  ERROR file, otherwise it is logged via Utilities::message
 	 *  If msg is nullptr, no message is passed.
+	 *  If the group's statistics are gathered, they are reported first
 	 *  If this function ends up calling itself,
 	 *  immediate process group termination will occur
 	 *  setup() **DOES NOT** have to be called before this function
@@ -0,0 +1,338 @@
+#include "group_stats.hpp"
+#include "utilities.hpp"
+#include "constants.hpp"
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+#include <atomic>
+
+
+// Identifies the segment, so a file descriptor the target reused is not mistaken for it
+#define GROUP_STATS_MAGIC 0x4452535353544154ul
+
+// The seals of the segment: its size never changes, nor do its seals
+#define GROUP_STATS_SEALS ( F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL )
+
+// The statistics of a process
+// A slot is claimed by storing its pid; every other field starts at 0
+// Slots are aligned so processes do not share cache lines
+struct alignas( 64 ) GroupStats::Slot {
+
+	/** Add the counters of stats to the slot's */
+	void add( const ThreadStats &stats ) {
+		calls.fetch_add( stats.calls, std::memory_order_relaxed );
+		rets.fetch_add( stats.rets, std::memory_order_relaxed );
+		wildcard_pushes.fetch_add( stats.wildcard_pushes, std::memory_order_relaxed );
+		wildcard_pops.fetch_add( stats.wildcard_pops, std::memory_order_relaxed );
+		execve_clears.fetch_add( stats.execve_clears, std::memory_order_relaxed );
+		depth_total.fetch_add( stats.depth_total, std::memory_order_relaxed );
+		unsigned long max = max_depth.load( std::memory_order_relaxed );
+		while ( ( stats.max_depth > max ) &&
+		        !max_depth.compare_exchange_weak( max, stats.max_depth,
+		                                          std::memory_order_relaxed ) ) {
+		}
+		for ( unsigned int i = 0; i < STATS_DEPTH_BUCKETS; ++i ) {
+			depth_histogram[i].fetch_add( stats.depth_histogram[i],
+			                              std::memory_order_relaxed );
+		}
+	}
+
+	/** Returns a copy of the slot's counters */
+	ThreadStats load() const {
+		ThreadStats ret;
+		ret.calls = calls.load( std::memory_order_relaxed );
+		ret.rets = rets.load( std::memory_order_relaxed );
+		ret.wildcard_pushes = wildcard_pushes.load( std::memory_order_relaxed );
+		ret.wildcard_pops = wildcard_pops.load( std::memory_order_relaxed );
+		ret.execve_clears = execve_clears.load( std::memory_order_relaxed );
+		ret.max_depth = max_depth.load( std::memory_order_relaxed );
+		ret.depth_total = depth_total.load( std::memory_order_relaxed );
+		for ( unsigned int i = 0; i < STATS_DEPTH_BUCKETS; ++i ) {
+			ret.depth_histogram[i] = depth_histogram[i].load( std::memory_order_relaxed );
+		}
+		return ret;
+	}
+
+	/** The pid of the process, 0 until the slot is claimed */
+	std::atomic<pid_t> pid;
+	/** The pid of the process's parent */
+	std::atomic<pid_t> parent;
+	/** The number of protected images the process ran, 1 more than its execs
+	 *  The launcher's slot runs none */
+	std::atomic<unsigned long> images;
+	/** The number of threads started in the process */
+	std::atomic<unsigned long> threads;
+	/** True once the process exited, so a process that reuses its pid is not mistaken
+	 *  for an image of it */
+	std::atomic<bool> exited;
+
+	/** The counters of ThreadStats */
+	std::atomic<unsigned long> calls;
+	std::atomic<unsigned long> rets;
+	std::atomic<unsigned long> wildcard_pushes;
+	std::atomic<unsigned long> wildcard_pops;
+	std::atomic<unsigned long> execve_clears;
+	std::atomic<unsigned long> max_depth;
+	std::atomic<unsigned long> depth_total;
+	std::atomic<unsigned long> depth_histogram[STATS_DEPTH_BUCKETS];
+};
+
+// The layout of the segment
+// A new file is zero filled, so every slot starts free
+struct GroupStats::Segment {
+	/** GROUP_STATS_MAGIC, set by the launcher before any client starts */
+	uint64_t magic;
+	/** The pid of the launcher that created the segment */
+	pid_t launcher;
+	/** True if statistics are gathered. Set before any client starts */
+	bool enabled;
+	/** The path of the statistics file. Set before any client starts */
+	char path[PATH_MAX];
+	/** True once the group's view was reported */
+	std::atomic<bool> reported;
+	/** The number of slots claimed, which may exceed GROUP_STATS_SLOTS */
+	std::atomic<unsigned int> claimed;
+	/** The slots */
+	Slot slots[GROUP_STATS_SLOTS];
+};
+
+
+// Initalize statics
+int GroupStats::fd = -1;
+GroupStats::Segment *GroupStats::segment = nullptr;
+GroupStats::Slot *GroupStats::slot = nullptr;
+
+
+/*********************************************************/
+/*                                                       */
+/*                     Private functions                 */
+/*                                                       */
+/*********************************************************/
+
+
+// Returns true if fd has the seals and size of a segment
+// A sealed file cannot be shrunk, so a segment this passes can be mapped safely
+static bool is_sealed_segment( const int fd, const size_t size ) {
+	const int seals = fcntl( fd, F_GET_SEALS );
+	struct stat st;
+	return ( seals != -1 ) && ( ( seals & GROUP_STATS_SEALS ) == GROUP_STATS_SEALS ) &&
+	       ( fstat( fd, &st ) == 0 ) && ( st.st_size == (off_t) size );
+}
+
+// Claim a new slot for this process, nullptr if none is left
+// Slots are handed out in order, so claiming one takes a single atomic add
+GroupStats::Slot *GroupStats::claim() {
+	const unsigned int i = segment->claimed.fetch_add( 1, std::memory_order_relaxed );
+	if ( i >= GROUP_STATS_SLOTS ) {
+		Utilities::log_error( "Every group statistics slot is taken, process ", getpid(),
+		                      " is not counted" );
+		return nullptr;
+	}
+	Slot &ret = segment->slots[i];
+	ret.parent.store( getppid(), std::memory_order_relaxed );
+	ret.pid.store( getpid(), std::memory_order_release );
+	return &ret;
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Create the segment and export it to every process started after
+// The file descriptor is not closed on exec, so every image can map it
+// The segment is sealed at its size, so no process can shrink it under another
+void GroupStats::create() {
+	fd = (int) syscall( SYS_memfd_create, "dr_shadow_stack_stats", MFD_ALLOW_SEALING );
+	Utilities::assert( fd != -1, "memfd_create() failed." );
+	Utilities::assert( ftruncate( fd, sizeof( Segment ) ) == 0, "ftruncate() failed." );
+	Utilities::assert( fcntl( fd, F_ADD_SEALS, GROUP_STATS_SEALS ) == 0,
+	                   "fcntl() failed." );
+	void *const mem =
+	    mmap( nullptr, sizeof( Segment ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	Utilities::assert( mem != MAP_FAILED, "mmap() failed." );
+	segment = (Segment *) mem;
+	segment->magic = GROUP_STATS_MAGIC;
+	segment->launcher = getpid();
+	const std::string fd_str = std::to_string( fd );
+	Utilities::assert( setenv( DR_SS_ENV_STATS_FD, fd_str.c_str(), true ) == 0,
+	                   "setenv() failed." );
+	Utilities::log( DR_SS_ENV_STATS_FD " environment variable set to ", fd_str );
+}
+
+// Gather statistics, and report them to the log and to path
+void GroupStats::enable( const std::string &path ) {
+	Utilities::assert( path.size() < PATH_MAX, "The statistics file path is too long" );
+	memcpy( segment->path, path.c_str(), path.size() + 1 );
+	segment->enabled = true;
+	slot = claim();
+}
+
+// Remove the segment, so no process inherits it
+void GroupStats::destroy() {
+	munmap( (void *) segment, sizeof( Segment ) );
+	close( fd );
+	segment = nullptr;
+	fd = -1;
+	Utilities::assert( unsetenv( DR_SS_ENV_STATS_FD ) == 0, "unsetenv() failed." );
+}
+
+// Map the segment the launcher exported, if it gathers statistics
+// The target may have closed the segment's file descriptor before an exec, and reused
+// it, so the file is only mapped if it is sealed like the segment, and only used if
+// it starts with the magic number
+void GroupStats::attach() {
+	const char *const fd_str = getenv( DR_SS_ENV_STATS_FD );
+	if ( ( fd_str == nullptr ) || ( fd_str[0] == (char) 0 ) ) {
+		return;
+	}
+	fd = (int) strtol( fd_str, nullptr, 10 );
+	if ( !is_sealed_segment( fd, sizeof( Segment ) ) ) {
+		Utilities::log_error( "fd ", fd, " is not the group statistics segment" );
+		fd = -1;
+		return;
+	}
+	void *const mem =
+	    mmap( nullptr, sizeof( Segment ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if ( mem == MAP_FAILED ) {
+		Utilities::log_error( "Could not map the group statistics segment on fd ", fd );
+		fd = -1;
+		return;
+	}
+	segment = (Segment *) mem;
+	if ( segment->magic != GROUP_STATS_MAGIC ) {
+		Utilities::log_error( "fd ", fd, " is not the group statistics segment" );
+	}
+	if ( ( segment->magic != GROUP_STATS_MAGIC ) || !segment->enabled ) {
+		munmap( mem, sizeof( Segment ) );
+		segment = nullptr;
+		fd = -1;
+		return;
+	}
+
+	// An exec'd image keeps the slot of the image before it
+	const pid_t pid = getpid();
+	slot = nullptr;
+	const unsigned int claimed =
+	    std::min( segment->claimed.load( std::memory_order_relaxed ),
+	              (unsigned int) GROUP_STATS_SLOTS );
+	for ( unsigned int i = 0; i < claimed; ++i ) {
+		Slot &s = segment->slots[i];
+		if ( ( s.pid.load( std::memory_order_acquire ) == pid ) &&
+		     !s.exited.load( std::memory_order_relaxed ) ) {
+			slot = &s;
+		}
+	}
+	if ( slot == nullptr ) {
+		slot = claim();
+	}
+	if ( slot != nullptr ) {
+		slot->images.fetch_add( 1, std::memory_order_relaxed );
+	}
+}
+
+// Claim a slot for a child after a fork
+// The child runs its parent's image, so that image counts as its first
+void GroupStats::on_fork() {
+	if ( segment != nullptr ) {
+		slot = claim();
+		if ( slot != nullptr ) {
+			slot->images.store( 1, std::memory_order_relaxed );
+		}
+	}
+}
+
+// Called when the process exits, so its slot is not reused
+void GroupStats::on_exit() {
+	if ( slot != nullptr ) {
+		slot->exited.store( true, std::memory_order_relaxed );
+	}
+}
+
+// Count a thread that started in this process
+void GroupStats::note_thread() {
+	if ( slot != nullptr ) {
+		slot->threads.fetch_add( 1, std::memory_order_relaxed );
+	}
+}
+
+// Add stats to the counters of this process
+void GroupStats::add( const ThreadStats &stats ) {
+	if ( slot != nullptr ) {
+		slot->add( stats );
+	}
+}
+
+// If statistics are gathered, log the view of the group and append it to the
+// statistics file. Only the first call in the group reports
+void GroupStats::report() {
+	if ( ( segment == nullptr ) || !segment->enabled ||
+	     segment->reported.exchange( true ) ) {
+		return;
+	}
+
+	// Describe each process
+	ThreadStats total;
+	unsigned long processes = 0;
+	unsigned long images = 0;
+	unsigned long threads = 0;
+	std::stringstream json;
+	json << "{\"source\":\"group\",\"launcher\":" << segment->launcher
+	     << ",\"processes\":[";
+	const unsigned int claimed =
+	    std::min( segment->claimed.load( std::memory_order_relaxed ),
+	              (unsigned int) GROUP_STATS_SLOTS );
+	for ( unsigned int i = 0; i < claimed; ++i ) {
+		const Slot &s = segment->slots[i];
+		const pid_t pid = s.pid.load( std::memory_order_acquire );
+		if ( pid == 0 ) {
+			continue;
+		}
+		const ThreadStats stats = s.load();
+		const unsigned long n_images = s.images.load( std::memory_order_relaxed );
+		const unsigned long n_threads = s.threads.load( std::memory_order_relaxed );
+
+		// The launcher only counts anything if it ran the server
+		if ( ( n_images == 0 ) && ( stats.calls == 0 ) &&
+		     ( stats.wildcard_pushes == 0 ) ) {
+			continue;
+		}
+		const std::string counters = stats.to_json();
+		json << ( ( processes == 0 ) ? "" : "," ) << "{\"pid\":" << pid
+		     << ",\"parent\":" << s.parent.load( std::memory_order_relaxed )
+		     << ",\"images\":" << n_images << ",\"threads\":" << n_threads
+		     << ",\"exited\":"
+		     << ( s.exited.load( std::memory_order_relaxed ) ? "true" : "false" ) << ","
+		     << &counters[1];
+		Utilities::log_error( "Group statistics: process ", pid,
+		                      ( pid == segment->launcher ) ? " (launcher)" : "", ": ",
+		                      n_images, " images, ", n_threads, " threads, ",
+		                      stats.calls, " calls, ", stats.rets, " rets, max depth ",
+		                      stats.max_depth, ", average depth ",
+		                      stats.average_depth() );
+		total.add( stats );
+		images += n_images;
+		threads += n_threads;
+		++processes;
+	}
+	json << "],\"total\":" << total.to_json() << "}\n";
+
+	// Then the group
+	Utilities::log_error( "Group statistics: ", processes, " processes, ", images,
+	                      " images, ", threads, " threads, ", total.calls, " calls, ",
+	                      total.rets, " rets, ", total.wildcard_pushes, " wildcards, ",
+	                      total.execve_clears, " execve clears, max depth ",
+	                      total.max_depth, ", average depth ", total.average_depth() );
+	Stats::append_line( segment->path, json.str() );
+}
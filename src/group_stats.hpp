@@ -0,0 +1,77 @@
+/** @file */
+#ifndef __GROUP_STATS_HPP__
+#define __GROUP_STATS_HPP__
+
+#include "thread_stats.hpp"
+
+#include <string>
+
+
+/** The number of processes whose statistics the group can hold
+ *  Processes started after every slot is taken are not counted */
+#define GROUP_STATS_SLOTS 1024
+
+
+/** A static class that gathers the statistics of every process of the group
+ *  The launcher creates a shared memory segment, which every client instance maps
+ *  through a file descriptor inherited across fork and exec. Each process has a slot
+ *  of its own, claimed without locks, which its image after an exec keeps using.
+ *  The group's view is reported once, when the group is terminated */
+struct GroupStats {
+
+	/** Disable construction */
+	GroupStats() = delete;
+
+	/** Launcher only: create the segment and export it to every process started after
+	 *  Statistics are not gathered until enable is called */
+	static void create();
+
+	/** Launcher only: gather statistics, and report them to the log and to path
+	 *  The launcher's own slot is claimed for the counters of the server, if any */
+	static void enable( const std::string &path );
+
+	/** Launcher only: remove the segment, so no process inherits it */
+	static void destroy();
+
+	/** Client only: map the segment the launcher exported, if it gathers statistics
+	 *  Claims a slot for this process, or keeps the one its previous image used */
+	static void attach();
+
+	/** Client only: called in a child after a fork, to claim a slot of its own */
+	static void on_fork();
+
+	/** Client only: called when the process exits, so its slot is not reused */
+	static void on_exit();
+
+	/** Count a thread that started in this process */
+	static void note_thread();
+
+	/** Add stats to the counters of this process */
+	static void add( const ThreadStats &stats );
+
+	/** If statistics are gathered, log the view of the group and append it to the
+	 *  statistics file as a line of JSON. Only the first call in the group reports */
+	static void report();
+
+  private:
+	/** The statistics of a process. Defined in group_stats.cpp */
+	struct Slot;
+
+	/** The layout of the segment. Defined in group_stats.cpp */
+	struct Segment;
+
+	/** Claim a new slot for this process, nullptr if none is left */
+	static Slot *claim();
+
+	/** The file descriptor of the segment, -1 if there is none */
+	static int fd;
+
+	/** The segment, nullptr if it is not mapped */
+	static Segment *segment;
+
+	/** The slot of this process, nullptr if it has none */
+	static Slot *slot;
+};
+
+
+#endif
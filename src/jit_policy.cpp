@@ -0,0 +1,13 @@
+#include "jit_policy.hpp"
+#include "utilities.hpp"
+
+#include "string.h"
+
+
+// The constructor
+JITPolicy::JITPolicy( const char *const p )
+    : str( Utilities::safe_strdup( p ) ),
+      is_full( strcmp( str, FULL_JIT_POLICY_FLAG ) == 0 ),
+      is_bitmap( strcmp( str, BITMAP_JIT_POLICY_FLAG ) == 0 ),
+      is_track( strcmp( str, TRACK_JIT_POLICY_FLAG ) == 0 ),
+      is_valid_policy( is_full || is_bitmap || is_track ) {}
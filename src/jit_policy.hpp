@@ -0,0 +1,52 @@
+/** @file */
+#ifndef __JIT_POLICY_HPP__
+#define __JIT_POLICY_HPP__
+
+
+/** The flag that selects full shadow stack checking inside JIT regions */
+#define FULL_JIT_POLICY_FLAG "full"
+
+/** The flag that selects bitmap return checking inside JIT regions */
+#define BITMAP_JIT_POLICY_FLAG "bitmap"
+
+/** The flag that selects track-only handling of JIT regions */
+#define TRACK_JIT_POLICY_FLAG "track"
+
+/** The default JIT policy */
+#define DEFAULT_JIT_POLICY FULL_JIT_POLICY_FLAG
+
+
+/** A tiny struct that represents how writable-executable (JIT) regions are handled
+ *  In full mode, JIT code is treated like any other code.
+ *  In bitmap mode, calls inside JIT regions are not pushed onto the shadow stack;
+ *  instead their return sites are recorded in a per-region bitmap, and returns
+ *  into a JIT region are only checked against that bitmap.
+ *  In track mode, returns into JIT regions are only counted, never checked */
+struct JITPolicy final {
+
+	/** The constructor
+	 *  Reads the policy in from p and stores a copy of it */
+	JITPolicy( const char *const p );
+
+	/** Disable the default constructor */
+	JITPolicy() = delete;
+
+
+	/** The policy */
+	const char *const str;
+
+	/** True if policy = full */
+	const bool is_full;
+
+	/** True if policy = bitmap */
+	const bool is_bitmap;
+
+	/** True if policy = track */
+	const bool is_track;
+
+	/** True if any policy is valid */
+	const bool is_valid_policy;
+};
+
+
+#endif
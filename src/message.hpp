@@ -7,6 +7,8 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <endian.h>
 
 
 /*********************************************************/
@@ -95,10 +97,14 @@ class Message final {
 			// Setup the internals of the message
 			MESSAGE_INTERNALS( false )
 
-			/** The constructor */
+			/** The constructor
+			 *  The body is the pointer sized integer at ptr, stored in wire order */
 			explicit MessageType<false, Info>( const char *const ptr ) {
+				uintptr_t body;
+				memcpy( &body, ptr, POINTER_SIZE );
+				body = wire_order( body );
 				memcpy( message, header, MESSAGE_HEADER_LENGTH );
-				memcpy( &message[MESSAGE_HEADER_LENGTH], ptr, POINTER_SIZE );
+				memcpy( &message[MESSAGE_HEADER_LENGTH], &body, POINTER_SIZE );
 			}
 
 			/** The message an instanation of the class holds
@@ -157,6 +163,42 @@ class Message final {
 		static const constexpr char *const header = "FORK";
 	};
 
+	/** A class containing the header of Child message */
+	struct ChildInfo final {
+		/** The header of the Child message */
+		static const constexpr char *const header = "CHLD";
+	};
+
+	/** A class containing the header of ForkFailed message */
+	struct ForkFailedInfo final {
+		/** The header of the ForkFailed message */
+		static const constexpr char *const header = "NOFK";
+	};
+
+	/** A class containing the header of Fill message */
+	struct FillInfo final {
+		/** The header of the Fill message */
+		static const constexpr char *const header = "FILL";
+	};
+
+	/** A class containing the header of Priority message */
+	struct PriorityInfo final {
+		/** The header of the Priority message */
+		static const constexpr char *const header = "PRIO";
+	};
+
+	/** A class containing the header of Digest message */
+	struct DigestInfo final {
+		/** The header of the Digest message */
+		static const constexpr char *const header = "DGST";
+	};
+
+	/** A class containing the header of Hello message */
+	struct HelloInfo final {
+		/** The header of the Hello message */
+		static const constexpr char *const header = "HELO";
+	};
+
 	/** A class containing the header of Thread message */
 	struct ThreadInfo final {
 		/** The header of the Thread message */
@@ -164,6 +206,21 @@ class Message final {
 	};
 
   public:
+	/** Converts the pointer sized integer x between host byte order and wire order
+	 *  Message bodies and raw integers in replies are sent little-endian, so hosts of
+	 *  either byte order agree on them. On a little-endian host this does nothing */
+	static inline uintptr_t wire_order( const uintptr_t x ) {
+		return ( sizeof( x ) == sizeof( uint64_t ) ) ? (uintptr_t) htole64( (uint64_t) x )
+		                                            : (uintptr_t) htole32( (uint32_t) x );
+	}
+
+	/** Returns the body of the message in buffer, in host byte order */
+	static inline uintptr_t body_of( const char *const buffer ) {
+		uintptr_t body;
+		memcpy( &body, &buffer[MESSAGE_HEADER_LENGTH], POINTER_SIZE );
+		return wire_order( body );
+	}
+
 	/** A function used to check if a char * may represent a message of type T */
 	template <class T> static bool is_a_valid( const char *const buffer ) {
 		return !memcmp( buffer, T::header, MESSAGE_HEADER_LENGTH );
@@ -180,10 +237,22 @@ class Message final {
 	typedef const Msg::HeaderOnly<NewSignalInfo> NewSignal;
 	/** A typedef for the execve message */
 	typedef const Msg::HeaderOnly<ExecveInfo> Execve;
-	/** A typedef for the fork message */
-	typedef const Msg::HeaderOnly<ForkInfo> Fork;
-	/** A typedef for the thread message */
-	typedef const Msg::HeaderOnly<ThreadInfo> Thread;
+	/** A typedef for the fork message, whose body is a fork token */
+	typedef const Msg::WithBody<ForkInfo> Fork;
+	/** A typedef for the child message, whose body is the token of its fork */
+	typedef const Msg::WithBody<ChildInfo> Child;
+	/** A typedef for the fork failed message, whose body is the token of the fork */
+	typedef const Msg::WithBody<ForkFailedInfo> ForkFailed;
+	/** A typedef for the fill message, whose body is the most frames to send back */
+	typedef const Msg::WithBody<FillInfo> Fill;
+	/** A typedef for the priority message, whose body is a priority class number */
+	typedef const Msg::WithBody<PriorityInfo> Priority;
+	/** A typedef for the digest message, whose body is the digest of an epoch */
+	typedef const Msg::WithBody<DigestInfo> Digest;
+	/** A typedef for the thread message, whose body is a thread id */
+	typedef const Msg::WithBody<ThreadInfo> Thread;
+	/** A typedef for the hello message, whose body is a protocol version */
+	typedef const Msg::WithBody<HelloInfo> Hello;
 };
 
 
@@ -226,20 +295,19 @@ template <typename Msg> void recv_msg( const int sock ) {
 	char buffer[Msg::size];
 	const int bytes_recv = recv( sock, buffer, Msg::size, MSG_WAITALL );
 	Utilities::assert( bytes_recv == Msg::size, "Did not get full size message!" );
-	const constexpr auto is_msg = Message::is_a_valid<Message::Continue>;
+	const constexpr auto is_msg = Message::is_a_valid<Msg>;
 	Utilities::assert( is_msg( buffer ), "Received incorrect message!" );
 }
 
-/** Reads a only Msg from sock
- *  This function is **NOT** re-entrant */
-template <typename Msg> const char *recv_msg_and_body( const int sock ) {
+/** Reads a non-header only Msg from sock into buffer, which the caller provides so
+ *  that threads may receive at once */
+template <typename Msg>
+void recv_msg_and_body( const int sock, char ( &buffer )[Msg::size] ) {
 	static_assert( Msg::header_only == false, "wrong recv_msg called." );
-	static char buffer[Msg::size];
 	const int bytes_recv = recv( sock, buffer, Msg::size, MSG_WAITALL );
 	Utilities::assert( bytes_recv == Msg::size, "Did not get full size message!" );
-	const constexpr auto is_msg = Message::is_a_valid<Message::Continue>;
+	const constexpr auto is_msg = Message::is_a_valid<Msg>;
 	Utilities::assert( is_msg( buffer ), "Received incorrect message!" );
-	return buffer;
 }
 
 
@@ -40,9 +40,74 @@ variables_map parse_args_helper( const int argc, const char *const argv[],
 		( MODE, value<std::string>(),
 		  "The mode in which the shadow stack is used"
 		  "\n\t" INTERNAL_MODE_FLAG " -- internal shadow stack mode"
-		  "\n\t" EXTERNAL_MODE_FLAG " -- external shadow stack mode" )
-		( TARGET, value<std::string>()->required(), "The target executable" )
-		( TARGET_ARGS, value<std::vector<std::string>>(), "The target executable's arguments" )
+		  "\n\t" EXTERNAL_MODE_FLAG " -- external shadow stack mode"
+		  "\n\t" HYBRID_MODE_FLAG " -- hybrid mode: the top of the stack is kept "
+		  "internally, the rest externally" )
+		( JIT_POLICY, value<std::string>()->default_value( DEFAULT_JIT_POLICY ),
+		  "How writable-executable (JIT) code regions are protected"
+		  "\n\t" FULL_JIT_POLICY_FLAG " -- treat JIT code like any other code"
+		  "\n\t" BITMAP_JIT_POLICY_FLAG " -- check returns into JIT code against a bitmap"
+		  "\n\t" TRACK_JIT_POLICY_FLAG " -- only count returns into JIT code" )
+		( TRANSPORT, value<std::string>()->default_value( DEFAULT_TRANSPORT ),
+		  "How external mode messages are sent to the server"
+		  "\n\t" SOCKET_TRANSPORT_FLAG " -- over the server's unix socket"
+		  "\n\t" SHM_TRANSPORT_FLAG " -- over a shared memory ring"
+		  "\n\t" TCP_TRANSPORT_FLAG " -- over TCP; a daemon's socket path is then an "
+		  "address of the form [<IPv4 address>:]<port>, on 127.0.0.1 if no address is "
+		  "given. TCP peers are not authenticated" )
+		( ASYNC_WINDOW, value<unsigned int>()->default_value( 0 ),
+		  "External mode only: the number of rets the server may still be verifying "
+		  "while the target runs on. Every ret is verified before a sensitive "
+		  "syscall. 0 waits for the server on every ret" )
+		( HYBRID_WINDOW, value<unsigned int>()->default_value( DEFAULT_HYBRID_WINDOW ),
+		  "Hybrid mode only: the number of frames at the top of each thread's shadow "
+		  "stack kept by the client. Deeper frames are kept by the server. At least 2" )
+		( FAILOVER_SLO, value<unsigned long>()->default_value( 0 ),
+		  "External mode only: if a ret waits for the server for longer than this many "
+		  "microseconds, its thread verifies its rets itself until the server catches "
+		  "up. 0 disables this" )
+		( DIGEST_INTERVAL, value<unsigned int>()->default_value( 0 ),
+		  "External mode only: have each thread keep the frames it pushes and verify the "
+		  "rets into them itself, sending only the rets past them, which get no reply. "
+		  "Every this many calls, rets, and signals, and before each sensitive syscall, "
+		  "the frames left are sent along with a keyed hash chain digest of them, which "
+		  "the server checks. 0 disables this" )
+		( QOS, value<std::string>()->default_value( DEFAULT_QOS_CLASS ),
+		  "External and hybrid mode only: the priority class of the target's threads on "
+		  "the server. Ready threads of higher classes are served first, and may send "
+		  "more per turn; no class is starved. A daemon's is the highest class targets "
+		  "of other users may ask for"
+		  "\n\t" INTERACTIVE_QOS_FLAG " -- the highest class"
+		  "\n\t" NORMAL_QOS_FLAG " -- the default class"
+		  "\n\t" BATCH_QOS_FLAG " -- the lowest class" )
+		( SERVER_THREADS, value<unsigned int>()->default_value( 0 ),
+		  "External and hybrid mode only: the number of pinned threads the server "
+		  "verifies socket clients with. 0 uses one per cpu" )
+		( IO_URING, bool_switch(),
+		  "External and hybrid mode only: have the server threads verify socket clients "
+		  "with io_uring instead of epoll, if the kernel supports it" )
+		( STARTUP_PROFILE, bool_switch(), "Log how long each startup phase takes" )
+		( ZYGOTE, value<std::string>()->default_value( "" ),
+		  "Run the target as a zygote: once it reaches main, fork a protected "
+		  "worker for each connection to this unix socket path" )
+		( DAEMON, value<std::string>()->default_value( "" ),
+		  "Run no target; instead serve external mode shadow stacks as a long-lived "
+		  "daemon listening on this unix socket path" )
+		( ATTACH, value<std::string>()->default_value( "" ),
+		  "External and hybrid mode only: have the target verified by the daemon "
+		  "listening on this unix socket path instead of starting a server for it. The "
+		  "transport must match the daemon's" )
+		( STATS_FILE, value<std::string>()->default_value( "" ),
+		  "Append the event counters of each thread, and their total, to this file as a "
+		  "line of JSON: internal mode clients write theirs when they exit, the server "
+		  "writes those of its clients once they have disconnected" )
+		( METRICS_SOCKET, value<std::string>()->default_value( "" ),
+		  "External and hybrid mode only: have the server serve live metrics in the "
+		  "Prometheus text format on this unix socket path, over HTTP or to any client "
+		  "that connects" )
+		( TARGET, value<std::string>(), "The target executable" )
+		( TARGET_ARGS, value<std::vector<std::string>>(),
+		  "The target executable's arguments" )
 	;
 	/* clang-format on */
 
@@ -90,6 +155,16 @@ variables_map parse_args_helper( const int argc, const char *const argv[],
 			    MODE, variable_value( std::string( DEFAULT_MODE ), false ) ) );
 		}
 
+		// A daemon has no target, every other use requires one
+		if ( args.count( TARGET ) == 0 ) {
+			if ( args[DAEMON].as<std::string>().empty() ) {
+				incorrect_usage();
+			}
+			args.insert(
+				std::make_pair( TARGET, variable_value( std::string(), false ) ) );
+			return std::move( args );
+		}
+
 		// Collect all unregistered and positional
 		// arguments to create the target's argument list
 		*target_args = collect_unrecognized( raw_parsed.options, include_positional );
@@ -117,8 +192,20 @@ variables_map parse_args_helper( const int argc, const char *const argv[],
 
 
 // Args constructor
-Args::Args( SSMode &&mode_, const std::string &targ, std::vector<std::string> &targ_args )
-    : mode( std::move( mode_ ) ), target( targ ), target_args( std::move( targ_args ) ) {}
+Args::Args( SSMode &&mode_, JITPolicy &&jit_, Transport &&transport_, QoSClass &&qos_,
+            const unsigned int window, const unsigned int hybrid,
+            const unsigned long failover, const unsigned int digest,
+            const unsigned int threads, const bool uring, const bool profile,
+            const std::string &zyg, const std::string &dmn, const std::string &att,
+            const std::string &stats, const std::string &metrics,
+            const std::string &targ, std::vector<std::string> &targ_args )
+    : mode( std::move( mode_ ) ), jit_policy( std::move( jit_ ) ),
+      transport( std::move( transport_ ) ), qos( std::move( qos_ ) ),
+      async_window( window ), hybrid_window( hybrid ), failover_slo( failover ),
+      digest_interval( digest ), server_threads( threads ), io_uring( uring ),
+      startup_profile( profile ), zygote( zyg ), daemon( dmn ), attach( att ),
+      stats_file( stats ), metrics_socket( metrics ), target( targ ),
+      target_args( std::move( targ_args ) ) {}
 
 
 // Returns an args_t containing the parsed arguments
@@ -135,7 +222,104 @@ Args parse_args( const int argc, const char *const argv[] ) {
 		incorrect_usage();
 	}
 
+	// Verify the JIT policy
+	JITPolicy jit( vm[JIT_POLICY].as<std::string>().c_str() );
+	if ( !jit.is_valid_policy ) {
+		Utilities::log_error( "Invalid JIT policy given" );
+		incorrect_usage();
+	}
+
+	// Verify the transport
+	Transport transport( vm[TRANSPORT].as<std::string>().c_str() );
+	if ( !transport.is_valid_transport ) {
+		Utilities::log_error( "Invalid transport given" );
+		incorrect_usage();
+	}
+
+	// A daemon runs no target, and a target attached to a daemon has no server of its own
+	const std::string daemon = vm[DAEMON].as<std::string>();
+	const std::string attach = vm[ATTACH].as<std::string>();
+	if ( !daemon.empty() && ( !attach.empty() || ( vm.count( TARGET_ARGS ) > 0 ) ||
+	                          !vm[TARGET].as<std::string>().empty() ) ) {
+		Utilities::log_error( "A daemon runs no target" );
+		incorrect_usage();
+	}
+	if ( !attach.empty() && !mode.uses_server ) {
+		Utilities::log_error(
+			"Only external and hybrid mode targets can attach to a daemon" );
+		incorrect_usage();
+	}
+
+	// Verify the priority class, which only the server uses
+	// A daemon's is the highest class launchers of other users may ask for
+	QoSClass qos( vm[QOS].as<std::string>().c_str() );
+	if ( !qos.is_valid_class ) {
+		Utilities::log_error( "Invalid priority class given" );
+		incorrect_usage();
+	}
+	if ( !qos.is_normal && daemon.empty() && !mode.uses_server ) {
+		Utilities::log_error(
+			"Only external and hybrid mode targets and daemons have a priority class" );
+		incorrect_usage();
+	}
+
+	// The daemon counts the events of the targets attached to it
+	const std::string stats_file = vm[STATS_FILE].as<std::string>();
+	if ( !attach.empty() && !stats_file.empty() ) {
+		Utilities::log_error(
+			"The statistics of an attached target are written by its daemon" );
+		incorrect_usage();
+	}
+
+	// Only a server has metrics to serve
+	const std::string metrics_socket = vm[METRICS_SOCKET].as<std::string>();
+	if ( !metrics_socket.empty() && daemon.empty() && !mode.uses_server ) {
+		Utilities::log_error( "Only external and hybrid mode servers serve metrics" );
+		incorrect_usage();
+	}
+	if ( !metrics_socket.empty() && !attach.empty() ) {
+		Utilities::log_error(
+			"The metrics of an attached target are served by its daemon" );
+		incorrect_usage();
+	}
+
+	// Hybrid mode spills half its window at a time, so it needs room for two frames
+	const unsigned int hybrid_window = vm[HYBRID_WINDOW].as<unsigned int>();
+	if ( mode.is_hybrid && ( hybrid_window < 2 ) ) {
+		Utilities::log_error( "The hybrid window must hold at least 2 frames" );
+		incorrect_usage();
+	}
+
+	// A thread fails over when a ret waits too long for the server
+	const unsigned long failover_slo = vm[FAILOVER_SLO].as<unsigned long>();
+	if ( ( failover_slo > 0 ) && !mode.is_external ) {
+		Utilities::log_error( "Only external mode threads can fail over" );
+		incorrect_usage();
+	}
+
+	// Digest mode threads verify the rets into their own frames, and never wait for the
+	// server otherwise. The key of each epoch comes back over the thread's socket
+	const unsigned int digest_interval = vm[DIGEST_INTERVAL].as<unsigned int>();
+	if ( ( digest_interval > 0 ) && !mode.is_external ) {
+		Utilities::log_error( "Only external mode verifies rets by digest" );
+		incorrect_usage();
+	}
+	if ( ( digest_interval > 0 ) &&
+	     ( ( vm[ASYNC_WINDOW].as<unsigned int>() > 0 ) || ( failover_slo > 0 ) ) ) {
+		Utilities::log_error( "Digests cannot be used with an async window or failover" );
+		incorrect_usage();
+	}
+	if ( ( digest_interval > 0 ) && transport.is_shm ) {
+		Utilities::log_error( "Digests need a socket, they cannot be sent over a ring" );
+		incorrect_usage();
+	}
+
 	// Extract the arguments and return the result
 	return std::move(
-	    Args( std::move( mode ), vm[TARGET].as<std::string>(), target_args ) );
+	    Args( std::move( mode ), std::move( jit ), std::move( transport ),
+	          std::move( qos ), vm[ASYNC_WINDOW].as<unsigned int>(), hybrid_window,
+	          failover_slo, digest_interval, vm[SERVER_THREADS].as<unsigned int>(),
+	          vm[IO_URING].as<bool>(), vm[STARTUP_PROFILE].as<bool>(),
+	          vm[ZYGOTE].as<std::string>(), daemon, attach, stats_file, metrics_socket,
+	          vm[TARGET].as<std::string>(), target_args ) );
 }
@@ -2,6 +2,9 @@
 #ifndef __PARSE_ARGS_HPP__
 #define __PARSE_ARGS_HPP__
 
+#include "jit_policy.hpp"
+#include "qos_class.hpp"
+#include "transport.hpp"
 #include "ss_mode.hpp"
 
 #include <boost/program_options.hpp>
@@ -23,6 +26,52 @@
 /** The key to the variables map that stores the mode */
 #define MODE "ss_mode"
 
+/** The key to the variables map that stores the JIT region policy */
+#define JIT_POLICY "jit_policy"
+
+/** The key to the variables map that stores if a startup profile is requested */
+#define STARTUP_PROFILE "startup_profile"
+
+/** The key to the variables map that stores the zygote socket path */
+#define ZYGOTE "zygote"
+
+/** The key to the variables map that stores the external mode transport */
+#define TRANSPORT "transport"
+
+/** The key to the variables map that stores the async window size */
+#define ASYNC_WINDOW "async_window"
+
+/** The key to the variables map that stores the number of frames hybrid mode keeps
+ *  locally */
+#define HYBRID_WINDOW "hybrid_window"
+
+/** The key to the variables map that stores the longest a ret may wait for the server */
+#define FAILOVER_SLO "failover_slo"
+
+/** The key to the variables map that stores the number of events between digests */
+#define DIGEST_INTERVAL "digest_interval"
+
+/** The key to the variables map that stores the priority class of the target's threads */
+#define QOS "qos"
+
+/** The key to the variables map that stores the number of server threads */
+#define SERVER_THREADS "server_threads"
+
+/** The key to the variables map that stores if the server should use io_uring */
+#define IO_URING "io_uring"
+
+/** The key to the variables map that stores the socket path to run a daemon on */
+#define DAEMON "daemon"
+
+/** The key to the variables map that stores the socket path of the daemon to attach to */
+#define ATTACH "attach"
+
+/** The key to the variables map that stores the path statistics are written to */
+#define STATS_FILE "stats_file"
+
+/** The key to the variables map that stores the socket path metrics are served on */
+#define METRICS_SOCKET "metrics_socket"
+
 
 /*********************************************************/
 /*                                                       */
@@ -35,11 +84,69 @@
 struct Args {
 
 	/** Constructor */
-	Args( SSMode &&mode_, const std::string &targ, std::vector<std::string> &targ_args );
+	Args( SSMode &&mode_, JITPolicy &&jit_, Transport &&transport_, QoSClass &&qos_,
+	      const unsigned int window, const unsigned int hybrid,
+	      const unsigned long failover, const unsigned int digest,
+	      const unsigned int threads, const bool uring, const bool profile,
+	      const std::string &zyg, const std::string &dmn, const std::string &att,
+	      const std::string &stats, const std::string &metrics,
+	      const std::string &targ, std::vector<std::string> &targ_args );
 
 	/** The shadow stack mode */
 	const SSMode mode;
 
+	/** How writable-executable regions are handled */
+	const JITPolicy jit_policy;
+
+	/** How external mode messages are sent to the server */
+	const Transport transport;
+
+	/** The priority class of the target's threads on the server */
+	const QoSClass qos;
+
+	/** The number of rets the server may still be verifying while the target runs
+	 *  0 means every ret waits for the server */
+	const unsigned int async_window;
+
+	/** The number of frames per thread hybrid mode keeps in the client */
+	const unsigned int hybrid_window;
+
+	/** The longest a ret may wait for the server in microseconds before its thread
+	 *  verifies its rets itself, 0 means threads never fail over */
+	const unsigned long failover_slo;
+
+	/** The number of calls, rets, and signals between digests, 0 means rets are not
+	 *  verified by digest */
+	const unsigned int digest_interval;
+
+	/** The number of threads serving socket clients, 0 means one per cpu */
+	const unsigned int server_threads;
+
+	/** True if the server should serve socket clients with io_uring, when supported */
+	const bool io_uring;
+
+	/** True if the time taken by each startup phase should be logged */
+	const bool startup_profile;
+
+	/** The path of the zygote's socket, empty if zygote mode is off */
+	const std::string zygote;
+
+	/** The socket path to serve as a daemon on, empty unless this is a daemon
+	 *  A daemon has no target */
+	const std::string daemon;
+
+	/** The socket path of the daemon the target is verified by
+	 *  Empty if external mode starts its own server */
+	const std::string attach;
+
+	/** The path the counters of each thread are written to as JSON, empty if they are
+	 *  not. Internal mode clients write them when they exit, servers when clients
+	 *  disconnect */
+	const std::string stats_file;
+
+	/** The unix socket path the server serves live metrics on, empty if it does not */
+	const std::string metrics_socket;
+
 	/** Path to target executable */
 	const std::string target;
 
@@ -0,0 +1,177 @@
+/** @file */
+#ifndef __PROTOCOL_HPP__
+#define __PROTOCOL_HPP__
+
+#include "message.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*********************************************************/
+/*                                                       */
+/*                        Constant                       */
+/*                                                       */
+/*********************************************************/
+
+
+/** The original protocol: every message is MESSAGE_SIZE bytes with an ASCII header */
+#define PROTOCOL_V1 1
+
+/** The compact protocol: one byte opcodes, addresses varint delta-encoded */
+#define PROTOCOL_V2 2
+
+/** The newest protocol version this build speaks */
+#define PROTOCOL_LATEST PROTOCOL_V2
+
+/** The largest a v2 frame can be: an opcode and a 64 bit varint */
+#define MAX_FRAME_SIZE ( 1 + 10 )
+
+
+/*********************************************************/
+/*                                                       */
+/*                     Wire protocol                     */
+/*                                                       */
+/*********************************************************/
+
+
+/** The external mode wire protocol
+ *  A client that supports v2 opens its channel by sending a v1 Hello message whose body
+ *  is the newest version it speaks. The server answers with a Hello holding the version
+ *  both will use. A channel whose first message is not a Hello is a v1 channel.
+ *  A v1 message is a 4 byte header followed by a pointer sized little-endian body.
+ *  In v2, each frame is a one byte opcode. Call and Ret frames are followed by the
+ *  zig-zag varint encoded difference between their address and the previous address
+ *  sent on the channel. The previous address starts at 0 and is reset by an Execve.
+ *  Thread, Fork, Child, Fill, Priority, ForkFailed, and Digest frames are followed by a
+ *  varint thread id, fork token, frame count, class number, fork token, or digest, which
+ *  is not an address. A Priority sets the channel's priority class, and a ForkFailed
+ *  drops the snapshot of a fork that made no child; the server answers neither.
+ *  In either version, the server answers a Fill by popping up to as many frames as it
+ *  asks for, then sending their number as a pointer sized little-endian integer,
+ *  followed by the frames themselves the same way, top of the stack first.
+ *  A Digest ends an epoch of a digest mode channel. The server answers a Digest that
+ *  matches the frames it was sent with the next epoch's 16 byte key, as two
+ *  little-endian 64 bit integers. Once a channel sent a Digest, its rets get no Continue.
+ *  A client only sends a Fill or a Digest once every Continue it is owed was received */
+namespace Protocol {
+
+	/** The opcodes of v2 frames. Also used to dispatch v1 messages */
+	enum Opcode : unsigned char {
+		CALL,
+		RET,
+		NEW_SIGNAL,
+		EXECVE,
+		FORK,
+		THREAD,
+		CONTINUE,
+		CHILD,
+		FILL,
+		PRIORITY,
+		FORK_FAILED,
+		DIGEST,
+		/** The number of opcodes; also used for unknown v1 headers */
+		NUM_OPCODES
+	};
+
+	/** Returns true if frames of opcode op carry an address */
+	inline bool has_address( const Opcode op ) { return ( op == CALL ) || ( op == RET ); }
+
+	/** Returns true if frames of opcode op carry a body */
+	inline bool has_body( const Opcode op ) {
+		return has_address( op ) || ( op == THREAD ) || ( op == FORK ) ||
+		       ( op == CHILD ) || ( op == FILL ) || ( op == PRIORITY ) ||
+		       ( op == FORK_FAILED ) || ( op == DIGEST );
+	}
+
+	/** Packs a v1 header into an integer so headers can be compared in one instruction */
+	constexpr uint32_t v1_code( const char *const h ) {
+		return (uint32_t)(unsigned char) h[0] | ( (uint32_t)(unsigned char) h[1] << 8 ) |
+		       ( (uint32_t)(unsigned char) h[2] << 16 ) |
+		       ( (uint32_t)(unsigned char) h[3] << 24 );
+	}
+
+	/** Returns the opcode of the v1 message in buffer, or NUM_OPCODES if it is unknown */
+	inline Opcode from_v1( const char *const buffer ) {
+		switch ( v1_code( buffer ) ) {
+			case v1_code( Message::Call::header ):
+				return CALL;
+			case v1_code( Message::Ret::header ):
+				return RET;
+			case v1_code( Message::NewSignal::header ):
+				return NEW_SIGNAL;
+			case v1_code( Message::Execve::header ):
+				return EXECVE;
+			case v1_code( Message::Fork::header ):
+				return FORK;
+			case v1_code( Message::Thread::header ):
+				return THREAD;
+			case v1_code( Message::Continue::header ):
+				return CONTINUE;
+			case v1_code( Message::Child::header ):
+				return CHILD;
+			case v1_code( Message::Fill::header ):
+				return FILL;
+			case v1_code( Message::Priority::header ):
+				return PRIORITY;
+			case v1_code( Message::ForkFailed::header ):
+				return FORK_FAILED;
+			case v1_code( Message::Digest::header ):
+				return DIGEST;
+			default:
+				return NUM_OPCODES;
+		}
+	}
+
+	/** Returns the opcode of the message type Msg */
+	template <typename Msg> inline Opcode opcode_of() { return from_v1( Msg::header ); }
+
+	/** Writes the header only frame op to dst
+	 *  Returns the number of bytes written */
+	inline size_t encode( char *const dst, const Opcode op ) {
+		dst[0] = (char) op;
+		return 1;
+	}
+
+	/** Writes the frame op with address addr to dst, then sets prev to addr
+	 *  dst must have room for MAX_FRAME_SIZE bytes
+	 *  Returns the number of bytes written */
+	inline size_t encode( char *const dst, const Opcode op, const uint64_t addr,
+	                      uint64_t &prev ) {
+		const int64_t delta = (int64_t)( addr - prev );
+		uint64_t zz = ( (uint64_t) delta << 1 ) ^ (uint64_t)( delta >> 63 );
+		prev = addr;
+		size_t n = encode( dst, op );
+		for ( ; zz >= 0x80; zz >>= 7 ) {
+			dst[n++] = (char) ( zz | 0x80 );
+		}
+		dst[n++] = (char) zz;
+		return n;
+	}
+
+	/** Decodes the varint address following an opcode from the len bytes at src
+	 *  On success, stores the address in addr, sets prev to it,
+	 *  and returns the number of bytes read. Returns 0 if src holds
+	 *  only part of the varint. Returns -1 if the varint is malformed */
+	inline int decode_address( const char *const src, const size_t len, uint64_t &addr,
+	                           uint64_t &prev ) {
+		uint64_t zz = 0;
+		for ( size_t i = 0; i < len; ++i ) {
+			if ( i == MAX_FRAME_SIZE - 1 ) {
+				return -1;
+			}
+			const unsigned char byte = (unsigned char) src[i];
+			zz |= (uint64_t)( byte & 0x7f ) << ( 7 * i );
+			if ( ( byte & 0x80 ) == 0 ) {
+				const int64_t delta = (int64_t)( zz >> 1 ) ^ -(int64_t)( zz & 1 );
+				addr = prev + (uint64_t) delta;
+				prev = addr;
+				return (int) i + 1;
+			}
+		}
+		return 0;
+	}
+}; // namespace Protocol
+
+
+#endif
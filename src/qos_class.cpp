@@ -0,0 +1,23 @@
+#include "qos_class.hpp"
+#include "utilities.hpp"
+
+#include <string.h>
+
+
+// The flag of each class, by number
+static const char *const names[NUM_QOS_CLASSES] = { INTERACTIVE_QOS_FLAG, NORMAL_QOS_FLAG,
+	                                                BATCH_QOS_FLAG };
+
+// The constructor
+QoSClass::QoSClass( const char *const q )
+    : str( Utilities::safe_strdup( q ) ),
+      is_interactive( strcmp( str, INTERACTIVE_QOS_FLAG ) == 0 ),
+      is_normal( strcmp( str, NORMAL_QOS_FLAG ) == 0 ),
+      is_batch( strcmp( str, BATCH_QOS_FLAG ) == 0 ),
+      is_valid_class( is_interactive || is_normal || is_batch ),
+      level( is_interactive ? 0 : is_normal ? 1 : is_batch ? 2 : NUM_QOS_CLASSES ) {}
+
+// Returns the flag of the class numbered level
+const char *QoSClass::name( const unsigned int level ) {
+	return ( level < NUM_QOS_CLASSES ) ? names[level] : "unknown";
+}
@@ -0,0 +1,59 @@
+/** @file */
+#ifndef __QOS_CLASS_HPP__
+#define __QOS_CLASS_HPP__
+
+
+/** The flag that selects the interactive priority class */
+#define INTERACTIVE_QOS_FLAG "interactive"
+
+/** The flag that selects the normal priority class */
+#define NORMAL_QOS_FLAG "normal"
+
+/** The flag that selects the batch priority class */
+#define BATCH_QOS_FLAG "batch"
+
+/** The default priority class */
+#define DEFAULT_QOS_CLASS NORMAL_QOS_FLAG
+
+/** The number of priority classes */
+#define NUM_QOS_CLASSES 3
+
+
+/** A tiny struct that represents the priority class of a target's threads on the server
+ *  Classes are numbered from 0, the highest, to NUM_QOS_CLASSES - 1. The server serves
+ *  the ready connections of higher classes first, and lets them send more per turn.
+ *  Every ready connection is still served each turn, so no class starves */
+struct QoSClass final {
+
+	/** The constructor
+	 *  Reads the class in from q and stores a copy of it */
+	QoSClass( const char *const q );
+
+	/** Disable the default constructor */
+	QoSClass() = delete;
+
+	/** Returns the flag of the class numbered level */
+	static const char *name( const unsigned int level );
+
+
+	/** The class */
+	const char *const str;
+
+	/** True if class = interactive */
+	const bool is_interactive;
+
+	/** True if class = normal */
+	const bool is_normal;
+
+	/** True if class = batch */
+	const bool is_batch;
+
+	/** True if any class is valid */
+	const bool is_valid_class;
+
+	/** The number of the class, NUM_QOS_CLASSES if it is invalid */
+	const unsigned int level;
+};
+
+
+#endif
@@ -1,15 +1,28 @@
 #include "quick_socket.hpp"
+#include "constants.hpp"
 #include "utilities.hpp"
 
 #include <sys/socket.h>
+#include <sys/random.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stddef.h>
 #include <string.h>
+#include <sstream>
 
 
 // Undefine macro assert, it clobbers the class member function assert
 #undef assert
 
+// The host of a TCP address that names only a port
+// Nothing authenticates TCP peers, so only local ones are reached unless asked otherwise
+#define DEFAULT_TCP_HOST "127.0.0.1"
+
 
 /*********************************************************/
 /*                                                       */
@@ -18,15 +31,45 @@
 /*********************************************************/
 
 
-// Create a unix server with name fname
-static struct sockaddr_un make_unix_server( const char *const fname ) {
+// Create a unix server with name fname, and store the size of its address in len
+// An abstract name is as long as fname; the rest of sun_path is not part of it
+static struct sockaddr_un make_unix_server( const char *const fname, socklen_t &len ) {
 	struct sockaddr_un server;
+	memset( &server, 0, sizeof( server ) );
 	server.sun_family = AF_UNIX;
-	strcpy( server.sun_path, fname );
+	const size_t fname_len = strlen( fname );
+	Utilities::assert( fname_len < sizeof( server.sun_path ), "Socket name is too long" );
+	memcpy( server.sun_path, fname, fname_len );
+	len = sizeof( struct sockaddr_un );
+	if ( fname[0] == ABSTRACT_SOCKET_PREFIX ) {
+		server.sun_path[0] = 0;
+		len = (socklen_t)( offsetof( struct sockaddr_un, sun_path ) + fname_len );
+	}
 	return server;
 }
 
 
+// Parse address, of the form [<IPv4 address>]:<port> or <port>, into a TCP socket address
+// An address without a host is on the loopback interface
+// Host names are not resolved, so no resolver runs inside the target
+static struct sockaddr_in make_tcp_address( const char *const address ) {
+	const std::string str( address );
+	const size_t colon = str.rfind( ':' );
+	const bool has_host = ( colon != std::string::npos ) && ( colon > 0 );
+	const std::string host = has_host ? str.substr( 0, colon ) : DEFAULT_TCP_HOST;
+	const std::string port = str.substr( ( colon == std::string::npos ) ? 0 : colon + 1 );
+	const bool numeric = port.find_first_not_of( "0123456789" ) == std::string::npos;
+	Utilities::assert( !port.empty() && numeric, "TCP address has no numeric port" );
+	struct sockaddr_in ret;
+	memset( &ret, 0, sizeof( ret ) );
+	ret.sin_family = AF_INET;
+	ret.sin_port = htons( (uint16_t) std::stoul( port ) );
+	Utilities::assert( inet_pton( AF_INET, host.c_str(), &ret.sin_addr ) == 1,
+	                   "TCP address is not a numeric IPv4 address" );
+	return ret;
+}
+
+
 /*********************************************************/
 /*                                                       */
 /*                     Header functions                  */
@@ -35,24 +78,26 @@ static struct sockaddr_un make_unix_server( const char *const fname ) {
 
 
 // Create a unix socket, and a server for it
+// At most backlog clients may be waiting to be accepted
 // Returns the server file descriptor
-int QS::create_server( const char *const fname ) {
+int QS::create_server( const char *const fname, const int backlog ) {
 
 	// Create the server
 	const int server_sock = socket( AF_UNIX, SOCK_STREAM, 0 );
 	Utilities::assert( server_sock != -1, "socket() failed" );
 
 	// Define the server
-	struct sockaddr_un server = make_unix_server( fname );
+	socklen_t len;
+	struct sockaddr_un server = make_unix_server( fname, len );
 
 	// Bind the server to the socket
-	const int rv =
-	    bind( server_sock, (struct sockaddr *) &server, sizeof( struct sockaddr_un ) );
+	const int rv = bind( server_sock, (struct sockaddr *) &server, len );
 	Utilities::assert( rv != -1, "bind() failed" );
 
-	// Begin listening for exactly one client
-	Utilities::assert( listen( server_sock, 1 ) != -1, "listen() failed." );
-	Utilities::log( "Created server ", fname, "\n\t- Listening for one client..." );
+	// Begin listening for clients
+	Utilities::assert( listen( server_sock, backlog ) != -1, "listen() failed." );
+	Utilities::log( "Created server ", fname, "\n\t- Listening with a backlog of ",
+	                backlog, "..." );
 
 	// Return the server and client sockets
 	return server_sock;
@@ -64,20 +109,93 @@ int QS::create_server( const char *const fname ) {
 int QS::create_client( const char *sock_name ) {
 
 	// Create the client
-	const int client = socket( AF_UNIX, SOCK_STREAM, 0 );
+	// It is close on exec, so that only sockets deliberately passed on are inherited
+	const int client = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
 	Utilities::assert( client != -1, "socket() failed" );
 
 	// Connect the client. This is NOT blocking IF listen() was called
-	struct sockaddr_un server = make_unix_server( sock_name );
-	Utilities::assert(
-	    connect( client, (struct sockaddr *) &server, sizeof( struct sockaddr_un ) ) == 0,
-	    "connect() failed" );
+	socklen_t len;
+	struct sockaddr_un server = make_unix_server( sock_name, len );
+	Utilities::assert( connect( client, (struct sockaddr *) &server, len ) == 0,
+	                   "connect() failed" );
 	Utilities::log( "New client connected to ", sock_name );
 
 	// Return the client
 	return client;
 }
 
+// Returns a new abstract unix socket name, unique to this launch
+// The name holds the launcher's pid and a random nonce; if it is taken anyway,
+// binding it fails, which is safe
+std::string QS::unique_abstract_name() {
+	uint64_t nonce;
+	Utilities::assert( getrandom( &nonce, sizeof( nonce ), 0 ) == sizeof( nonce ),
+	                   "getrandom() failed." );
+	std::stringstream name;
+	name << ABSTRACT_SOCKET_PREFIX << PROGRAM_NAME << '-' << getpid() << '-' << std::hex
+	     << nonce;
+	return name.str();
+}
+
+// Create a TCP server listening on address, of the form [<IPv4 address>:]<port>
+// At most backlog clients may be waiting to be accepted
+// Returns the server file descriptor
+int QS::create_tcp_server( const char *const address, const int backlog ) {
+	const int server_sock = socket( AF_INET, SOCK_STREAM, 0 );
+	Utilities::assert( server_sock != -1, "socket() failed" );
+
+	// Allow a restarted server to reuse its port at once
+	const int one = 1;
+	Utilities::assert(
+	    setsockopt( server_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) ) == 0,
+	    "setsockopt() failed" );
+
+	// Bind, then listen. Accepted sockets inherit TCP_NODELAY
+	struct sockaddr_in server = make_tcp_address( address );
+	Utilities::assert(
+	    bind( server_sock, (struct sockaddr *) &server, sizeof( server ) ) != -1,
+	    "bind() failed" );
+	set_no_delay( server_sock );
+	Utilities::assert( listen( server_sock, backlog ) != -1, "listen() failed." );
+	Utilities::log( "Created TCP server ", tcp_address( server_sock ),
+	                "\n\t- Listening with a backlog of ", backlog, "..." );
+	return server_sock;
+}
+
+// Create a client for the TCP server at address, of the form [<IPv4 address>:]<port>
+// Returns the file descriptor for the client
+int QS::create_tcp_client( const char *const address ) {
+	const int client = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	Utilities::assert( client != -1, "socket() failed" );
+	set_no_delay( client );
+	struct sockaddr_in server = make_tcp_address( address );
+	Utilities::assert(
+	    connect( client, (struct sockaddr *) &server, sizeof( server ) ) == 0,
+	    "connect() failed" );
+	Utilities::log( "New client connected to ", address );
+	return client;
+}
+
+// Returns the address the TCP server sock listens on
+std::string QS::tcp_address( const int sock ) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof( addr );
+	Utilities::assert( getsockname( sock, (struct sockaddr *) &addr, &len ) == 0,
+	                   "getsockname() failed" );
+	char ip[INET_ADDRSTRLEN];
+	Utilities::assert( inet_ntop( AF_INET, &addr.sin_addr, ip, sizeof( ip ) ) != nullptr,
+	                   "inet_ntop() failed" );
+	return std::string( ip ) + ":" + std::to_string( ntohs( addr.sin_port ) );
+}
+
+// Disable Nagle's algorithm on the TCP socket sock
+void QS::set_no_delay( const int sock ) {
+	const int one = 1;
+	Utilities::assert(
+	    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) ) == 0,
+	    "setsockopt() failed" );
+}
+
 // Wait for a client to connect to sock
 // Once the client connects, accept then return the file descriptor
 int QS::accept_client( const int sock ) {
@@ -86,3 +204,47 @@ int QS::accept_client( const int sock ) {
 	Utilities::log( "Server on fd ", sock, " accepted one client" );
 	return accepted_sock;
 }
+
+// Send the file descriptor fd to the other end of sock
+// The fd is passed as SCM_RIGHTS ancillary data along with a single byte
+void QS::send_fd( const int sock, const int fd ) {
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	char control[CMSG_SPACE( sizeof( int ) )];
+	memset( control, 0, sizeof( control ) );
+	struct msghdr msg;
+	memset( &msg, 0, sizeof( msg ) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof( control );
+	struct cmsghdr *const cmsg = CMSG_FIRSTHDR( &msg );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+	memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ) );
+	Utilities::assert( sendmsg( sock, &msg, 0 ) == 1, "sendmsg() failed" );
+	Utilities::log( "Sent fd ", fd, " over socket ", sock );
+}
+
+// Receive a file descriptor sent via send_fd from sock
+int QS::recv_fd( const int sock ) {
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	char control[CMSG_SPACE( sizeof( int ) )];
+	struct msghdr msg;
+	memset( &msg, 0, sizeof( msg ) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof( control );
+	Utilities::assert( recvmsg( sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC ) == 1,
+	                   "recvmsg() failed" );
+	struct cmsghdr *const cmsg = CMSG_FIRSTHDR( &msg );
+	Utilities::assert( ( cmsg != nullptr ) && ( cmsg->cmsg_type == SCM_RIGHTS ),
+	                   "No file descriptor received" );
+	int fd;
+	memcpy( &fd, CMSG_DATA( cmsg ), sizeof( int ) );
+	Utilities::log( "Received fd ", fd, " over socket ", sock );
+	return fd;
+}
@@ -2,6 +2,8 @@
 #ifndef __QUICK_SOCKET_HPP__
 #define __QUICK_SOCKET_HPP__
 
+#include <string>
+
 
 /*********************************************************/
 /*                                                       */
@@ -10,22 +12,61 @@
 /*********************************************************/
 
 
+/** A unix socket name starting with this is in the abstract namespace
+ *  Such a socket has no file, so it costs no filesystem operation and
+ *  leaves nothing behind when its server exits */
+#define ABSTRACT_SOCKET_PREFIX '@'
+
+
 // Protect the global namespace
 namespace QS {
 
 	/** Create a unix socket at fname, and a server for it
+	 *  fname may be an abstract name, see ABSTRACT_SOCKET_PREFIX
+	 *  At most backlog clients may be waiting to be accepted
 	 *  Returns the server file descriptor */
-	int create_server( const char *fname );
+	int create_server( const char *fname, const int backlog = 1 );
+
+	/** Returns a new abstract unix socket name, unique to this launch */
+	std::string unique_abstract_name();
 
 	/** Create a client for a unix socket
 	 *  Joins the unix socked located at sock_name
-	 *  Returns the file descriptor for the client */
+	 *  Returns the file descriptor for the client, which is close on exec */
 	int create_client( const char *const sock_name );
 
+	/** Create a TCP server listening on address, of the form [<IPv4 address>:]<port>
+	 *  Without an address, or with an empty one, it listens on 127.0.0.1 only
+	 *  Nothing authenticates the clients that connect, so another address should only
+	 *  be given on a trusted network
+	 *  Port 0 picks any free port. At most backlog clients may be waiting to be accepted
+	 *  Returns the server file descriptor */
+	int create_tcp_server( const char *const address, const int backlog = 1 );
+
+	/** Create a client for the TCP server at address, of the form [<IPv4 address>:]<port>
+	 *  Without an address, or with an empty one, the server is at 127.0.0.1
+	 *  Small messages are sent at once, see set_no_delay
+	 *  Returns the file descriptor for the client, which is close on exec */
+	int create_tcp_client( const char *const address );
+
+	/** Returns the address the TCP server sock listens on, as <IPv4 address>:<port> */
+	std::string tcp_address( const int sock );
+
+	/** Disable Nagle's algorithm on the TCP socket sock
+	 *  Every message is a complete batch, so none is worth delaying to coalesce */
+	void set_no_delay( const int sock );
+
 	/** Wait for a client to connect to sock
 	 *  Once the client connects, accept then return the file descriptor */
 	int accept_client( const int sock );
 
+	/** Send the file descriptor fd to the other end of sock */
+	void send_fd( const int sock, const int fd );
+
+	/** Receive a file descriptor sent via send_fd from sock
+	 *  Returns the received file descriptor, which is close on exec */
+	int recv_fd( const int sock );
+
 }; // namespace QS
 
 
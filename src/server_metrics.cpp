@@ -0,0 +1,283 @@
+#include "server_metrics.hpp"
+#include "quick_socket.hpp"
+#include "utilities.hpp"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <map>
+
+// Remove assert macro
+#undef assert
+
+
+// How long a scraper may take to send its request, in milliseconds
+// One that sends nothing, such as a plain socket client, gets the metrics after it
+#define SCRAPE_REQUEST_TIMEOUT 100
+
+// The most bytes of a scraper's request read
+#define MAX_SCRAPE_REQUEST 4096
+
+// The name of each opcode, indexed by opcode
+static const char *const opcode_names[Protocol::NUM_OPCODES] = {
+	"call", "ret", "new_signal", "execve", "fork", "thread",
+	"continue", "child", "fill", "priority", "fork_failed", "digest"
+};
+
+// The quantiles of ret latency reported
+static const double latency_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// The counters of many clients added together
+struct Totals {
+
+	/** Add the counters of m to these */
+	void add( const ClientMetrics &m ) {
+		bytes += m.bytes.load( std::memory_order_relaxed );
+		for ( unsigned int i = 0; i < Protocol::NUM_OPCODES; ++i ) {
+			messages[i] += m.messages[i].load( std::memory_order_relaxed );
+		}
+		latency_total += m.latency_total.load( std::memory_order_relaxed );
+		for ( unsigned int i = 0; i < METRICS_LATENCY_BUCKETS; ++i ) {
+			latency_histogram[i] +=
+			    m.latency_histogram[i].load( std::memory_order_relaxed );
+		}
+	}
+
+	/** The counters of ClientMetrics */
+	unsigned long bytes = 0;
+	unsigned long messages[Protocol::NUM_OPCODES] = {};
+	unsigned long latency_total = 0;
+	unsigned long latency_histogram[METRICS_LATENCY_BUCKETS] = {};
+};
+
+
+// True once the metrics are served
+// Set before the server accepts any client, so it never changes while one is counted
+static bool serving = false;
+
+// The counters of every connected client, by number
+static std::map<unsigned long, ClientMetrics *> live;
+
+// The counters of every client that disconnected
+static Totals retired;
+
+// The number of the next client to connect
+static unsigned long next_id = 0;
+
+// Protects live, retired, and next_id
+static std::mutex metrics_lock;
+
+
+/*********************************************************/
+/*                                                       */
+/*                    Not in header file                 */
+/*                                                       */
+/*********************************************************/
+
+
+// Write the HELP and TYPE lines of the metric name to out
+static void describe( std::stringstream &out, const char *const name,
+                      const char *const type, const char *const help ) {
+	out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type
+	    << "\n";
+}
+
+// Returns the metrics in the Prometheus text format
+static std::string render() {
+
+	// Gather every client's counters
+	Totals total;
+	unsigned long connections;
+	unsigned long connected;
+	unsigned long frames = 0;
+	std::stringstream depths;
+	{
+		std::lock_guard<std::mutex> lock( metrics_lock );
+		total = retired;
+		connections = live.size();
+		connected = next_id;
+		for ( const auto &i : live ) {
+			const ClientMetrics &m = *i.second;
+			const unsigned long depth = m.depth.load( std::memory_order_relaxed );
+			total.add( m );
+			frames += depth;
+			depths << "dr_shadow_stack_depth{connection=\"" << m.id << "\",tid=\""
+			       << m.tid.load( std::memory_order_relaxed ) << "\"} " << depth << "\n";
+		}
+	}
+
+	// Messages
+	std::stringstream out;
+	describe( out, "dr_shadow_stack_messages_total", "counter",
+	          "Messages received from clients, by type" );
+	for ( unsigned int i = 0; i < Protocol::NUM_OPCODES; ++i ) {
+		out << "dr_shadow_stack_messages_total{type=\"" << opcode_names[i] << "\"} "
+		    << total.messages[i] << "\n";
+	}
+	describe( out, "dr_shadow_stack_received_bytes_total", "counter",
+	          "Bytes received from clients" );
+	out << "dr_shadow_stack_received_bytes_total " << total.bytes << "\n";
+
+	// Connections
+	describe( out, "dr_shadow_stack_connections", "gauge", "Clients connected" );
+	out << "dr_shadow_stack_connections " << connections << "\n";
+	describe( out, "dr_shadow_stack_connections_total", "counter",
+	          "Clients that have connected" );
+	out << "dr_shadow_stack_connections_total " << connected << "\n";
+
+	// Depths
+	describe( out, "dr_shadow_stack_depth", "gauge",
+	          "Frames on the shadow stack of each connected client" );
+	out << depths.str();
+	describe( out, "dr_shadow_stack_frames", "gauge",
+	          "Frames on the shadow stacks of every connected client" );
+	out << "dr_shadow_stack_frames " << frames << "\n";
+
+	// Ret latency
+	unsigned long rets = 0;
+	for ( unsigned int i = 0; i < METRICS_LATENCY_BUCKETS; ++i ) {
+		rets += total.latency_histogram[i];
+	}
+	describe( out, "dr_shadow_stack_ret_latency_seconds", "summary",
+	          "Time from receiving a ret to acknowledging it" );
+	for ( const double q : latency_quantiles ) {
+		out << "dr_shadow_stack_ret_latency_seconds{quantile=\"" << q << "\"} "
+		    << ServerMetrics::quantile( total.latency_histogram, rets, q ) << "\n";
+	}
+	out << "dr_shadow_stack_ret_latency_seconds_sum "
+	    << (double) total.latency_total / 1e9
+	    << "\ndr_shadow_stack_ret_latency_seconds_count " << rets << "\n";
+	return out.str();
+}
+
+// Read the request of the scraper on sock, then send it the metrics
+// An HTTP request gets an HTTP response, anything else just the metrics
+static void answer( const int sock ) {
+
+	// Read the request, until its headers end or the scraper stops sending
+	struct timeval timeout = { 0, SCRAPE_REQUEST_TIMEOUT * 1000 };
+	(void) setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+	char request[MAX_SCRAPE_REQUEST + 1];
+	size_t len = 0;
+	request[0] = (char) 0;
+	while ( ( len < MAX_SCRAPE_REQUEST ) &&
+	        ( strstr( request, "\r\n\r\n" ) == nullptr ) ) {
+		const ssize_t n = recv( sock, &request[len], MAX_SCRAPE_REQUEST - len, 0 );
+		if ( n <= 0 ) {
+			break;
+		}
+		len += (size_t) n;
+		request[len] = (char) 0;
+	}
+
+	// Send the metrics
+	const std::string body = render();
+	std::string response;
+	if ( strncmp( request, "GET ", 4 ) == 0 ) {
+		response = "HTTP/1.0 200 OK\r\n"
+		           "Content-Type: text/plain; version=0.0.4\r\n"
+		           "Content-Length: " +
+		           std::to_string( body.size() ) + "\r\n\r\n";
+	}
+	response += body;
+	size_t sent = 0;
+	while ( sent < response.size() ) {
+		const ssize_t n =
+		    send( sock, &response[sent], response.size() - sent, MSG_NOSIGNAL );
+		if ( n <= 0 ) {
+			Utilities::log( "Metrics scraper on fd ", sock, " is gone" );
+			return;
+		}
+		sent += (size_t) n;
+	}
+}
+
+// Answer every scraper that connects to the metrics server server_sock, one at a time
+[[noreturn]] static void serve_scrapers( const int server_sock ) {
+	while ( true ) {
+		const int sock = accept4( server_sock, nullptr, nullptr, SOCK_CLOEXEC );
+		if ( sock == -1 ) {
+			if ( errno != EINTR ) {
+				Utilities::log_error( "Could not accept a metrics scraper" );
+			}
+			continue;
+		}
+		answer( sock );
+		close( sock );
+	}
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Serve the metrics on a unix socket at path
+// The thread serving them runs until the process exits
+void ServerMetrics::serve( const std::string &path ) {
+	const int server_sock = QS::create_server( path.c_str(), SOMAXCONN );
+	serving = true;
+	std::thread( serve_scrapers, server_sock ).detach();
+	Utilities::log( "Serving metrics on ", path );
+}
+
+// Returns the least latency in nanoseconds bucket of a latency histogram counts
+unsigned long ServerMetrics::bucket_floor( const unsigned int bucket ) {
+	if ( bucket < 4 ) {
+		return bucket;
+	}
+	const unsigned int log2 = bucket / 4 + 1;
+	return ( 4ul + bucket % 4 ) << ( log2 - 2 );
+}
+
+// Returns the latency in seconds that the fraction q of the count latencies in
+// histogram are at most, interpolated within its bucket
+double ServerMetrics::quantile( const unsigned long *const histogram,
+                                const unsigned long count, const double q ) {
+	const double rank = q * (double) count;
+	unsigned long below = 0;
+	for ( unsigned int i = 0; i < METRICS_LATENCY_BUCKETS; ++i ) {
+		if ( ( histogram[i] > 0 ) && ( (double) ( below + histogram[i] ) >= rank ) ) {
+			const double low = (double) bucket_floor( i );
+			const double high = ( i + 1 < METRICS_LATENCY_BUCKETS )
+			                        ? (double) bucket_floor( i + 1 )
+			                        : low;
+			const double within = ( rank - (double) below ) / (double) histogram[i];
+			return ( low + within * ( high - low ) ) / 1e9;
+		}
+		below += histogram[i];
+	}
+	return 0;
+}
+
+// Returns the counters of a new client, or nullptr if metrics are not served
+ClientMetrics *ServerMetrics::connect() {
+	if ( !serving ) {
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> lock( metrics_lock );
+	ClientMetrics *const ret = new ClientMetrics( next_id++ );
+	live[ret->id] = ret;
+	return ret;
+}
+
+// Forget the client whose counters are metrics, keeping its counters in the totals
+void ServerMetrics::disconnect( ClientMetrics *const metrics ) {
+	if ( metrics == nullptr ) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock( metrics_lock );
+		retired.add( *metrics );
+		live.erase( metrics->id );
+	}
+	delete metrics;
+}
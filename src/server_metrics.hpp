@@ -0,0 +1,117 @@
+/** @file */
+#ifndef __SERVER_METRICS_HPP__
+#define __SERVER_METRICS_HPP__
+
+#include "protocol.hpp"
+
+#include <sys/types.h>
+#include <algorithm>
+#include <string>
+#include <atomic>
+
+
+/** The number of buckets in a latency histogram
+ *  Latencies below 4ns each have a bucket. Above, each power of two is split into 4
+ *  buckets, so a quantile is known to within 25%. The last bucket counts every
+ *  latency of 7 * 2^38ns or more */
+#define METRICS_LATENCY_BUCKETS 160
+
+
+/** The live counters of one client of the server
+ *  Only the thread serving the client writes them, so writes never contend
+ *  Each is atomic, so the metrics endpoint may read them at any time */
+struct ClientMetrics final {
+
+	/** The constructor */
+	explicit ClientMetrics( const unsigned long id_ ) : id( id_ ) {}
+
+	/** Add n to counter. Only the thread serving the client may call this
+	 *  No other thread writes counter, so no atomic read-modify-write is needed */
+	static inline void bump( std::atomic<unsigned long> &counter,
+	                         const unsigned long n ) {
+		counter.store( counter.load( std::memory_order_relaxed ) + n,
+		               std::memory_order_relaxed );
+	}
+
+	/** Returns the bucket of a latency histogram latency nanoseconds fall in */
+	static inline unsigned int latency_bucket( const unsigned long latency ) {
+		if ( latency < 4 ) {
+			return (unsigned int) latency;
+		}
+		const unsigned int log2 = 63 - (unsigned int) __builtin_clzl( latency );
+		const unsigned int bucket =
+		    4 * ( log2 - 1 ) + ( ( latency >> ( log2 - 2 ) ) & 3 );
+		return std::min( bucket, (unsigned int) METRICS_LATENCY_BUCKETS - 1 );
+	}
+
+	/** Note that the client sent a message of opcode op */
+	inline void note_message( const Protocol::Opcode op ) {
+		if ( op < Protocol::NUM_OPCODES ) {
+			bump( messages[op], 1 );
+		}
+	}
+
+	/** Note that n rets were acknowledged latency nanoseconds after they were received */
+	inline void note_rets( const unsigned long n, const unsigned long latency ) {
+		bump( latency_histogram[latency_bucket( latency )], n );
+		bump( latency_total, n * latency );
+	}
+
+
+	/** The number of the client, in the order clients connected */
+	const unsigned long id;
+
+	/** The client's thread id, 0 until the client says */
+	std::atomic<pid_t> tid{ 0 };
+
+	/** The number of frames on the client's shadow stack */
+	std::atomic<unsigned long> depth{ 0 };
+
+	/** The number of bytes received from the client */
+	std::atomic<unsigned long> bytes{ 0 };
+
+	/** The number of messages received of each opcode */
+	std::atomic<unsigned long> messages[Protocol::NUM_OPCODES] = {};
+
+	/** The total latency of every ret acknowledged, in nanoseconds */
+	std::atomic<unsigned long> latency_total{ 0 };
+
+	/** The number of rets acknowledged with a latency in each bucket */
+	std::atomic<unsigned long> latency_histogram[METRICS_LATENCY_BUCKETS] = {};
+};
+
+
+/** Live metrics of the server, served in the Prometheus text format
+ *  Each client's counters are written by the thread serving it; a scrape only reads
+ *  them, so it never blocks a worker. Only connecting and disconnecting take a lock */
+namespace ServerMetrics {
+
+	/** Serve the metrics on a unix socket at path, which may be an abstract name
+	 *  Each connection is answered with the metrics then closed. A connection that
+	 *  sends an HTTP request gets an HTTP response, so any Prometheus scraper that
+	 *  speaks HTTP over a unix socket can read them. Until this is called, no client
+	 *  is counted */
+	void serve( const std::string &path );
+
+	/** Returns the counters of a new client, or nullptr if metrics are not served */
+	ClientMetrics *connect();
+
+	/** Forget the client whose counters are metrics, which may be nullptr
+	 *  Its counters are kept in the totals of every client */
+	void disconnect( ClientMetrics *const metrics );
+
+	/** Returns the least latency in nanoseconds that bucket of a latency histogram
+	 *  counts, the inverse of ClientMetrics::latency_bucket */
+	unsigned long bucket_floor( const unsigned int bucket );
+
+	/** Returns the latency in seconds that the fraction q of the count latencies in
+	 *  histogram are at most, interpolated linearly within its bucket
+	 *  The last bucket has no upper bound, so its floor is returned. Returns 0 if
+	 *  count is 0 */
+	double quantile( const unsigned long *const histogram, const unsigned long count,
+	                 const double q );
+
+}; // namespace ServerMetrics
+
+
+#endif
@@ -1,13 +1,24 @@
 #include "external_stack_server.hpp"
+#include "startup_profile.hpp"
+#include "group_stats.hpp"
 #include "quick_socket.hpp"
 #include "parse_args.hpp"
-#include "temp_name.hpp"
 #include "constants.hpp"
 #include "utilities.hpp"
 #include "group.hpp"
 
+#include "dr_inject.h"
+#include "dr_config.h"
+
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <vector>
 
 
@@ -28,73 +39,163 @@ static inline void run_before_everything() {
 	// Also changes many default signal handlers to kill the process group
 	Utilities::log( "Setting up the group now..." );
 	Group::setup();
+
+	// Create the group's statistics segment before any process that could use it
+	GroupStats::create();
+}
+
+// Returns value quoted as one client option, so DynamoRIO does not split it at spaces
+static std::string quote( const std::string &value ) {
+	Utilities::assert( value.find( '"' ) == std::string::npos,
+	                   "Client option values may not contain a double quote" );
+	return '"' + value + '"';
 }
 
-// Start's the program passed in via drrun
-[[noreturn]] void start_program( const Args input_args, const char *socket_path ) {
+// Returns the name DynamoRIO registers the program at path under
+static std::string image_name( const std::string &path ) {
+	const size_t slash = path.rfind( '/' );
+	return ( slash == std::string::npos ) ? path : path.substr( slash + 1 );
+}
+
+// Remove the DynamoRIO registration made for the target with process id pid
+// DynamoRIO reads it when the target starts; this removes it if the target never did
+static void unregister_target( const Args &args, const pid_t pid ) {
+	if ( dr_unregister_process( image_name( args.target ).c_str(), pid, false,
+	                            DR_PLATFORM_DEFAULT ) == DR_SUCCESS ) {
+		Utilities::log( "Removed the DynamoRIO registration of process ", pid );
+	}
+}
 
-	// Construct args to give to exec
-	std::vector<const char *> exec_args;
+// Start's the program passed in with DynamoRIO injected
+// DynamoRIO is injected directly via its injection library,
+// so the target is loaded by this process's exec without going through drrun
+// If channel is not -1, it is already connected to the server; the target's initial
+// thread uses it instead of connecting to socket_path
+[[noreturn]] void start_program( const Args input_args, const char *socket_path,
+                                 const int channel = -1 ) {
+
+	// Construct the target's command line
+	std::vector<const char *> target_args;
+	target_args.push_back( input_args.target.c_str() );
+	for ( unsigned long i = 0; i < input_args.target_args.size(); ++i ) {
+		target_args.push_back( input_args.target_args[i].c_str() );
+	}
+	target_args.push_back( nullptr );
+
+	// Construct the client's options
+	std::stringstream client_ops;
+	client_ops << CLIENT_OPT_MODE " " << input_args.mode.str;
+	client_ops << " " CLIENT_OPT_JIT " " << input_args.jit_policy.str;
+	if ( socket_path[0] != 0 ) {
+		client_ops << " " CLIENT_OPT_SOCK " " << quote( socket_path );
+		client_ops << " " CLIENT_OPT_TRANSPORT " " << input_args.transport.str;
+		client_ops << " " CLIENT_OPT_WINDOW " " << input_args.async_window;
+		client_ops << " " CLIENT_OPT_FAILOVER " " << input_args.failover_slo;
+		client_ops << " " CLIENT_OPT_DIGEST " " << input_args.digest_interval;
+		client_ops << " " CLIENT_OPT_QOS " " << input_args.qos.str;
+	}
+	if ( input_args.mode.is_hybrid ) {
+		client_ops << " " CLIENT_OPT_HYBRID " " << input_args.hybrid_window;
+	}
+	if ( !input_args.zygote.empty() ) {
+		client_ops << " " CLIENT_OPT_ZYGOTE " " << quote( input_args.zygote );
+	}
+	if ( input_args.mode.is_internal && !input_args.stats_file.empty() ) {
+		client_ops << " " CLIENT_OPT_STATS " " << quote( input_args.stats_file );
+	}
 
-	// Drrun a client
-	exec_args.push_back( DRRUN_PATH );
+	// DynamoRIO options
+	bool dr_debug = false;
+	const char *dr_ops = "";
 #ifdef DEBUG_MODE
 	/* clang-format off */
 #	ifdef DR_DEBUG_LOG_LEVEL
-	exec_args.push_back( "-debug" );
-	exec_args.push_back( "-ops" );
-	exec_args.push_back( "-loglevel " DR_DEBUG_LOG_LEVEL );
+	dr_debug = true;
+	dr_ops = "-loglevel " DR_DEBUG_LOG_LEVEL;
 #	endif
 	/* clang-format on */
 #endif
-	exec_args.push_back( "-c" );
-
-	// ShadowStack dynamorio client + args
-	exec_args.push_back( DYNAMORIO_CLIENT_SO );
-	exec_args.push_back( input_args.mode.str );
 
-	// Specify target a.out
-	exec_args.push_back( "--" );
-	exec_args.push_back( input_args.target.c_str() );
-
-	// Add a.out's args
-	for ( int i = 0; i < input_args.target_args.size(); ++i ) {
-		exec_args.push_back( input_args.target_args[i].c_str() );
-	}
-
-	// Null terminate the array
-	exec_args.push_back( nullptr );
-
-	// Specify the socket path and fd
-	Utilities::assert( setenv( DR_SS_ENV_SOCK, socket_path, true ) == 0,
+	// The fds connected to the server are only known once the client connects
+	// unless the launcher connected the initial thread's channel itself
+	const std::string channel_str = ( channel == -1 ) ? "" : std::to_string( channel );
+	Utilities::assert( setenv( DR_SS_ENV_FD, channel_str.c_str(), true ) == 0,
 	                   "setenv() failed" );
-	Utilities::log( DR_SS_ENV_SOCK " environment variable set to \"", socket_path, '"' );
-	Utilities::assert( setenv( DR_SS_ENV_FD, "", true ) == 0, "setenv() failed" );
-	Utilities::log( DR_SS_ENV_FD " environment variable set to \"\"" );
+	Utilities::log( DR_SS_ENV_FD " environment variable set to \"", channel_str, '"' );
+	if ( channel != -1 ) {
+		Utilities::assert( fcntl( channel, F_SETFD, 0 ) == 0, "fcntl() failed" );
+	}
+	Utilities::assert( setenv( DR_SS_ENV_RING_FD, "", true ) == 0, "setenv() failed" );
+	Utilities::log( DR_SS_ENV_RING_FD " environment variable set to \"\"" );
+	Utilities::assert( setenv( DR_SS_ENV_PROTOCOL, "", true ) == 0, "setenv() failed" );
+	Utilities::log( DR_SS_ENV_PROTOCOL " environment variable set to \"\"" );
+
+	// Replace this process with the target once DynamoRIO is injected
+	void *inject_data;
+	const int inject_err =
+	    dr_inject_prepare_to_exec( target_args[0], target_args.data(), &inject_data );
+	Utilities::assert( inject_err == 0, "dr_inject_prepare_to_exec() failed." );
+	const char *const app_name = dr_inject_get_image_name( inject_data );
+	const process_id_t pid = dr_inject_get_process_id( inject_data );
+
+	// Register the process and the client; remove any stale registration first
+	dr_unregister_process( app_name, pid, false, DR_PLATFORM_DEFAULT );
+	Utilities::assert( dr_register_process( app_name, pid, false, DYNAMORIO_ROOT,
+	                                        DR_MODE_CODE_MANIPULATION, dr_debug,
+	                                        DR_PLATFORM_DEFAULT, dr_ops ) == DR_SUCCESS,
+	                   "dr_register_process() failed." );
+	Utilities::assert( dr_register_client( app_name, pid, false, DR_PLATFORM_DEFAULT, 0,
+	                                       0, DYNAMORIO_CLIENT_SO,
+	                                       client_ops.str().c_str() ) == DR_SUCCESS,
+	                   "dr_register_client() failed." );
 
 	// Log the action then flush the buffers
 	std::stringstream pnt;
-	pnt << "Starting dr_run\n\tCalling execvp on: ";
-	for ( unsigned long i = 0; i < exec_args.size() - 1; ++i ) {
-		pnt << exec_args[i] << ' ';
+	pnt << "Injecting DynamoRIO\n\tClient options: " << client_ops.str()
+	    << "\n\tTarget: ";
+	for ( unsigned long i = 0; i < target_args.size() - 1; ++i ) {
+		pnt << target_args[i] << ' ';
 	}
 	Utilities::log( pnt.str() );
+	if ( !dr_inject_process_inject( inject_data, false, nullptr ) ) {
+		unregister_target( input_args, pid );
+		Utilities::err( "dr_inject_process_inject() failed." );
+	}
+	StartupProfile::mark( "DynamoRIO inject" );
 	fflush( NULL );
 
-	// Start drrun
-	execvp( DRRUN_PATH, (char **) exec_args.data() );
-	Utilities::err( "execvp() failed." );
+	// Exec the target
+	dr_inject_process_run( inject_data );
+	unregister_target( input_args, pid );
+	Utilities::err( "dr_inject_process_run() failed." );
 }
 
 // Setup and start the external client
 [[noreturn]] void start_external_client( const Args &args ) {
 
-	// Setup a unix server
-	// Technically, between generating the name name and the
-	// server starting, the file could have been created.
+	// Setup a unix server in the abstract namespace, so no file is made or left behind
+	// Technically, between generating the name and the server
+	// starting, the name could have been taken.
 	// However, this is safe as the program will crash if so
-	const std::string server_name = temp_name();
-	const int sock = QS::create_server( server_name.c_str() );
+	// Every process the target becomes may connect, so allow a full backlog
+	// Over TCP, the server listens on any free loopback port instead
+	std::string server_name;
+	int sock;
+	if ( args.transport.is_tcp ) {
+		sock = QS::create_tcp_server( "127.0.0.1:0", SOMAXCONN );
+		server_name = QS::tcp_address( sock );
+	}
+	else {
+		server_name = QS::unique_abstract_name();
+		sock = QS::create_server( server_name.c_str(), SOMAXCONN );
+	}
+	StartupProfile::mark( "server bind" );
+
+	// The target's initial thread gets a channel connected before the fork
+	// so the server need not wait for it to connect
+	int channel[2];
+	Utilities::assert( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel ) == 0,
+	                   "socketpair() failed" );
 
 	// Just in case an exception occurs, setup a class
 	// whose destructor will terminate the group
@@ -109,19 +210,20 @@ static inline void run_before_everything() {
 	// If this is the child process,
 	// start the program to be protected
 	if ( pid == 0 ) {
-		Utilities::log( "Forming drrun args..." );
-		start_program( args, (char *) server_name.c_str() );
+		Utilities::log( "Starting the target..." );
+		close( channel[0] );
+		start_program( args, (char *) server_name.c_str(), channel[1] );
 	}
 
 	// Otherwise, this is the parent process
+	// Serve every client, including each zygote worker, until all have exited
 	else {
-
-		// Wait for the client then start the shadow stack
-		Utilities::log( "Waiting for client" );
-		const int client_sock = QS::accept_client( sock );
-
-		// Start the shadow stack server
-		start_external_shadow_stack( client_sock );
+		Utilities::log( "Waiting for clients" );
+		close( channel[1] );
+		start_external_shadow_stack( sock, args.transport, args.server_threads,
+		                             args.io_uring, false, args.qos.level, channel[0],
+		                             args.stats_file, args.metrics_socket );
+		unregister_target( args, pid );
 
 		// If the program made it to this point, nothing
 		// went wrong, gracefully exit
@@ -130,20 +232,97 @@ static inline void run_before_everything() {
 	}
 }
 
+// Start the internal mode target as a child, then wait for it and every process it
+// started to exit, and exit with the target's status
+// The launcher outlives the group so it can report the group's statistics. It is a
+// subreaper, so the target's orphaned descendants are its children, and are waited for
+[[noreturn]] void start_counted_program( const Args &args ) {
+	TerminateOnDestruction tod;
+	Utilities::assert( prctl( PR_SET_CHILD_SUBREAPER, 1 ) == 0, "prctl() failed." );
+	Utilities::assert( signal( SIGCHLD, SIG_DFL ) != SIG_ERR, "signal() failed." );
+	Utilities::log( "Starting the target as a child..." );
+	const pid_t pid = fork();
+	Utilities::assert( pid != -1, "fork() failed" );
+	if ( pid == 0 ) {
+		const char null = 0;
+		start_program( args, &null );
+	}
+
+	// Reap every child until none is left
+	int status = 0;
+	while ( true ) {
+		int child_status;
+		const pid_t child = waitpid( -1, &child_status, 0 );
+		if ( child == pid ) {
+			status = child_status;
+			unregister_target( args, pid );
+		}
+		else if ( child == -1 ) {
+			if ( errno == ECHILD ) {
+				break;
+			}
+			Utilities::assert( errno == EINTR, "waitpid() failed." );
+		}
+	}
+
+	// Report, then exit as the target did
+	tod.disable();
+	Utilities::message( "Program exited" );
+	GroupStats::report();
+	fflush( nullptr );
+	exit( WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status ) );
+}
+
+// Serve the shadow stacks of every launcher attached to the daemon socket
+// The daemon is its own process group, so it outlives the groups it serves
+// Over TCP, the daemon may serve launchers on other machines
+// Only launchers of the daemon's user may ask for a higher priority class than its own
+[[noreturn]] void start_daemon( const Args &args ) {
+	const int sock = args.transport.is_tcp
+	                     ? QS::create_tcp_server( args.daemon.c_str(), SOMAXCONN )
+	                     : QS::create_server( args.daemon.c_str(), SOMAXCONN );
+	Utilities::log( "Daemon serving on ", args.daemon );
+	start_external_shadow_stack( sock, args.transport, args.server_threads, args.io_uring,
+	                             true, args.qos.level, -1, args.stats_file,
+	                             args.metrics_socket );
+	Group::terminate( "Daemon stopped serving" );
+}
+
 // Main function
 int main( int argc, char *argv[] ) {
+	StartupProfile::start();
 
 	// Setup then handle arguments
 	run_before_everything();
 	const Args args = parse_args( argc, argv );
 
 	// Delete dr_ss environment variables
-	while ( getenv( DR_SS_ENV_SOCK ) != nullptr ) {
-		unsetenv( DR_SS_ENV_SOCK );
-	}
 	while ( getenv( DR_SS_ENV_FD ) != nullptr ) {
 		unsetenv( DR_SS_ENV_FD );
 	}
+	while ( getenv( DR_SS_ENV_RING_FD ) != nullptr ) {
+		unsetenv( DR_SS_ENV_RING_FD );
+	}
+	while ( getenv( DR_SS_ENV_PROTOCOL ) != nullptr ) {
+		unsetenv( DR_SS_ENV_PROTOCOL );
+	}
+	while ( getenv( DR_SS_ENV_PROFILE ) != nullptr ) {
+		unsetenv( DR_SS_ENV_PROFILE );
+	}
+
+	// Gather the group's statistics only if they were asked for
+	if ( args.stats_file.empty() ) {
+		GroupStats::destroy();
+	}
+	else {
+		GroupStats::enable( args.stats_file );
+	}
+
+	// If requested, profile the remaining startup phases
+	if ( args.startup_profile ) {
+		StartupProfile::enable();
+		StartupProfile::mark( "launcher parse" );
+	}
 
 	// We check for the return statuses of functions, so ignore sigpipe
 	Utilities::assert( signal( SIGCHLD, SIG_IGN ) != SIG_ERR, "signal() failed." );
@@ -154,14 +333,29 @@ int main( int argc, char *argv[] ) {
 	Utilities::log( "DrShadowStack initalized" );
 	Utilities::enable_multi_thread_or_process_mode();
 
+	// If this is a daemon, serve until killed
+	if ( !args.daemon.empty() ) {
+		start_daemon( args );
+	}
+
 	// If the shadow stack should be internal, start it
-	if ( args.mode.is_internal ) {
+	else if ( args.mode.is_internal && args.stats_file.empty() ) {
 		const char null = 0;
 		start_program( args, &null );
 	}
 
-	// If the shadow stack should be external
-	else if ( args.mode.is_external ) {
+	// If the group's statistics are gathered, the launcher waits to report them
+	else if ( args.mode.is_internal ) {
+		start_counted_program( args );
+	}
+
+	// If the shadow stack is kept by a daemon, the target is all that is left to run
+	else if ( args.mode.uses_server && !args.attach.empty() ) {
+		start_program( args, args.attach.c_str() );
+	}
+
+	// If the shadow stack should be external, in full or in part
+	else if ( args.mode.uses_server ) {
 		start_external_client( args );
 	}
 
@@ -0,0 +1,162 @@
+#include "shm_ring.hpp"
+#include "utilities.hpp"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <limits.h>
+
+
+// The number of times a waiter checks its word before sleeping
+#define SPIN_COUNT 2000
+
+
+/*********************************************************/
+/*                                                       */
+/*                    Helper Functions                   */
+/*                                                       */
+/*********************************************************/
+
+
+// Sleep on the futex word while it holds old. Spurious wakeups are fine
+static void futex_wait( std::atomic<uint32_t> &word, const uint32_t old ) {
+	syscall( SYS_futex, (uint32_t *) &word, FUTEX_WAIT, old, nullptr, nullptr, 0 );
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                     Private functions                 */
+/*                                                       */
+/*********************************************************/
+
+
+// Map the ring stored in the file fd refers to
+ShmRing::Shared *ShmRing::map( const int fd ) {
+	void *const ret =
+	    mmap( nullptr, sizeof( Shared ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	Utilities::assert( ret != MAP_FAILED, "mmap() failed." );
+	return (Shared *) ret;
+}
+
+// Spin then sleep until word no longer holds old
+void ShmRing::wait_while_equal( std::atomic<uint32_t> &word, const uint32_t old,
+                                std::atomic<uint32_t> &sleepers ) {
+	for ( int i = 0; i < SPIN_COUNT; ++i ) {
+		if ( word.load( std::memory_order_acquire ) != old ) {
+			return;
+		}
+		__builtin_ia32_pause();
+	}
+
+	// Announce the sleeper before the final check, so wake cannot miss it
+	sleepers.fetch_add( 1 );
+	if ( word.load() == old ) {
+		futex_wait( word, old );
+	}
+	sleepers.fetch_sub( 1 );
+}
+
+// Wake everyone sleeping on word, if anyone is
+void ShmRing::wake( std::atomic<uint32_t> &word, std::atomic<uint32_t> &sleepers ) {
+	if ( sleepers.load() != 0 ) {
+		syscall( SYS_futex, (uint32_t *) &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+		         0 );
+	}
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Create a new, empty ring in an anonymous shared memory file
+// A new file is zero filled, which is an empty ring
+int ShmRing::create() {
+	const int fd = syscall( SYS_memfd_create, "dr_shadow_stack_ring", 0 );
+	Utilities::assert( fd != -1, "memfd_create() failed." );
+	Utilities::assert( ftruncate( fd, sizeof( Shared ) ) == 0, "ftruncate() failed." );
+	return fd;
+}
+
+// Map the ring stored in the file fd refers to
+ShmRing::ShmRing( const int fd ) : shared( map( fd ) ) {}
+
+// Unmap the ring
+ShmRing::~ShmRing() { munmap( (void *) shared, sizeof( Shared ) ); }
+
+// Producer: push a message, waiting if the ring is full
+// The message is published before parked is read, and park sets parked before it reads
+// head, so either the consumer sees the message or the producer sees it parked
+// Returns true if the consumer was parked
+bool ShmRing::push( const char *const msg ) {
+	const uint32_t h = shared->head.load( std::memory_order_relaxed );
+	uint32_t t;
+	while ( h - ( t = shared->tail.load( std::memory_order_acquire ) ) == capacity ) {
+		wait_while_equal( shared->tail, t, shared->tail_sleepers );
+	}
+	memcpy( shared->slots[h & ( capacity - 1 )].msg, msg, MESSAGE_SIZE );
+	shared->head.store( h + 1 );
+	return ( shared->parked.load() != 0 ) && ( shared->parked.exchange( 0 ) != 0 );
+}
+
+// Returns the number of rets the consumer has acknowledged so far
+uint32_t ShmRing::acked() const { return shared->acks.load(); }
+
+// Producer: wait until the consumer has acknowledged n rets in total
+// Unsigned differences keep this correct when the counter wraps
+void ShmRing::wait_for_acks( const uint32_t n ) {
+	uint32_t a = shared->acks.load( std::memory_order_acquire );
+	while ( (int32_t)( a - n ) < 0 ) {
+		wait_while_equal( shared->acks, a, shared->ack_sleepers );
+		a = shared->acks.load( std::memory_order_acquire );
+	}
+}
+
+// Consumer: pop a message into msg, if there is one
+bool ShmRing::pop( char *const msg ) {
+	const uint32_t t = shared->tail.load( std::memory_order_relaxed );
+	if ( shared->head.load( std::memory_order_acquire ) == t ) {
+		return false;
+	}
+	memcpy( msg, shared->slots[t & ( capacity - 1 )].msg, MESSAGE_SIZE );
+	shared->tail.store( t + 1 );
+	wake( shared->tail, shared->tail_sleepers );
+	empty_since = 0;
+	return true;
+}
+
+// Consumer: park the ring if it has been empty for spin_ns
+// Until then the consumer keeps polling, so a producer that pushes again soon after
+// the ring went empty does not ring the doorbell
+// A message pushed after parked is set is seen by the check below, or rings the bell
+// If messages slipped in, the consumer unparks; a doorbell rung anyway is harmless
+bool ShmRing::park( const unsigned long now, const unsigned long spin_ns ) {
+	if ( shared->head.load() != shared->tail.load( std::memory_order_relaxed ) ) {
+		return false;
+	}
+	if ( empty_since == 0 ) {
+		empty_since = now;
+	}
+	if ( now - empty_since < spin_ns ) {
+		return false;
+	}
+	shared->parked.store( 1 );
+	if ( shared->head.load() != shared->tail.load( std::memory_order_relaxed ) ) {
+		shared->parked.store( 0 );
+		return false;
+	}
+	return true;
+}
+
+// Consumer: acknowledge n rets
+void ShmRing::ack( const uint32_t n ) {
+	if ( n > 0 ) {
+		shared->acks.fetch_add( n );
+		wake( shared->acks, shared->ack_sleepers );
+	}
+}
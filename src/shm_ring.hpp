@@ -0,0 +1,114 @@
+/** @file */
+#ifndef __SHM_RING_HPP__
+#define __SHM_RING_HPP__
+
+#include "message.hpp"
+
+#include <stdint.h>
+#include <atomic>
+
+
+/** A single-producer / single-consumer ring of messages in shared memory
+ *  The client pushes messages, the server pops them. The server acknowledges
+ *  each ret by bumping an ack counter instead of sending a Continue message.
+ *  The server never blocks on the ring: once it has found the ring empty for a while
+ *  it parks it, and the next push tells the client to ring the server's doorbell, a
+ *  byte sent on the client's socket, so the ring is served alongside the server's
+ *  socket clients. Until then, pushes need no doorbell.
+ *  The client's waits spin briefly, then sleep on a futex */
+class ShmRing final {
+  public:
+	/** The number of messages the ring can hold. Must be a power of two */
+	static const constexpr uint32_t capacity = 4096;
+
+	/** Create a new, empty ring in an anonymous shared memory file
+	 *  Returns the file descriptor of that file */
+	static int create();
+
+	/** Map the ring stored in the file fd refers to */
+	explicit ShmRing( const int fd );
+
+	/** Unmap the ring */
+	~ShmRing();
+
+	// Delete unwanted 'constructors'
+	ShmRing( const ShmRing & ) = delete;
+	ShmRing &operator=( const ShmRing & ) = delete;
+
+
+	/** Producer: push a MESSAGE_SIZE byte message, waiting if the ring is full
+	 *  Returns true if the consumer is parked, in which case the producer must ring
+	 *  its doorbell */
+	bool push( const char *const msg );
+
+	/** Returns the number of rets the consumer has acknowledged so far */
+	uint32_t acked() const;
+
+	/** Producer: wait until the consumer has acknowledged n rets in total */
+	void wait_for_acks( const uint32_t n );
+
+	/** Consumer: pop a message into msg
+	 *  Returns false if the ring is empty */
+	bool pop( char *const msg );
+
+	/** Consumer: park the ring if it is empty and was already found empty spin_ns
+	 *  nanoseconds before now, then wait for the doorbell before popping again
+	 *  Returns false if the ring holds messages, which should be popped instead, or
+	 *  was found empty too recently, in which case it should be polled again */
+	bool park( const unsigned long now, const unsigned long spin_ns );
+
+	/** Consumer: acknowledge n rets */
+	void ack( const uint32_t n );
+
+  private:
+	/** A message slot, aligned so slots do not straddle cache lines */
+	struct alignas( 16 ) Slot {
+		/** The message */
+		char msg[MESSAGE_SIZE];
+	};
+
+	/** The layout of the shared memory
+	 *  Producer and consumer owned fields live on separate cache lines */
+	struct Shared {
+		/** The index of the next slot to write. Only the producer writes this */
+		alignas( 64 ) std::atomic<uint32_t> head;
+		/** 1 while the consumer is parked, waiting for the doorbell */
+		std::atomic<uint32_t> parked;
+
+		/** The index of the next slot to read. Only the consumer writes this */
+		alignas( 64 ) std::atomic<uint32_t> tail;
+		/** The number of producers sleeping on tail */
+		std::atomic<uint32_t> tail_sleepers;
+
+		/** The number of rets acknowledged. Only the consumer should write this, but
+		 *  the client can map the ring writable and forge acks. That only lets it run
+		 *  ahead of the server, which still checks every ret it pops */
+		alignas( 64 ) std::atomic<uint32_t> acks;
+		/** The number of producers sleeping on acks */
+		std::atomic<uint32_t> ack_sleepers;
+
+		/** The messages */
+		alignas( 64 ) Slot slots[capacity];
+	};
+
+	/** Spin then sleep until word no longer holds old
+	 *  sleepers counts sleeping waiters */
+	static void wait_while_equal( std::atomic<uint32_t> &word, const uint32_t old,
+	                              std::atomic<uint32_t> &sleepers );
+
+	/** Map the ring stored in the file fd refers to */
+	static Shared *map( const int fd );
+
+	/** Wake everyone sleeping on word, if anyone is */
+	static void wake( std::atomic<uint32_t> &word, std::atomic<uint32_t> &sleepers );
+
+	/** The mapped shared memory */
+	Shared *const shared;
+
+	/** Consumer only: when the ring was first found empty since its last pop, 0 if it
+	 *  was not. Kept out of the shared memory, as only the consumer uses it */
+	unsigned long empty_since = 0;
+};
+
+
+#endif
@@ -0,0 +1,59 @@
+/** @file */
+#ifndef __SIPHASH_HPP__
+#define __SIPHASH_HPP__
+
+#include <stdint.h>
+
+
+/** SipHash-2-4, specialised to messages of exactly two 64 bit words
+ *  Digest mode chains a shadow stack's frames with it: the chain value of a frame is
+ *  the keyed hash of the chain value below it and the frame's address */
+namespace SipHash {
+
+	/** Rotates x left by b bits */
+	inline uint64_t rotl( const uint64_t x, const int b ) {
+		return ( x << b ) | ( x >> ( 64 - b ) );
+	}
+
+	/** One SipRound over the state v */
+	inline void round( uint64_t v[4] ) {
+		v[0] += v[1];
+		v[1] = rotl( v[1], 13 ) ^ v[0];
+		v[0] = rotl( v[0], 32 );
+		v[2] += v[3];
+		v[3] = rotl( v[3], 16 ) ^ v[2];
+		v[0] += v[3];
+		v[3] = rotl( v[3], 21 ) ^ v[0];
+		v[2] += v[1];
+		v[1] = rotl( v[1], 17 ) ^ v[2];
+		v[2] = rotl( v[2], 32 );
+	}
+
+	/** Absorbs the message word m into the state v */
+	inline void compress( uint64_t v[4], const uint64_t m ) {
+		v[3] ^= m;
+		round( v );
+		round( v );
+		v[0] ^= m;
+	}
+
+	/** Returns the SipHash-2-4 under key of the 16 byte message made of a then b,
+	 *  each read as little endian */
+	inline uint64_t hash( const uint64_t key[2], const uint64_t a, const uint64_t b ) {
+		uint64_t v[4] = { key[0] ^ 0x736f6d6570736575ULL, key[1] ^ 0x646f72616e646f6dULL,
+			              key[0] ^ 0x6c7967656e657261ULL,
+			              key[1] ^ 0x7465646279746573ULL };
+		compress( v, a );
+		compress( v, b );
+		compress( v, (uint64_t) 16 << 56 );
+		v[2] ^= 0xff;
+		round( v );
+		round( v );
+		round( v );
+		round( v );
+		return v[0] ^ v[1] ^ v[2] ^ v[3];
+	}
+}; // namespace SipHash
+
+
+#endif
@@ -12,6 +12,9 @@
 /** The flag that must be passed to invoke external mode */
 #define EXTERNAL_MODE_FLAG "ext"
 
+/** The flag that must be passed to invoke hybrid mode */
+#define HYBRID_MODE_FLAG "hyb"
+
 
 /** A tiny struct that represents a shadow stack mode */
 struct SSMode final {
@@ -36,6 +39,12 @@ struct SSMode final {
 	/** True if mode = external */
 	const bool is_external;
 
+	/** True if mode = hybrid */
+	const bool is_hybrid;
+
+	/** True if the mode keeps frames in an external server: external or hybrid */
+	const bool uses_server;
+
 	/** True if any mode is valid */
 	const bool is_valid_mode;
 };
@@ -63,6 +72,12 @@ static_assert( !str_equal( INTERNAL_MODE_FLAG, PROT_INTERNAL_MODE_FLAG ),
                "internal mode flag cannot equal protected internal mode flag" );
 static_assert( !str_equal( PROT_INTERNAL_MODE_FLAG, EXTERNAL_MODE_FLAG ),
                "protected iternal mode flag cannot equal external mode flag" );
+static_assert( !str_equal( HYBRID_MODE_FLAG, INTERNAL_MODE_FLAG ),
+               "hybrid mode flag cannot equal internal mode flag" );
+static_assert( !str_equal( HYBRID_MODE_FLAG, PROT_INTERNAL_MODE_FLAG ),
+               "hybrid mode flag cannot equal protected internal mode flag" );
+static_assert( !str_equal( HYBRID_MODE_FLAG, EXTERNAL_MODE_FLAG ),
+               "hybrid mode flag cannot equal external mode flag" );
 
 
 #endif
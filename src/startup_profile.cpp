@@ -0,0 +1,60 @@
+#include "startup_profile.hpp"
+#include "utilities.hpp"
+#include "constants.hpp"
+
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+
+
+// Initalize statics
+bool StartupProfile::enabled = false;
+unsigned long long StartupProfile::launch = 0;
+unsigned long long StartupProfile::last = 0;
+
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds
+unsigned long long StartupProfile::now() {
+	struct timespec ts;
+	Utilities::assert( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0,
+	                   "clock_gettime() failed." );
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Record the launch time
+void StartupProfile::start() { launch = last = now(); }
+
+// Enable profiling in the launcher and export the launch time
+void StartupProfile::enable() {
+	enabled = true;
+	const std::string launch_str = std::to_string( launch );
+	Utilities::assert( setenv( DR_SS_ENV_PROFILE, launch_str.c_str(), true ) == 0,
+	                   "setenv() failed." );
+	Utilities::log( DR_SS_ENV_PROFILE " environment variable set to ", launch_str );
+}
+
+// Enable profiling in the client if the launcher requested it
+// The variable is then removed, so programs the target starts are not profiled
+// against a launch that is not theirs
+void StartupProfile::attach() {
+	const char *const launch_str = getenv( DR_SS_ENV_PROFILE );
+	if ( launch_str != nullptr ) {
+		launch = strtoull( launch_str, nullptr, 10 );
+		last = launch;
+		enabled = ( launch != 0 );
+		Utilities::assert( unsetenv( DR_SS_ENV_PROFILE ) == 0, "unsetenv() failed." );
+	}
+}
+
+// Returns true if profiling is enabled
+bool StartupProfile::is_enabled() { return enabled; }
+
+// If enabled, log that phase finished now
+void StartupProfile::mark( const char *const phase ) {
+	if ( enabled ) {
+		const unsigned long long t = now();
+		Utilities::log_error( "Startup profile: ", phase, " at +", ( t - launch ) / 1000,
+		                      " us (phase took ", ( t - last ) / 1000, " us)" );
+		last = t;
+	}
+}
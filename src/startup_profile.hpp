@@ -0,0 +1,47 @@
+/** @file */
+#ifndef __STARTUP_PROFILE_HPP__
+#define __STARTUP_PROFILE_HPP__
+
+
+/** A static class used to time each phase of starting a protected program
+ *  The launcher records the launch time, then passes it to the client via
+ *  the environment, so every phase is reported relative to the same launch */
+struct StartupProfile {
+
+	/** Disable construction */
+	StartupProfile() = delete;
+
+	/** Record the launch time. Should be the first thing the launcher does */
+	static void start();
+
+	/** Enable profiling in the launcher and export the launch time
+	 *  to any client started after this point */
+	static void enable();
+
+	/** Enable profiling in the client if the launcher requested it
+	 *  Removes the launch time from the environment once read */
+	static void attach();
+
+	/** Returns true if profiling is enabled */
+	static bool is_enabled();
+
+	/** If enabled, log that phase finished now
+	 *  Reports the time since launch and since the previous mark */
+	static void mark( const char *const phase );
+
+  private:
+	/** Returns the current CLOCK_MONOTONIC time in nanoseconds */
+	static unsigned long long now();
+
+	/** True if profiling is enabled */
+	static bool enabled;
+
+	/** The time of launch */
+	static unsigned long long launch;
+
+	/** The time of the previous mark in this process */
+	static unsigned long long last;
+};
+
+
+#endif
@@ -0,0 +1,86 @@
+#include "thread_stats.hpp"
+#include "utilities.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <sstream>
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Add the counters of other to these
+void ThreadStats::add( const ThreadStats &other ) {
+	calls += other.calls;
+	rets += other.rets;
+	wildcard_pushes += other.wildcard_pushes;
+	wildcard_pops += other.wildcard_pops;
+	execve_clears += other.execve_clears;
+	max_depth = std::max( max_depth, other.max_depth );
+	depth_total += other.depth_total;
+	for ( unsigned int i = 0; i < STATS_DEPTH_BUCKETS; ++i ) {
+		depth_histogram[i] += other.depth_histogram[i];
+	}
+}
+
+// Returns the mean depth of the stack after a push, 0 if nothing was pushed
+double ThreadStats::average_depth() const {
+	const unsigned long pushes = calls + wildcard_pushes;
+	return ( pushes == 0 ) ? 0 : (double) depth_total / (double) pushes;
+}
+
+// Returns the counters as a JSON object
+std::string ThreadStats::to_json() const {
+	std::stringstream json;
+	json << "{\"calls\":" << calls << ",\"rets\":" << rets
+	     << ",\"wildcard_pushes\":" << wildcard_pushes
+	     << ",\"wildcard_pops\":" << wildcard_pops
+	     << ",\"execve_clears\":" << execve_clears << ",\"max_depth\":" << max_depth
+	     << ",\"average_depth\":" << average_depth() << ",\"depth_histogram\":[";
+	unsigned int used = STATS_DEPTH_BUCKETS;
+	while ( ( used > 0 ) && ( depth_histogram[used - 1] == 0 ) ) {
+		--used;
+	}
+	for ( unsigned int i = 0; i < used; ++i ) {
+		json << ( ( i == 0 ) ? "" : "," ) << depth_histogram[i];
+	}
+	json << "]}";
+	return json.str();
+}
+
+// Append one line of JSON describing threads to the file at path
+void Stats::append_json( const std::string &path, const char *const source,
+                         const ThreadList &threads ) {
+
+	// Build the line
+	ThreadStats total;
+	std::stringstream line;
+	line << "{\"source\":\"" << source << "\",\"pid\":" << getpid() << ",\"threads\":[";
+	for ( unsigned long i = 0; i < threads.size(); ++i ) {
+		const std::string counters = threads[i].second.to_json();
+		line << ( ( i == 0 ) ? "" : "," ) << "{\"tid\":" << threads[i].first << ","
+		     << &counters[1];
+		total.add( threads[i].second );
+	}
+	line << "],\"total\":" << total.to_json() << "}\n";
+	append_line( path, line.str() );
+	Utilities::log( "Statistics of ", threads.size(), " threads written to ", path );
+}
+
+// Append line to the file at path in one write
+void Stats::append_line( const std::string &path, const std::string &line ) {
+	const int fd = open( path.c_str(), O_CREAT | O_APPEND | O_CLOEXEC | O_WRONLY, 0644 );
+	if ( fd == -1 ) {
+		Utilities::log_error( "Could not open the statistics file ", path );
+		return;
+	}
+	if ( write( fd, line.data(), line.size() ) != (ssize_t) line.size() ) {
+		Utilities::log_error( "Could not write to the statistics file ", path );
+	}
+	close( fd );
+}
@@ -0,0 +1,89 @@
+/** @file */
+#ifndef __THREAD_STATS_HPP__
+#define __THREAD_STATS_HPP__
+
+#include <sys/types.h>
+#include <algorithm>
+#include <utility>
+#include <string>
+#include <vector>
+
+
+/** The number of buckets in a depth histogram
+ *  Bucket 0 counts depths of 0 and 1, bucket i > 0 counts depths in [2^i, 2^(i+1))
+ *  The last bucket also counts every deeper depth */
+#define STATS_DEPTH_BUCKETS 32
+
+
+/** Counters of the shadow stack events of one thread, or of many added together
+ *  The depth of the stack is sampled after every push, be it a call or a wildcard */
+struct ThreadStats final {
+
+	/** Note that a frame was pushed, leaving the stack depth frames deep */
+	inline void note_depth( const unsigned long depth ) {
+		depth_total += depth;
+		if ( depth > max_depth ) {
+			max_depth = depth;
+		}
+		const unsigned int log2 =
+		    ( depth <= 1 ) ? 0 : 63 - (unsigned int) __builtin_clzl( depth );
+		++depth_histogram[std::min( log2, (unsigned int) STATS_DEPTH_BUCKETS - 1 )];
+	}
+
+	/** Add the counters of other to these */
+	void add( const ThreadStats &other );
+
+	/** Returns the mean depth of the stack after a push, 0 if nothing was pushed */
+	double average_depth() const;
+
+	/** Returns the counters as a JSON object
+	 *  Trailing empty buckets of the depth histogram are omitted */
+	std::string to_json() const;
+
+
+	/** The number of calls pushed */
+	unsigned long calls = 0;
+
+	/** The number of rets popped, including those that popped a wildcard */
+	unsigned long rets = 0;
+
+	/** The number of wildcards pushed for signal handlers */
+	unsigned long wildcard_pushes = 0;
+
+	/** The number of rets that popped a wildcard */
+	unsigned long wildcard_pops = 0;
+
+	/** The number of times an execve cleared the stack */
+	unsigned long execve_clears = 0;
+
+	/** The deepest the stack was */
+	unsigned long max_depth = 0;
+
+	/** The sum of the depth of the stack after each push */
+	unsigned long depth_total = 0;
+
+	/** The number of pushes that left the stack at a depth in each bucket */
+	unsigned long depth_histogram[STATS_DEPTH_BUCKETS] = {};
+};
+
+
+/** Reporting of thread statistics */
+namespace Stats {
+
+	/** The counters of each thread of a process, with its thread id */
+	typedef std::vector<std::pair<pid_t, ThreadStats>> ThreadList;
+
+	/** Append one line of JSON to the file at path, creating it if need be
+	 *  The line holds the calling process's pid, source, the counters of each of
+	 *  threads, and their total. Each line is written at once, so many processes
+	 *  may append to the same file. On failure, an error is logged */
+	void append_json( const std::string &path, const char *const source,
+	                  const ThreadList &threads );
+
+	/** Append line, which must end in a newline, to the file at path in one write
+	 *  The file is created if need be. On failure, an error is logged */
+	void append_line( const std::string &path, const std::string &line );
+}; // namespace Stats
+
+
+#endif
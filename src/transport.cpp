@@ -0,0 +1,13 @@
+#include "transport.hpp"
+#include "utilities.hpp"
+
+#include "string.h"
+
+
+// The constructor
+Transport::Transport( const char *const t )
+    : str( Utilities::safe_strdup( t ) ),
+      is_socket( strcmp( str, SOCKET_TRANSPORT_FLAG ) == 0 ),
+      is_shm( strcmp( str, SHM_TRANSPORT_FLAG ) == 0 ),
+      is_tcp( strcmp( str, TCP_TRANSPORT_FLAG ) == 0 ),
+      is_valid_transport( is_socket || is_shm || is_tcp ) {}
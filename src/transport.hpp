@@ -0,0 +1,53 @@
+/** @file */
+#ifndef __TRANSPORT_HPP__
+#define __TRANSPORT_HPP__
+
+
+/** The flag that selects the unix socket transport */
+#define SOCKET_TRANSPORT_FLAG "sock"
+
+/** The flag that selects the shared memory ring transport */
+#define SHM_TRANSPORT_FLAG "shm"
+
+/** The flag that selects the TCP transport */
+#define TCP_TRANSPORT_FLAG "tcp"
+
+/** The default transport */
+#define DEFAULT_TRANSPORT SOCKET_TRANSPORT_FLAG
+
+
+/** A tiny struct that represents how external mode messages are transported
+ *  With the socket transport every message is written to the server's socket.
+ *  With the shm transport, messages go through a shared memory ring,
+ *  and the socket is only used to setup the ring, ring the server's doorbell,
+ *  and detect disconnects.
+ *  The TCP transport is the socket transport over TCP, so the server may run on
+ *  another machine. Its address is of the form <IPv4 address>:<port> */
+struct Transport final {
+
+	/** The constructor
+	 *  Reads the transport in from t and stores a copy of it */
+	Transport( const char *const t );
+
+	/** Disable the default constructor */
+	Transport() = delete;
+
+
+	/** The transport */
+	const char *const str;
+
+	/** True if transport = socket */
+	const bool is_socket;
+
+	/** True if transport = shared memory ring */
+	const bool is_shm;
+
+	/** True if transport = TCP */
+	const bool is_tcp;
+
+	/** True if any transport is valid */
+	const bool is_valid_transport;
+};
+
+
+#endif
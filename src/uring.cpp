@@ -0,0 +1,288 @@
+#include "uring.hpp"
+#include "utilities.hpp"
+
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+
+
+/*********************************************************/
+/*                                                       */
+/*                    Helper Functions                   */
+/*                                                       */
+/*********************************************************/
+
+
+// Map size bytes of the ring fd at offset, shared with the kernel
+// Returns nullptr on failure
+static void *map_ring( const int fd, const size_t size, const off_t offset ) {
+	void *const ret =
+	    mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	          offset );
+	return ( ret == MAP_FAILED ) ? nullptr : ret;
+}
+
+// Returns the pointer offset bytes into map
+template <typename T> static T *at( void *const map, const unsigned int offset ) {
+	return (T *) ( (char *) map + offset );
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                     Private functions                 */
+/*                                                       */
+/*********************************************************/
+
+
+// Returns a cleared submission entry
+// If the submission queue is full, the queued requests are submitted first
+struct io_uring_sqe *Uring::next_sqe() {
+	const unsigned int entries = *sq.mask + 1;
+	if ( sq_tail - __atomic_load_n( sq.head, __ATOMIC_ACQUIRE ) == entries ) {
+		enter( 0 );
+	}
+	const unsigned int index = sq_tail & *sq.mask;
+	struct io_uring_sqe *const sqe = &sq.sqes[index];
+	memset( sqe, 0, sizeof( *sqe ) );
+	sq.array[index] = index;
+	++sq_tail;
+	++queued;
+	return sqe;
+}
+
+// Enter the kernel to submit queued requests, and wait for wait_for completions
+// A full completion queue is not an error if completions are what was waited for
+void Uring::enter( const unsigned int wait_for ) {
+	__atomic_store_n( sq.tail, sq_tail, __ATOMIC_RELEASE );
+	const unsigned int flags = ( wait_for > 0 ) ? IORING_ENTER_GETEVENTS : 0;
+	while ( true ) {
+		const long ret =
+		    syscall( __NR_io_uring_enter, fd, queued, wait_for, flags, nullptr, 0 );
+		if ( ret >= 0 ) {
+			queued -= (unsigned int) ret;
+			return;
+		}
+		if ( ( errno == EBUSY ) && ( wait_for > 0 ) ) {
+			return;
+		}
+		Utilities::assert( ( errno == EINTR ) || ( errno == EAGAIN ),
+		                   "io_uring_enter() failed." );
+	}
+}
+
+// Unmap whichever of the queues were mapped
+void Uring::unmap_queues() {
+	if ( sqes_map != nullptr ) {
+		munmap( sqes_map, sqes_map_size );
+	}
+	if ( ( cq_map != nullptr ) && ( cq_map != sq_map ) ) {
+		munmap( cq_map, cq_map_size );
+	}
+	if ( sq_map != nullptr ) {
+		munmap( sq_map, sq_map_size );
+	}
+	sq_map = cq_map = sqes_map = nullptr;
+}
+
+// Hand the buffer bid to the kernel to receive into
+// The buffers are indexed from the start of the ring: compiled as C++, the header's
+// flexible array member is placed after an empty struct, and so at the wrong offset
+void Uring::provide( const unsigned short bid ) {
+	struct io_uring_buf &buf =
+	    ( (struct io_uring_buf *) buf_ring )[buf_tail & ( num_buffers - 1 )];
+	buf.addr = (uint64_t)(uintptr_t) &buffers[(size_t) bid * buffer_size];
+	buf.len = buffer_size;
+	buf.bid = bid;
+	++buf_tail;
+	__atomic_store_n( &buf_ring->tail, buf_tail, __ATOMIC_RELEASE );
+}
+
+
+/*********************************************************/
+/*                                                       */
+/*                       From Header                     */
+/*                                                       */
+/*********************************************************/
+
+
+// Returns true if this kernel supports everything Uring needs
+// Multishot receives cannot be probed for, so one is tried on a socketpair
+bool Uring::is_supported() {
+	Uring ring( 8, 1, 64 );
+	if ( !ring.is_valid() ) {
+		return false;
+	}
+	int pair[2];
+	if ( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair ) != 0 ) {
+		return false;
+	}
+	const char byte = 0;
+	bool supported = false;
+	ring.recv_multishot( pair[0], 0 );
+	if ( write( pair[1], &byte, 1 ) == 1 ) {
+		ring.submit_and_wait();
+		auto check = [&]( const uint64_t, const int res, const unsigned int flags ) {
+			supported = ( res == 1 ) && ( flags & IORING_CQE_F_BUFFER ) &&
+			            ( flags & IORING_CQE_F_MORE );
+		};
+		ring.for_each_completion( check );
+	}
+	close( pair[0] );
+	close( pair[1] );
+	return supported;
+}
+
+// Set up a ring and provide it its buffers
+// Cooperative task running is only a hint, so kernels without it get a plain ring
+Uring::Uring( const unsigned int entries, const unsigned int num_buffers_,
+              const unsigned int buffer_size_ )
+    : num_buffers( num_buffers_ ), buffer_size( buffer_size_ ) {
+	struct io_uring_params params;
+	memset( &params, 0, sizeof( params ) );
+	params.flags = IORING_SETUP_COOP_TASKRUN;
+	int ring = (int) syscall( __NR_io_uring_setup, entries, &params );
+	if ( ring < 0 ) {
+		memset( &params, 0, sizeof( params ) );
+		ring = (int) syscall( __NR_io_uring_setup, entries, &params );
+	}
+	if ( ring < 0 ) {
+		Utilities::log( "io_uring_setup() failed: ", strerror( errno ) );
+		return;
+	}
+
+	// Map the queues, with one mapping if the kernel allows
+	sq_map_size = params.sq_off.array + params.sq_entries * sizeof( unsigned int );
+	cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		sq_map_size = cq_map_size = std::max( sq_map_size, cq_map_size );
+	}
+	sq_map = map_ring( ring, sq_map_size, IORING_OFF_SQ_RING );
+	cq_map = ( params.features & IORING_FEAT_SINGLE_MMAP )
+	             ? sq_map
+	             : map_ring( ring, cq_map_size, IORING_OFF_CQ_RING );
+	sqes_map_size = params.sq_entries * sizeof( struct io_uring_sqe );
+	sqes_map = map_ring( ring, sqes_map_size, IORING_OFF_SQES );
+
+	// Provide the buffers
+	// The buffer ring must be page aligned, which mmap guarantees
+	const size_t buf_ring_size = num_buffers * sizeof( struct io_uring_buf );
+	void *const buf_map = mmap( nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+	                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	struct io_uring_buf_reg reg;
+	memset( &reg, 0, sizeof( reg ) );
+	reg.ring_addr = (uint64_t)(uintptr_t) buf_map;
+	reg.ring_entries = num_buffers;
+	reg.bgid = 0;
+	if ( ( sq_map == nullptr ) || ( cq_map == nullptr ) || ( sqes_map == nullptr ) ||
+	     ( buf_map == MAP_FAILED ) ||
+	     ( syscall( __NR_io_uring_register, ring, IORING_REGISTER_PBUF_RING, &reg, 1 ) !=
+	       0 ) ) {
+		Utilities::log( "Could not map io_uring or provide it buffers: ",
+		                strerror( errno ) );
+		if ( buf_map != MAP_FAILED ) {
+			munmap( buf_map, buf_ring_size );
+		}
+		close( ring );
+		unmap_queues();
+		return;
+	}
+	fd = ring;
+	buf_ring = (struct io_uring_buf_ring *) buf_map;
+	buffers = new char[(size_t) num_buffers * buffer_size];
+	for ( unsigned int i = 0; i < num_buffers; ++i ) {
+		provide( (unsigned short) i );
+	}
+
+	// Locate each part of the queues
+	sq.head = at<unsigned int>( sq_map, params.sq_off.head );
+	sq.tail = at<unsigned int>( sq_map, params.sq_off.tail );
+	sq.mask = at<unsigned int>( sq_map, params.sq_off.ring_mask );
+	sq.array = at<unsigned int>( sq_map, params.sq_off.array );
+	sq.sqes = (struct io_uring_sqe *) sqes_map;
+	cq.head = at<unsigned int>( cq_map, params.cq_off.head );
+	cq.tail = at<unsigned int>( cq_map, params.cq_off.tail );
+	cq.mask = at<unsigned int>( cq_map, params.cq_off.ring_mask );
+	cq.cqes = at<struct io_uring_cqe>( cq_map, params.cq_off.cqes );
+	sq_tail = *sq.tail;
+}
+
+// Tear down the ring
+// Closing the ring cancels its requests and frees the buffer ring registration
+Uring::~Uring() {
+	if ( fd != -1 ) {
+		close( fd );
+	}
+	unmap_queues();
+	if ( buf_ring != nullptr ) {
+		munmap( buf_ring, num_buffers * sizeof( struct io_uring_buf ) );
+	}
+	delete[] buffers;
+}
+
+// Queue a multishot receive on sock into the provided buffers
+void Uring::recv_multishot( const int sock, const uint64_t user_data ) {
+	struct io_uring_sqe *const sqe = next_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sock;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = user_data;
+}
+
+// Queue a send of the len bytes at buf on sock, retried until every byte is sent
+void Uring::send( const int sock, const void *const buf, const size_t len,
+                  const uint64_t user_data ) {
+	struct io_uring_sqe *const sqe = next_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t)(uintptr_t) buf;
+	sqe->len = (unsigned int) len;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->user_data = user_data;
+}
+
+// Queue a multishot poll for fd becoming readable
+void Uring::poll_multishot( const int fd_, const uint64_t user_data ) {
+	struct io_uring_sqe *const sqe = next_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd_;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data;
+}
+
+// Queue the cancellation of the request whose user data is target
+void Uring::cancel( const uint64_t target, const uint64_t user_data ) {
+	struct io_uring_sqe *const sqe = next_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = user_data;
+}
+
+// Submit every queued request, then wait until a completion is ready
+void Uring::submit_and_wait() { enter( 1 ); }
+
+// Submit every queued request without waiting
+void Uring::submit() {
+	if ( queued > 0 ) {
+		enter( 0 );
+	}
+}
+
+// Returns the provided buffer the completion with flags received into
+char *Uring::buffer( const unsigned int flags ) const {
+	return &buffers[(size_t)( flags >> IORING_CQE_BUFFER_SHIFT ) * buffer_size];
+}
+
+// Give the buffer the completion with flags received into back to the kernel
+void Uring::recycle( const unsigned int flags ) {
+	provide( (unsigned short) ( flags >> IORING_CQE_BUFFER_SHIFT ) );
+}
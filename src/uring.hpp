@@ -0,0 +1,143 @@
+/** @file */
+#ifndef __URING_HPP__
+#define __URING_HPP__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** A minimal io_uring, driven through its system calls directly
+ *  Receives are multishot, and land in a ring of buffers provided to the kernel up front,
+ *  so a connection needs one request for as long as it stays open. Requests are queued,
+ *  then submitted together by the same system call that waits for completions */
+class Uring final {
+  public:
+	/** Returns true if this kernel supports everything Uring needs:
+	 *  io_uring itself, provided buffer rings, and multishot receives */
+	static bool is_supported();
+
+	/** Set up a ring with room for entries requests, and provide it num_buffers
+	 *  buffers of buffer_size bytes to receive into. num_buffers must be a power of two
+	 *  is_valid() is false if the kernel refused */
+	Uring( const unsigned int entries, const unsigned int num_buffers,
+	       const unsigned int buffer_size );
+
+	/** Tear down the ring */
+	~Uring();
+
+	// Delete unwanted 'constructors'
+	Uring( const Uring & ) = delete;
+	Uring &operator=( const Uring & ) = delete;
+
+
+	/** Returns true if the ring was set up */
+	bool is_valid() const { return fd != -1; }
+
+	/** Queue a multishot receive on sock into the provided buffers */
+	void recv_multishot( const int sock, const uint64_t user_data );
+
+	/** Queue a send of the len bytes at buf on sock, retried until every byte is sent
+	 *  buf must stay valid until the send completes */
+	void send( const int sock, const void *const buf, const size_t len,
+	           const uint64_t user_data );
+
+	/** Queue a multishot poll for fd becoming readable */
+	void poll_multishot( const int fd, const uint64_t user_data );
+
+	/** Queue the cancellation of the request whose user data is target */
+	void cancel( const uint64_t target, const uint64_t user_data );
+
+	/** Submit every queued request, then wait until a completion is ready */
+	void submit_and_wait();
+
+	/** Submit every queued request without waiting */
+	void submit();
+
+	/** Call handle( user_data, res, flags ) on every ready completion */
+	template <typename Handler> void for_each_completion( Handler handle ) {
+		unsigned int head = *cq.head;
+		const unsigned int tail = __atomic_load_n( cq.tail, __ATOMIC_ACQUIRE );
+		for ( ; head != tail; ++head ) {
+			const struct io_uring_cqe &cqe = cq.cqes[head & *cq.mask];
+			handle( cqe.user_data, cqe.res, cqe.flags );
+		}
+		__atomic_store_n( cq.head, head, __ATOMIC_RELEASE );
+	}
+
+	/** Returns the provided buffer the completion with flags received into */
+	char *buffer( const unsigned int flags ) const;
+
+	/** Give the buffer the completion with flags received into back to the kernel */
+	void recycle( const unsigned int flags );
+
+  private:
+	/** The submission queue, as mapped from the kernel */
+	struct SubmissionQueue {
+		unsigned int *head;
+		unsigned int *tail;
+		unsigned int *mask;
+		unsigned int *array;
+		struct io_uring_sqe *sqes;
+	};
+
+	/** The completion queue, as mapped from the kernel */
+	struct CompletionQueue {
+		unsigned int *head;
+		unsigned int *tail;
+		unsigned int *mask;
+		struct io_uring_cqe *cqes;
+	};
+
+	/** Returns a cleared submission entry, submitting queued ones first if the queue is
+	 *  full */
+	struct io_uring_sqe *next_sqe();
+
+	/** Enter the kernel to submit queued requests, and wait for wait_for completions */
+	void enter( const unsigned int wait_for );
+
+	/** Unmap whichever of the queues were mapped */
+	void unmap_queues();
+
+	/** Hand the buffer bid to the kernel to receive into */
+	void provide( const unsigned short bid );
+
+	/** The ring's file descriptor, -1 if it could not be set up */
+	int fd = -1;
+
+	/** The submission queue */
+	SubmissionQueue sq;
+
+	/** The completion queue */
+	CompletionQueue cq;
+
+	/** The tail of the submission queue, published to the kernel on each enter */
+	unsigned int sq_tail = 0;
+
+	/** The number of requests queued but not yet submitted */
+	unsigned int queued = 0;
+
+	/** The mapped rings, and their sizes */
+	void *sq_map = nullptr;
+	size_t sq_map_size = 0;
+	void *cq_map = nullptr;
+	size_t cq_map_size = 0;
+	void *sqes_map = nullptr;
+	size_t sqes_map_size = 0;
+
+	/** The ring of provided buffers, shared with the kernel */
+	struct io_uring_buf_ring *buf_ring = nullptr;
+
+	/** The provided buffers */
+	char *buffers = nullptr;
+
+	/** The number of provided buffers, and the size of each */
+	unsigned int num_buffers = 0;
+	unsigned int buffer_size = 0;
+
+	/** The index of the next free slot of buf_ring */
+	unsigned short buf_tail = 0;
+};
+
+
+#endif
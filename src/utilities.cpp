@@ -4,6 +4,7 @@
 
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
 #include <set>
 
@@ -92,6 +93,13 @@ void Utilities::assert( const bool b, const char *const s ) {
 	}
 }
 
+// strdup that kills the group on failure
+char *Utilities::safe_strdup( const char *const s ) {
+	char *const ret = strdup( s );
+	assert( ret != nullptr, "strdup() failed." );
+	return ret;
+}
+
 
 /*********************************************************/
 /*                                                       */
@@ -71,6 +71,9 @@ class Utilities {
 	/** assert b, if false call program_err(s) */
 	static void assert( const bool b, const char *const s );
 
+	/** strdup that kills the group on failure */
+	static char *safe_strdup( const char *const s );
+
 
 	/*********************************************************/
 	/*                                                       */
@@ -19,5 +19,5 @@ tar -zxf DynamoRIO-x86_64-Linux-7.0.17636-0.tar.gz
 DR=$(pwd)/DynamoRIO-x86_64-Linux-7.0.17636-0
 
 echo "Building DrShadowStack..."
-cmake .. -DDynamoRIO_DIR=$DR/cmake -DDRRUN_PATH=$DR/bin64/drrun
+cmake .. -DDynamoRIO_DIR=$DR/cmake -DDynamoRIO_ROOT=$DR
 make -j 2
@@ -0,0 +1,101 @@
+#include "check.hpp"
+#include "batch_validator.hpp"
+
+#include <string>
+#include <vector>
+
+
+// The wildcard used by the tests
+static const uint64_t wildcard = 0x1;
+
+// The most rets in a batch the tests check, enough to cover every vector width and tail
+static const size_t max_batch = 40;
+
+// Returns the address the i'th ret of a batch returns to
+static uint64_t address( const size_t i ) { return 0x7f0000400000 + 0x10 * i; }
+
+// Every ret matches, so no ret is reported, whatever the length of the batch
+static void all_match() {
+	std::vector<uint64_t> expected, actual;
+	for ( size_t n = 0; n <= max_batch; ++n ) {
+		CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), n,
+		                                       wildcard ) == n );
+		expected.push_back( address( n ) );
+		actual.push_back( address( n ) );
+	}
+}
+
+// A single mismatch is found wherever it is, in a vector or in the tail
+static void one_mismatch() {
+	for ( size_t n = 1; n <= max_batch; ++n ) {
+		for ( size_t bad = 0; bad < n; ++bad ) {
+			std::vector<uint64_t> expected, actual;
+			for ( size_t i = 0; i < n; ++i ) {
+				expected.push_back( address( i ) );
+				actual.push_back( address( i ) ^ ( ( i == bad ) ? 0x8 : 0 ) );
+			}
+			CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), n,
+			                                       wildcard ) == bad );
+		}
+	}
+}
+
+// Of several mismatches, the first is reported
+static void first_of_many() {
+	std::vector<uint64_t> expected, actual;
+	for ( size_t i = 0; i < max_batch; ++i ) {
+		expected.push_back( address( i ) );
+		actual.push_back( ( i % 7 == 5 ) ? 0 : address( i ) );
+	}
+	CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), max_batch,
+	                                       wildcard ) == 5 );
+}
+
+// Addresses that differ only in one half of their 64 bits do not match
+// SSE2 compares 32 bit halves, which must both be equal
+static void halves_differ() {
+	std::vector<uint64_t> expected( max_batch, 0x1122334455667788 );
+	std::vector<uint64_t> actual = expected;
+	actual[9] = 0x1122334400000000;
+	actual[13] = 0x0000000055667788;
+	CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), max_batch,
+	                                       wildcard ) == 9 );
+	actual[9] = expected[9];
+	CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), max_batch,
+	                                       wildcard ) == 13 );
+}
+
+// A frame holding the wildcard matches any address, but a ret to the wildcard does
+// not match a frame that holds an address
+static void wildcards() {
+	std::vector<uint64_t> expected, actual;
+	for ( size_t i = 0; i < max_batch; ++i ) {
+		expected.push_back( ( i % 3 == 0 ) ? wildcard : address( i ) );
+		actual.push_back( address( i ) + ( ( i % 3 == 0 ) ? 0x100 : 0 ) );
+	}
+	CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), max_batch,
+	                                       wildcard ) == max_batch );
+	actual[20] = wildcard;
+	CHECK( BatchValidator::first_mismatch( expected.data(), actual.data(), max_batch,
+	                                       wildcard ) == 20 );
+}
+
+// Main function
+// Every implementation the cpu supports is checked; scalar is always supported
+int main() {
+	CHECK( BatchValidator::use( "scalar" ) );
+	CHECK( !BatchValidator::use( "unknown" ) );
+	for ( const char *const name : { "avx2", "sse2", "scalar" } ) {
+		if ( !BatchValidator::use( name ) ) {
+			std::cout << "Skipping " << name << ", which this cpu does not support\n";
+			continue;
+		}
+		CHECK( std::string( BatchValidator::implementation() ) == name );
+		all_match();
+		one_mismatch();
+		first_of_many();
+		halves_differ();
+		wildcards();
+	}
+	return CHECK_RESULT();
+}
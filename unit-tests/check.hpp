@@ -0,0 +1,25 @@
+/** @file */
+#ifndef __CHECK_HPP__
+#define __CHECK_HPP__
+
+#include <iostream>
+#include <stdlib.h>
+
+
+/** The number of checks that failed so far */
+static int failed_checks = 0;
+
+/** Check that cond holds. If not, report where and count the failure */
+#define CHECK( cond )                                                                   \
+	do {                                                                                \
+		if ( !( cond ) ) {                                                              \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n";  \
+			++failed_checks;                                                            \
+		}                                                                               \
+	} while ( 0 )
+
+/** Returns the exit status of a test: success only if every check passed */
+#define CHECK_RESULT() ( ( failed_checks == 0 ) ? EXIT_SUCCESS : EXIT_FAILURE )
+
+
+#endif
@@ -0,0 +1,108 @@
+#include "check.hpp"
+#include "cow_stack.hpp"
+
+#include <vector>
+
+
+// Returns the value pushed as the i'th element
+static CowStack::value_type value( const size_t i ) {
+	return (CowStack::value_type)( 0x1000 + i );
+}
+
+// Returns true if stk holds exactly the elements of model, bottom first
+// Empties stk
+static bool drains_to( CowStack &stk, const std::vector<CowStack::value_type> &model ) {
+	if ( stk.size() != model.size() ) {
+		return false;
+	}
+	for ( size_t i = model.size(); i > 0; --i ) {
+		if ( stk.empty() || ( stk.top() != model[i - 1] ) ) {
+			return false;
+		}
+		stk.pop();
+	}
+	return stk.empty();
+}
+
+// Pushes and pops across chunk boundaries keep the stack's order
+static void push_and_pop() {
+	const size_t n = 3 * CowStack::chunk_size + 7;
+	CowStack stk;
+	std::vector<CowStack::value_type> model;
+	CHECK( stk.empty() );
+	for ( size_t i = 0; i < n; ++i ) {
+		stk.push( value( i ) );
+		model.push_back( value( i ) );
+		CHECK( stk.top() == value( i ) );
+	}
+	CHECK( stk.size() == n );
+
+	// Pop back down past a chunk boundary, then grow again
+	for ( size_t i = 0; i < CowStack::chunk_size + 1; ++i ) {
+		stk.pop();
+		model.pop_back();
+	}
+	for ( size_t i = 0; i < 5; ++i ) {
+		stk.push( value( n + i ) );
+		model.push_back( value( n + i ) );
+	}
+	CHECK( drains_to( stk, model ) );
+}
+
+// A copy shares the original's elements, but neither sees the other's changes
+static void copies_are_independent() {
+	CowStack parent;
+	std::vector<CowStack::value_type> parent_model;
+	for ( size_t i = 0; i < CowStack::chunk_size + 10; ++i ) {
+		parent.push( value( i ) );
+		parent_model.push_back( value( i ) );
+	}
+	CowStack child = parent;
+	std::vector<CowStack::value_type> child_model = parent_model;
+	CHECK( child.size() == parent.size() );
+	CHECK( child.top() == parent.top() );
+
+	// The child unwinds into the shared chunks, the parent writes its shared top chunk
+	for ( size_t i = 0; i < 20; ++i ) {
+		child.pop();
+		child_model.pop_back();
+	}
+	child.push( value( 9000 ) );
+	child_model.push_back( value( 9000 ) );
+	parent.push( value( 7000 ) );
+	parent_model.push_back( value( 7000 ) );
+
+	// A copy of a copy is independent as well
+	CowStack grandchild = child;
+	std::vector<CowStack::value_type> grandchild_model = child_model;
+	grandchild.clear();
+	grandchild_model.clear();
+	grandchild.push( value( 1 ) );
+	grandchild_model.push_back( value( 1 ) );
+
+	CHECK( drains_to( parent, parent_model ) );
+	CHECK( drains_to( child, child_model ) );
+	CHECK( drains_to( grandchild, grandchild_model ) );
+}
+
+// A cleared stack is empty and can be reused
+static void clear_and_reuse() {
+	CowStack stk;
+	for ( size_t i = 0; i < 2 * CowStack::chunk_size; ++i ) {
+		stk.push( value( i ) );
+	}
+	stk.clear();
+	CHECK( stk.empty() );
+	CHECK( stk.size() == 0 );
+	stk.push( value( 42 ) );
+	CHECK( stk.size() == 1 );
+	CHECK( stk.top() == value( 42 ) );
+}
+
+// Main function
+int main() {
+	push_and_pop();
+	copies_are_independent();
+	clear_and_reuse();
+	return CHECK_RESULT();
+}
@@ -0,0 +1,95 @@
+#include "check.hpp"
+#include "digest_chain.hpp"
+#include "siphash.hpp"
+
+
+// The wildcard frame pushed for a signal
+#define WILD ( ~0ull )
+
+// The key of the SipHash reference test vectors: bytes 0 to 15
+static const uint64_t ref_key[2] = { 0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull };
+
+// Returns the digest the server computes for the frames of chain, chained under key
+static uint64_t server_digest( const uint64_t key[2], const DigestChain &chain ) {
+	uint64_t value = 0;
+	for ( size_t i = 0; i < chain.size(); ++i ) {
+		value = DigestChain::extend( key, value, chain.address( i ) );
+	}
+	return value;
+}
+
+// The hash matches the reference implementation on a 16 byte message of bytes 0 to 15
+static void reference_vector() {
+	CHECK( SipHash::hash( ref_key, 0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull ) ==
+	       0x3f2acc7f57c29bdbull );
+}
+
+// Matching rets pop, and the digest of what is left is the one the server computes
+// from the addresses alone. Popping restores the digest of the frame below
+static void push_and_pop() {
+	DigestChain chain;
+	chain.start_epoch( ref_key );
+	CHECK( chain.digest() == 0 );
+	CHECK( chain.pop( 1, WILD ) == DigestChain::EMPTY );
+	chain.push( 0x1000 );
+	const uint64_t one = chain.digest();
+	chain.push( 0x2000 );
+	chain.push( WILD );
+	CHECK( chain.size() == 3 );
+	CHECK( chain.digest() == server_digest( ref_key, chain ) );
+	CHECK( chain.pop( 0x1234, WILD ) == DigestChain::POPPED );
+	CHECK( chain.pop( 0x1000, WILD ) == DigestChain::MISMATCH );
+	CHECK( chain.size() == 2 );
+	CHECK( chain.pop( 0x2000, WILD ) == DigestChain::POPPED );
+	CHECK( chain.digest() == one );
+	CHECK( chain.pop( 0x1000, WILD ) == DigestChain::POPPED );
+	CHECK( chain.digest() == 0 );
+}
+
+// The same frames chain to another digest under another key, and a new epoch starts
+// with no frames
+static void epochs() {
+	const uint64_t other[2] = { 1, 2 };
+	DigestChain a, b;
+	a.start_epoch( ref_key );
+	b.start_epoch( other );
+	a.push( 0x1000 );
+	b.push( 0x1000 );
+	CHECK( a.digest() != b.digest() );
+	CHECK( b.digest() == server_digest( other, b ) );
+	a.start_epoch( other );
+	CHECK( a.size() == 0 );
+	CHECK( a.digest() == 0 );
+}
+
+// A frame whose address was overwritten, as by an attacker writing to the client's
+// memory, no longer matches its chain value. It is not popped, even for a ret to the new
+// address, and the digest no longer matches the one the server computes from the
+// addresses it is sent
+static void tampering() {
+	DigestChain chain;
+	chain.start_epoch( ref_key );
+	chain.push( 0x1000 );
+	chain.push( 0x2000 );
+	chain.push( 0x3000 );
+	CHECK( chain.pop( 0x3000, WILD ) == DigestChain::POPPED );
+	const_cast<uint64_t &>( chain.address( 1 ) ) = 0x6666;
+	CHECK( chain.pop( 0x6666, WILD ) == DigestChain::TAMPERED );
+	CHECK( chain.size() == 2 );
+	CHECK( chain.digest() != server_digest( ref_key, chain ) );
+
+	// Overwriting a frame below the top is caught once it is the top
+	const_cast<uint64_t &>( chain.address( 1 ) ) = 0x2000;
+	const_cast<uint64_t &>( chain.address( 0 ) ) = 0x6666;
+	CHECK( chain.pop( 0x2000, WILD ) == DigestChain::POPPED );
+	CHECK( chain.pop( 0x6666, WILD ) == DigestChain::TAMPERED );
+}
+
+// Main function
+int main() {
+	reference_vector();
+	push_and_pop();
+	epochs();
+	tampering();
+	return CHECK_RESULT();
+}
@@ -0,0 +1,106 @@
+#include "check.hpp"
+#include "group_stats.hpp"
+#include "constants.hpp"
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+// The argument that has the test run as a client image
+#define CLIENT_ARG "client"
+
+// Run this test as a new client image, exported fd as the segment, which adds calls
+// calls to its slot. An image starts with no segment mapped, as a client does
+// If report is true, the client then reports, which appends a line to the statistics
+// file if the client used fd as the segment
+static void run_client( const int fd, const unsigned long calls, const bool report ) {
+	const pid_t pid = fork();
+	CHECK( pid != -1 );
+	if ( pid == 0 ) {
+		const std::string fd_str = std::to_string( fd );
+		const std::string calls_str = std::to_string( calls );
+		setenv( DR_SS_ENV_STATS_FD, fd_str.c_str(), true );
+		execl( "/proc/self/exe", "group_stats_test", CLIENT_ARG, calls_str.c_str(),
+		       report ? "report" : "quiet", (char *) nullptr );
+		_exit( EXIT_FAILURE );
+	}
+	int status;
+	CHECK( waitpid( pid, &status, 0 ) == pid );
+	CHECK( WIFEXITED( status ) && ( WEXITSTATUS( status ) == EXIT_SUCCESS ) );
+}
+
+// Returns a new memfd holding a copy of the segment on segment_fd, sealed like it if
+// sealed is true. If magic is false, the copy's magic number is cleared
+static int fake_segment( const int segment_fd, const bool sealed, const bool magic ) {
+	const off_t size = lseek( segment_fd, 0, SEEK_END );
+	std::vector<char> contents( (size_t) size );
+	CHECK( pread( segment_fd, contents.data(), contents.size(), 0 ) == size );
+	if ( !magic ) {
+		memset( contents.data(), 0, sizeof( uint64_t ) );
+	}
+	const int fd = (int) syscall( SYS_memfd_create, "fake", MFD_ALLOW_SEALING );
+	CHECK( fd != -1 );
+	CHECK( write( fd, contents.data(), contents.size() ) == size );
+	if ( sealed ) {
+		CHECK( fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL ) == 0 );
+	}
+	return fd;
+}
+
+// Main function
+// Only the client given the real segment is counted; files that are not the segment,
+// as a reused file descriptor would be, are not mapped or not used
+int main( int argc, char *argv[] ) {
+	if ( ( argc == 4 ) && ( std::string( argv[1] ) == CLIENT_ARG ) ) {
+		GroupStats::attach();
+		ThreadStats stats;
+		stats.calls = strtoul( argv[2], nullptr, 10 );
+		GroupStats::add( stats );
+		GroupStats::on_exit();
+		if ( std::string( argv[3] ) == "report" ) {
+			GroupStats::report();
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// Start gathering statistics
+	char path[] = "/tmp/group_stats_test.XXXXXX";
+	const int file = mkstemp( path );
+	CHECK( file != -1 );
+	close( file );
+	GroupStats::create();
+	GroupStats::enable( path );
+	const int fd = atoi( getenv( DR_SS_ENV_STATS_FD ) );
+
+	// Run a client with the segment, one with a copy of it that is not sealed, one with
+	// a sealed copy that lacks the magic number, and one with a closed descriptor
+	// Each copy names the statistics file, so a client that used one would report to it
+	run_client( fd, 5, false );
+	const int unsealed = fake_segment( fd, false, true );
+	run_client( unsealed, 7, true );
+	const int sealed = fake_segment( fd, true, false );
+	run_client( sealed, 11, true );
+	run_client( 1000, 13, true );
+	close( unsealed );
+	close( sealed );
+
+	// Only the first client was counted, and only the launcher reported
+	GroupStats::report();
+	std::ifstream in( path );
+	std::string line, extra;
+	CHECK( std::getline( in, line ) );
+	CHECK( !std::getline( in, extra ) );
+	CHECK( line.find( "\"total\":{\"calls\":5," ) != std::string::npos );
+	CHECK( line.find( "\"images\":1," ) != std::string::npos );
+	CHECK( line.find( "\"images\":2," ) == std::string::npos );
+	unlink( path );
+	return CHECK_RESULT();
+}
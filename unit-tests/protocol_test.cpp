@@ -0,0 +1,168 @@
+#include "check.hpp"
+#include "protocol.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+
+// Encodes a Call then a Ret frame for each address, relative to prev
+// Returns the frames, one after another
+static std::vector<char> encode_all( const std::vector<uint64_t> &addrs,
+                                    uint64_t &prev ) {
+	std::vector<char> out;
+	for ( const uint64_t a : addrs ) {
+		char frame[MAX_FRAME_SIZE];
+		const size_t n = Protocol::encode( frame, Protocol::CALL, a, prev );
+		CHECK( ( n >= 2 ) && ( n <= MAX_FRAME_SIZE ) );
+		out.insert( out.end(), frame, &frame[n] );
+	}
+	return out;
+}
+
+// Decodes every frame in buffer relative to prev, which must all be Calls
+static std::vector<uint64_t> decode_all( const std::vector<char> &buffer,
+                                        uint64_t &prev ) {
+	std::vector<uint64_t> out;
+	size_t at = 0;
+	while ( at < buffer.size() ) {
+		CHECK( buffer[at] == (char) Protocol::CALL );
+		uint64_t addr = 0;
+		const int n = Protocol::decode_address( &buffer[at + 1], buffer.size() - at - 1,
+		                                        addr, prev );
+		CHECK( n > 0 );
+		if ( n <= 0 ) {
+			break;
+		}
+		out.push_back( addr );
+		at += 1 + (size_t) n;
+	}
+	return out;
+}
+
+// Every address survives a round trip, whatever the size and sign of its delta
+static void round_trip() {
+	const std::vector<uint64_t> addrs = {
+		0x400000,           0x400005,       0x3ffff0, 0x7fffffffe000, 0, 1,
+		0xffffffffffffffff, 0x8000000000000000, 0x400000
+	};
+	uint64_t enc_prev = 0;
+	uint64_t dec_prev = 0;
+	const std::vector<char> buffer = encode_all( addrs, enc_prev );
+	CHECK( decode_all( buffer, dec_prev ) == addrs );
+	CHECK( enc_prev == dec_prev );
+}
+
+// Small deltas take one byte; the largest take the whole frame
+static void frame_sizes() {
+	char frame[MAX_FRAME_SIZE];
+	uint64_t prev = 1000;
+	CHECK( Protocol::encode( frame, Protocol::RET, 1010, prev ) == 2 );
+	CHECK( prev == 1010 );
+	CHECK( Protocol::encode( frame, Protocol::RET, 1000, prev ) == 2 );
+	prev = 0;
+	CHECK( Protocol::encode( frame, Protocol::RET, 0x8000000000000000, prev ) ==
+	       MAX_FRAME_SIZE );
+	CHECK( Protocol::encode( frame, Protocol::NEW_SIGNAL ) == 1 );
+}
+
+// A varint cut short is incomplete, and one longer than 64 bits is malformed
+static void partial_and_malformed() {
+	char frame[MAX_FRAME_SIZE];
+	uint64_t prev = 0;
+	const size_t n = Protocol::encode( frame, Protocol::CALL, 0x7fffffffe000, prev );
+	uint64_t addr = 0;
+	uint64_t base = 0;
+	for ( size_t len = 0; len < n - 1; ++len ) {
+		CHECK( Protocol::decode_address( &frame[1], len, addr, base ) == 0 );
+	}
+	CHECK( base == 0 );
+	const char too_long[MAX_FRAME_SIZE + 1] = { '\x80', '\x80', '\x80', '\x80',
+		                                        '\x80', '\x80', '\x80', '\x80',
+		                                        '\x80', '\x80', '\x80', '\x01' };
+	CHECK( Protocol::decode_address( too_long, sizeof( too_long ), addr, base ) == -1 );
+}
+
+// Each channel has its own base, on both sides, so channels that are interleaved
+// decode the same as channels sent alone
+static void channels_keep_their_own_base() {
+	const std::vector<uint64_t> a = { 0x400100, 0x400200, 0x400150 };
+	const std::vector<uint64_t> b = { 0x7f0000001000, 0x7f0000002000, 0x7f0000000800 };
+	uint64_t enc_a = 0;
+	uint64_t enc_b = 0;
+	uint64_t dec_a = 0;
+	uint64_t dec_b = 0;
+	for ( size_t i = 0; i < a.size(); ++i ) {
+		const std::vector<char> fa = encode_all( { a[i] }, enc_a );
+		const std::vector<char> fb = encode_all( { b[i] }, enc_b );
+		CHECK( decode_all( fb, dec_b ) == std::vector<uint64_t>{ b[i] } );
+		CHECK( decode_all( fa, dec_a ) == std::vector<uint64_t>{ a[i] } );
+	}
+
+	// A base shared by both channels decodes the other channel's frames wrongly
+	uint64_t enc = 0;
+	uint64_t shared = 0;
+	const std::vector<char> fa = encode_all( a, enc );
+	enc = 0;
+	const std::vector<char> fb = encode_all( b, enc );
+	CHECK( decode_all( fa, shared ) == a );
+	CHECK( decode_all( fb, shared ) != b );
+}
+
+// v1 headers map to the opcodes v2 frames use
+static void v1_opcodes() {
+	CHECK( Protocol::opcode_of<Message::Call>() == Protocol::CALL );
+	CHECK( Protocol::opcode_of<Message::Ret>() == Protocol::RET );
+	CHECK( Protocol::opcode_of<Message::Execve>() == Protocol::EXECVE );
+	CHECK( Protocol::from_v1( "????" ) == Protocol::NUM_OPCODES );
+	CHECK( Protocol::has_address( Protocol::CALL ) );
+	CHECK( !Protocol::has_address( Protocol::FORK ) );
+	CHECK( Protocol::has_body( Protocol::FORK ) );
+	CHECK( !Protocol::has_body( Protocol::EXECVE ) );
+	CHECK( Protocol::opcode_of<Message::ForkFailed>() == Protocol::FORK_FAILED );
+	CHECK( Protocol::has_body( Protocol::FORK_FAILED ) );
+	CHECK( Protocol::opcode_of<Message::Digest>() == Protocol::DIGEST );
+	CHECK( Protocol::has_body( Protocol::DIGEST ) );
+}
+
+// v1 bodies are little-endian whatever the host's byte order
+static void v1_bodies() {
+	const uintptr_t addr = 0x0102030405060708;
+	Message::Call call( (const char *) &addr );
+	CHECK( Message::body_of( call.message ) == addr );
+	const unsigned char *const body =
+	    (const unsigned char *) &call.message[MESSAGE_HEADER_LENGTH];
+	for ( size_t i = 0; i < POINTER_SIZE; ++i ) {
+		CHECK( body[i] == (unsigned char) ( addr >> ( 8 * i ) ) );
+	}
+	CHECK( Message::wire_order( Message::wire_order( addr ) ) == addr );
+}
+
+// Each message is received into the buffer its caller gave, so an earlier message is
+// not overwritten by a later one
+static void receive_into_own_buffers() {
+	int socks[2];
+	CHECK( socketpair( AF_UNIX, SOCK_STREAM, 0, socks ) == 0 );
+	const uintptr_t v1 = PROTOCOL_V1, v2 = PROTOCOL_V2;
+	send_msg<Message::Hello>( socks[0], (const char *) &v1 );
+	send_msg<Message::Hello>( socks[0], (const char *) &v2 );
+	char first[Message::Hello::size], second[Message::Hello::size];
+	recv_msg_and_body<Message::Hello>( socks[1], first );
+	recv_msg_and_body<Message::Hello>( socks[1], second );
+	CHECK( Message::body_of( first ) == PROTOCOL_V1 );
+	CHECK( Message::body_of( second ) == PROTOCOL_V2 );
+	close( socks[0] );
+	close( socks[1] );
+}
+
+// Main function
+int main() {
+	round_trip();
+	frame_sizes();
+	partial_and_malformed();
+	channels_keep_their_own_base();
+	v1_opcodes();
+	v1_bodies();
+	receive_into_own_buffers();
+	return CHECK_RESULT();
+}
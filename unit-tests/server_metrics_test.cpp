@@ -0,0 +1,73 @@
+#include "check.hpp"
+#include "server_metrics.hpp"
+
+#include <math.h>
+
+
+// Returns true if the latencies a and b, in seconds, are within a picosecond
+static bool near( const double a, const double b ) { return fabs( a - b ) < 1e-12; }
+
+// The floor of each bucket falls in that bucket, and floors increase
+static void floors() {
+	for ( unsigned int b = 0; b < METRICS_LATENCY_BUCKETS; ++b ) {
+		CHECK( ClientMetrics::latency_bucket( ServerMetrics::bucket_floor( b ) ) == b );
+		if ( b > 0 ) {
+			CHECK( ServerMetrics::bucket_floor( b ) >
+			       ServerMetrics::bucket_floor( b - 1 ) );
+		}
+	}
+	CHECK( ServerMetrics::bucket_floor( 4 ) == 4 );
+	CHECK( ServerMetrics::bucket_floor( 9 ) == 10 );
+	CHECK( ServerMetrics::bucket_floor( 13 ) == 20 );
+}
+
+// A latency falls in the bucket whose floor is the greatest at most it, so a bucket's
+// width is at most a quarter of its floor. Latencies past the last floor fall in it
+static void buckets() {
+	for ( unsigned long latency = 0; latency < ( 1ul << 42 );
+	      latency = latency * 3 / 2 + 1 ) {
+		const unsigned int b = ClientMetrics::latency_bucket( latency );
+		CHECK( ServerMetrics::bucket_floor( b ) <= latency );
+		if ( b + 1 < METRICS_LATENCY_BUCKETS ) {
+			CHECK( latency < ServerMetrics::bucket_floor( b + 1 ) );
+		}
+		else {
+			CHECK( latency >= ( 7ul << 38 ) );
+		}
+	}
+	CHECK( ClientMetrics::latency_bucket( ~0ul ) == METRICS_LATENCY_BUCKETS - 1 );
+}
+
+// Quantiles are interpolated within their bucket, in seconds
+static void quantiles() {
+	unsigned long histogram[METRICS_LATENCY_BUCKETS] = {};
+	CHECK( ServerMetrics::quantile( histogram, 0, 0.5 ) == 0 );
+
+	// 2 latencies in [4, 5) ns
+	histogram[4] = 2;
+	CHECK( near( ServerMetrics::quantile( histogram, 2, 0.5 ), 4.5e-9 ) );
+	CHECK( near( ServerMetrics::quantile( histogram, 2, 1 ), 5e-9 ) );
+
+	// 1 latency in [8, 10) ns and 3 in [16, 20) ns
+	histogram[4] = 0;
+	histogram[8] = 1;
+	histogram[12] = 3;
+	CHECK( near( ServerMetrics::quantile( histogram, 4, 0.25 ), 10e-9 ) );
+	CHECK( near( ServerMetrics::quantile( histogram, 4, 0.5 ),
+	             ( 16 + 4.0 / 3 ) * 1e-9 ) );
+	CHECK( near( ServerMetrics::quantile( histogram, 4, 1 ), 20e-9 ) );
+
+	// The last bucket has no upper bound, so it reports its floor
+	histogram[METRICS_LATENCY_BUCKETS - 1] = 4;
+	const double last =
+	    (double) ServerMetrics::bucket_floor( METRICS_LATENCY_BUCKETS - 1 ) / 1e9;
+	CHECK( near( ServerMetrics::quantile( histogram, 8, 0.9 ), last ) );
+}
+
+// Main function
+int main() {
+	floors();
+	buckets();
+	quantiles();
+	return CHECK_RESULT();
+}
@@ -0,0 +1,113 @@
+#include "check.hpp"
+#include "shm_ring.hpp"
+
+#include <unistd.h>
+#include <time.h>
+#include <thread>
+
+
+// The number of messages the producer pushes in ping_pong
+#define PUSHES 20000
+
+// How long the consumer polls an empty ring before parking it in ping_pong, in ns
+#define SPIN_NS 1000000
+
+// Returns a new ring. The file it is stored in is closed, which leaves it mapped
+static ShmRing *new_ring() {
+	const int fd = ShmRing::create();
+	ShmRing *const ring = new ShmRing( fd );
+	close( fd );
+	return ring;
+}
+
+// Returns the time, in nanoseconds
+static unsigned long now_ns() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long) ts.tv_sec * 1000000000ul + (unsigned long) ts.tv_nsec;
+}
+
+// A ring is only parked once it was found empty spin_ns before, and a pop restarts
+// that wait. Only the first push onto a parked ring needs the doorbell
+static void park() {
+	ShmRing *const ring = new_ring();
+	char msg[MESSAGE_SIZE] = {};
+	char out[MESSAGE_SIZE];
+	CHECK( !ring->pop( out ) );
+
+	// Polled while found empty for less than spin_ns, never parked while not empty
+	CHECK( !ring->park( 1000, 50 ) );
+	CHECK( !ring->park( 1049, 50 ) );
+	CHECK( !ring->push( msg ) );
+	CHECK( !ring->park( 1060, 50 ) );
+	CHECK( ring->pop( out ) );
+	CHECK( !ring->park( 1070, 50 ) );
+	CHECK( !ring->park( 1119, 50 ) );
+	CHECK( ring->park( 1120, 50 ) );
+	CHECK( ring->push( msg ) );
+	CHECK( !ring->push( msg ) );
+
+	// A ring that is not polled parks as soon as it is empty
+	CHECK( !ring->park( 1200, 0 ) );
+	CHECK( ring->pop( out ) );
+	CHECK( ring->pop( out ) );
+	CHECK( ring->park( 1300, 0 ) );
+	delete ring;
+}
+
+// A producer pushes PUSHES messages, each once the previous one was acknowledged, as a
+// client does its rets. The consumer parks the ring once it has found it empty for
+// spin_ns, then waits for the doorbell, a byte on a pipe
+// Returns the number of times the doorbell was rung
+static unsigned long ping_pong( const unsigned long spin_ns ) {
+	ShmRing *const ring = new_ring();
+	int bell[2];
+	CHECK( pipe( bell ) == 0 );
+	unsigned long rung = 0;
+	std::thread producer( [&]() {
+		char msg[MESSAGE_SIZE] = {};
+		for ( uint32_t i = 1; i <= PUSHES; ++i ) {
+			if ( ring->push( msg ) ) {
+				++rung;
+				CHECK( write( bell[1], "", 1 ) == 1 );
+			}
+			ring->wait_for_acks( i );
+		}
+	} );
+	char msg[MESSAGE_SIZE];
+	uint32_t popped = 0;
+	while ( popped < PUSHES ) {
+		uint32_t n = 0;
+		while ( ring->pop( msg ) ) {
+			++n;
+		}
+		ring->ack( n );
+		popped += n;
+		char byte;
+		if ( ( popped < PUSHES ) && ring->park( now_ns(), spin_ns ) ) {
+			CHECK( read( bell[0], &byte, 1 ) == 1 );
+		}
+	}
+	producer.join();
+	close( bell[0] );
+	close( bell[1] );
+	delete ring;
+	return rung;
+}
+
+// Main function
+// Polling an empty ring for a while before parking it lets most pushes skip the doorbell
+int main() {
+	park();
+	if ( std::thread::hardware_concurrency() < 2 ) {
+		std::cout << "Skipping ping_pong, which needs a cpu for each side\n";
+		return CHECK_RESULT();
+	}
+	const unsigned long at_once = ping_pong( 0 );
+	const unsigned long polled = ping_pong( SPIN_NS );
+	std::cout << "Doorbells rung for " << PUSHES << " pushes: " << at_once
+	          << " parking at once, " << polled << " polling for " << SPIN_NS
+	          << " ns first\n";
+	CHECK( polled * 100 <= PUSHES );
+	return CHECK_RESULT();
+}
@@ -0,0 +1,113 @@
+#include "check.hpp"
+#include "thread_stats.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+
+
+// A thread that did nothing has zero counters and an empty histogram
+static void empty() {
+	const ThreadStats stats;
+	CHECK( stats.average_depth() == 0 );
+	CHECK( stats.to_json() == "{\"calls\":0,\"rets\":0,\"wildcard_pushes\":0,"
+	                          "\"wildcard_pops\":0,\"execve_clears\":0,\"max_depth\":0,"
+	                          "\"average_depth\":0,\"depth_histogram\":[]}" );
+}
+
+// Depths fall in the bucket of their power of two, 0 and 1 sharing the first, and
+// every depth past the last bucket falls in it
+static void depth_buckets() {
+	ThreadStats stats;
+	for ( const unsigned long depth : { 0ul, 1ul, 2ul, 3ul, 4ul, 7ul, 8ul } ) {
+		stats.note_depth( depth );
+	}
+	CHECK( stats.depth_histogram[0] == 2 );
+	CHECK( stats.depth_histogram[1] == 2 );
+	CHECK( stats.depth_histogram[2] == 2 );
+	CHECK( stats.depth_histogram[3] == 1 );
+	CHECK( stats.max_depth == 8 );
+	CHECK( stats.depth_total == 25 );
+	stats.note_depth( 1ul << 40 );
+	CHECK( stats.depth_histogram[STATS_DEPTH_BUCKETS - 1] == 1 );
+}
+
+// Every counter is written, and trailing empty buckets are not
+static void json() {
+	ThreadStats stats;
+	stats.calls = 3;
+	stats.rets = 2;
+	stats.wildcard_pushes = 1;
+	stats.wildcard_pops = 1;
+	stats.execve_clears = 1;
+	stats.note_depth( 1 );
+	stats.note_depth( 2 );
+	stats.note_depth( 5 );
+	stats.note_depth( 4 );
+	CHECK( stats.average_depth() == 3 );
+	CHECK( stats.to_json() == "{\"calls\":3,\"rets\":2,\"wildcard_pushes\":1,"
+	                          "\"wildcard_pops\":1,\"execve_clears\":1,\"max_depth\":5,"
+	                          "\"average_depth\":3,\"depth_histogram\":[1,1,2]}" );
+}
+
+// Adding sums every counter but the deepest depth, which is the deepest of either
+static void add() {
+	ThreadStats a, b;
+	a.calls = 1;
+	a.note_depth( 9 );
+	b.calls = 2;
+	b.rets = 4;
+	b.execve_clears = 1;
+	b.note_depth( 3 );
+	a.add( b );
+	CHECK( a.calls == 3 );
+	CHECK( a.rets == 4 );
+	CHECK( a.execve_clears == 1 );
+	CHECK( a.max_depth == 9 );
+	CHECK( a.depth_total == 12 );
+	CHECK( a.depth_histogram[1] == 1 );
+	CHECK( a.depth_histogram[3] == 1 );
+	CHECK( a.average_depth() == 4 );
+}
+
+// A line holds the counters of each thread and their total, and lines are appended
+static void append() {
+	char path[] = "/tmp/thread_stats_test.XXXXXX";
+	const int fd = mkstemp( path );
+	CHECK( fd != -1 );
+	if ( fd == -1 ) {
+		return;
+	}
+	close( fd );
+	ThreadStats a, b;
+	a.calls = 1;
+	b.rets = 2;
+	const Stats::ThreadList threads = { { 7, a }, { 8, b } };
+	Stats::append_json( path, "test", threads );
+	Stats::append_json( path, "test", Stats::ThreadList() );
+	std::ifstream file( path );
+	std::string first, second, third;
+	CHECK( std::getline( file, first ) );
+	CHECK( std::getline( file, second ) );
+	CHECK( !std::getline( file, third ) );
+	const std::string pid = std::to_string( getpid() );
+	CHECK( first == "{\"source\":\"test\",\"pid\":" + pid + ",\"threads\":[{\"tid\":7," +
+	                    a.to_json().substr( 1 ) + ",{\"tid\":8," +
+	                    b.to_json().substr( 1 ) + "],\"total\":{\"calls\":1,\"rets\":2,"
+	                    "\"wildcard_pushes\":0,\"wildcard_pops\":0,\"execve_clears\":0,"
+	                    "\"max_depth\":0,\"average_depth\":0,\"depth_histogram\":[]}}" );
+	CHECK( second == "{\"source\":\"test\",\"pid\":" + pid +
+	                     ",\"threads\":[],\"total\":" + ThreadStats().to_json() + "}" );
+	unlink( path );
+}
+
+// Main function
+int main() {
+	empty();
+	depth_buckets();
+	json();
+	add();
+	append();
+	return CHECK_RESULT();
+}